@@ -16,6 +16,10 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#if defined (__linux__) && ! defined (_GNU_SOURCE)
+#define _GNU_SOURCE /* sched_getaffinity() */
+#endif
+
 #include "config.h"
 
 #include <libheif/heif.h>
@@ -23,17 +27,45 @@
 #include <gexiv2/gexiv2.h>
 #include <sys/time.h>
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined (ARCH_X86) && defined (__GNUC__)
+#define HEIFPLUGIN_X86_INTRINSICS 1
+#if defined (__clang__) || __GNUC__ >= 5
+#define HEIFPLUGIN_COMPILE_AVX2 1
+#endif
+#include <immintrin.h>
+#endif
+
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
 
+#ifdef G_OS_UNIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#endif
+
 #include "libgimp/stdplugins-intl.h"
 
 
-#define LOAD_PROC      "file-heif-load"
-#define LOAD_PROC_AV1  "file-heif-av1-load"
-#define SAVE_PROC      "file-heif-save"
-#define SAVE_PROC_AV1  "file-heif-av1-save"
-#define PLUG_IN_BINARY "file-heif"
+#define LOAD_PROC           "file-heif-load"
+#define LOAD_PROC_AV1       "file-heif-av1-load"
+#define LOAD_REGION_PROC    "file-heif-load-region"
+#define LOAD_THUMB_PROC     "file-heif-load-thumb"
+#define LOAD_LAYERS_PROC    "file-heif-load-layers"
+#define LOAD_FILES_PROC     "file-heif-load-files"
+#define SAVE_PROC           "file-heif-save"
+#define SAVE_PROC_AV1       "file-heif-av1-save"
+#define SAVE_FILES_PROC     "file-heif-save-files"
+#define SAVE_FILES_PROC_AV1 "file-heif-av1-save-files"
+#define EXTENSION_PROC      "extension-heif"
+#define RESIDENT_SUFFIX     "-resident"
+#define PLUG_IN_BINARY      "file-heif"
 
 typedef struct
 {
@@ -56,6 +88,36 @@ typedef enum _HeifpluginExportFormat
   HEIFPLUGIN_EXPORT_FORMAT_YUV420 = 3
 } HeifpluginExportFormat;
 
+typedef struct _HeifpluginInput
+{
+  GMappedFile  *mapped_file; /* native files, mapped read-only */
+  GInputStream *stream;      /* seekable remote files, read on demand */
+  guchar       *file_buffer; /* whole-file copy for all other files */
+  goffset       file_size;
+  guint64       bytes_read;
+} HeifpluginInput;
+
+typedef struct _HeifpluginLoadOptions
+{
+  gboolean      use_region;
+  GeglRectangle region;      /* part of the image to load */
+} HeifpluginLoadOptions;
+
+typedef struct _HeifpluginSaveOptions
+{
+  gboolean               lossless;
+  gint                   quality;
+  gboolean               save_profile;
+  gint                   save_bit_depth;
+  HeifpluginExportFormat pixel_format;
+  HeifpluginEncoderSpeed encoder_speed;
+  gboolean               save_exif;
+  gboolean               save_xmp;
+  gint                   tile_rows;  /* AV1 only, 0 for automatic */
+  gint                   tile_cols;  /* AV1 only, 0 for automatic */
+  gboolean               row_mt;     /* AV1 only */
+} HeifpluginSaveOptions;
+
 typedef struct _Heif      Heif;
 typedef struct _HeifClass HeifClass;
 
@@ -70,20 +132,39 @@ struct _HeifClass
 };
 
 
-#define HEIF_TYPE  (heif_get_type ())
+#define HEIF_TYPE  (heif_plug_in_get_type ())
 #define HEIF (obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), HEIF_TYPE, Heif))
 
-GType                   heif_get_type         (void) G_GNUC_CONST;
+GType                   heif_plug_in_get_type (void) G_GNUC_CONST;
 
 static GList          * heif_init_procedures  (GimpPlugIn           *plug_in);
+static void             heif_quit             (GimpPlugIn           *plug_in);
 static GimpProcedure  * heif_create_procedure (GimpPlugIn           *plug_in,
                                                const gchar          *name);
 
+static GimpValueArray * heif_extension        (GimpProcedure        *procedure,
+                                               const GimpValueArray *args,
+                                               gpointer              run_data);
+
 static GimpValueArray * heif_load             (GimpProcedure        *procedure,
                                                GimpRunMode           run_mode,
                                                GFile                *file,
                                                const GimpValueArray *args,
                                                gpointer              run_data);
+static GimpValueArray * heif_load_thumb       (GimpProcedure        *procedure,
+                                               GFile                *file,
+                                               gint                  size,
+                                               const GimpValueArray *args,
+                                               gpointer              run_data);
+static GimpValueArray * heif_load_region      (GimpProcedure        *procedure,
+                                               const GimpValueArray *args,
+                                               gpointer              run_data);
+static GimpValueArray * heif_load_layers      (GimpProcedure        *procedure,
+                                               const GimpValueArray *args,
+                                               gpointer              run_data);
+static GimpValueArray * heif_load_files       (GimpProcedure        *procedure,
+                                               const GimpValueArray *args,
+                                               gpointer              run_data);
 static GimpValueArray * heif_save             (GimpProcedure        *procedure,
                                                GimpRunMode           run_mode,
                                                GimpImage            *image,
@@ -92,6 +173,9 @@ static GimpValueArray * heif_save             (GimpProcedure        *procedure,
                                                GFile                *file,
                                                const GimpValueArray *args,
                                                gpointer              run_data);
+static GimpValueArray * heif_save_files       (GimpProcedure        *procedure,
+                                               const GimpValueArray *args,
+                                               gpointer              run_data);
 
 #if LIBHEIF_HAVE_VERSION(1,8,0)
 static GimpValueArray * heif_av1_save         (GimpProcedure        *procedure,
@@ -104,10 +188,31 @@ static GimpValueArray * heif_av1_save         (GimpProcedure        *procedure,
                                                gpointer              run_data);
 #endif
 
-static GimpImage      * load_image            (GFile               *file,
-                                               gboolean             interactive,
-                                               GimpPDBStatusType    *status,
-                                               GError              **error);
+static GimpImage      * load_image            (GFile                       *file,
+                                               gboolean                     interactive,
+                                               const HeifpluginLoadOptions *options,
+                                               GimpPDBStatusType           *status,
+                                               GError                     **error);
+static GimpImage      * load_layers_image     (GFile                       *file,
+                                               const gint32                *ids,
+                                               gint                         n_ids,
+                                               gboolean                     load_metadata,
+                                               GError                     **error);
+static void             load_files            (GFile                      **files,
+                                               gint                         n_files,
+                                               gint                         max_jobs,
+                                               gint                         max_decode_threads,
+                                               GimpImage                  **images,
+                                               GError                     **errors);
+static GimpImage      * load_thumbnail_image  (GFile                       *file,
+                                               gint                         size,
+                                               gint                        *width,
+                                               gint                        *height,
+                                               GimpImageType               *type,
+                                               GError                     **error);
+static void             heifplugin_save_options_init
+                                              (HeifpluginSaveOptions        *options,
+                                               GObject                      *config);
 static gboolean         save_image            (GFile                        *file,
                                                GimpImage                    *image,
                                                GimpDrawable                 *drawable,
@@ -115,71 +220,204 @@ static gboolean         save_image            (GFile                        *fil
                                                GError                      **error,
                                                enum heif_compression_format  compression,
                                                GimpMetadata                 *metadata);
-
-static gboolean         load_dialog           (struct heif_context  *heif,
-                                               uint32_t             *selected_image);
+static gboolean         save_files            (GFile                        **files,
+                                               GimpImage                    **images,
+                                               GimpDrawable                 **drawables,
+                                               gint                           n_files,
+                                               gint                           max_jobs,
+                                               const HeifpluginSaveOptions   *options,
+                                               enum heif_compression_format   compression,
+                                               GError                       **errors,
+                                               GError                       **error);
+
+static void             heifplugin_set_thread_budget
+                                              (gint                  max_threads);
+static void             heifplugin_release_thread_budget
+                                              (void);
+
+static gboolean         load_dialog           (struct heif_context   *heif,
+                                               const HeifpluginInput *input,
+                                               uint32_t              *selected_image);
 static gboolean         save_dialog           (GimpProcedure        *procedure,
                                                GObject              *config,
                                                GimpImage            *image);
 
 
-G_DEFINE_TYPE (Heif, heif, GIMP_TYPE_PLUG_IN)
+G_DEFINE_TYPE (Heif, heif_plug_in, GIMP_TYPE_PLUG_IN)
 
 GIMP_MAIN (HEIF_TYPE)
 
 
 static void
-heif_class_init (HeifClass *klass)
+heif_plug_in_class_init (HeifClass *klass)
 {
   GimpPlugInClass *plug_in_class = GIMP_PLUG_IN_CLASS (klass);
 
   plug_in_class->init_procedures  = heif_init_procedures;
   plug_in_class->create_procedure = heif_create_procedure;
+  plug_in_class->quit             = heif_quit;
+}
+
+static void
+heif_plug_in_init (Heif *heif)
+{
+}
+
+/*  libheif initialization  */
+
+static gboolean libheif_initialized = FALSE;
+
+/* Initialize libheif once per process. Since 1.13 this is where libheif
+ * scans its plug-in directory and loads the codec plug-ins, which is
+ * otherwise done implicitly on first use.
+ */
+static void
+heifplugin_init_libheif (void)
+{
+  gint64 start;
+
+  if (libheif_initialized)
+    return;
+
+  libheif_initialized = TRUE;
+
+  start = g_get_monotonic_time ();
+
+#if LIBHEIF_HAVE_VERSION(1,13,0)
+  {
+    struct heif_error err = heif_init (NULL);
+
+    if (err.code != 0)
+      g_printerr ("Failed to initialize libheif: %s\n", err.message);
+  }
+#endif
+
+  g_debug ("libheif %s initialized in %.3f ms",
+           heif_get_version (),
+           (g_get_monotonic_time () - start) / 1000.0);
+}
+
+typedef enum
+{
+  HEIFPLUGIN_CODEC_UNKNOWN = 0,
+  HEIFPLUGIN_CODEC_MISSING,
+  HEIFPLUGIN_CODEC_AVAILABLE
+} HeifpluginCodecState;
+
+/* Whether libheif has a decoder (or an encoder) for compression. Each
+ * probe is run the first time it is asked for and then cached, so a
+ * call only ever looks up the codecs it needs.
+ */
+static gboolean
+heifplugin_have_codec (enum heif_compression_format compression,
+                       gboolean                     encoder)
+{
+  static HeifpluginCodecState states[2][2] = { { 0, }, };
+  gint                        format;
+
+  format = (compression == heif_compression_HEVC ? 0 : 1);
+
+  if (states[format][encoder] == HEIFPLUGIN_CODEC_UNKNOWN)
+    {
+      gboolean available;
+      gint64   start;
+
+      heifplugin_init_libheif ();
+
+      start = g_get_monotonic_time ();
+
+      if (encoder)
+        available = heif_have_encoder_for_format (compression);
+      else
+        available = heif_have_decoder_for_format (compression);
+
+      states[format][encoder] = (available ?
+                                 HEIFPLUGIN_CODEC_AVAILABLE :
+                                 HEIFPLUGIN_CODEC_MISSING);
+
+      g_debug ("%s %s: %s (probed in %.3f ms)",
+               format == 0 ? "HEVC" : "AV1",
+               encoder ? "encoder" : "decoder",
+               available ? "available" : "missing",
+               (g_get_monotonic_time () - start) / 1000.0);
+    }
+
+  return states[format][encoder] == HEIFPLUGIN_CODEC_AVAILABLE;
 }
 
 static void
-heif_init (Heif *heif)
+heif_quit (GimpPlugIn *plug_in)
 {
+#if LIBHEIF_HAVE_VERSION(1,13,0)
+  if (libheif_initialized)
+    heif_deinit ();
+#endif
+
+  libheif_initialized = FALSE;
 }
 
 static GList *
 heif_init_procedures (GimpPlugIn *plug_in)
 {
-  GList *list = NULL;
+  GList  *list  = NULL;
+  gint64  start = g_get_monotonic_time ();
 
-  if (heif_have_decoder_for_format (heif_compression_HEVC))
+  if (heifplugin_have_codec (heif_compression_HEVC, FALSE))
     {
       list = g_list_append (list, g_strdup (LOAD_PROC));
+      list = g_list_append (list, g_strdup (LOAD_REGION_PROC));
+      list = g_list_append (list, g_strdup (LOAD_THUMB_PROC));
+      list = g_list_append (list, g_strdup (LOAD_LAYERS_PROC));
+      list = g_list_append (list, g_strdup (LOAD_FILES_PROC));
     }
 
-  if (heif_have_encoder_for_format (heif_compression_HEVC))
+  if (heifplugin_have_codec (heif_compression_HEVC, TRUE))
     {
       list = g_list_append (list, g_strdup (SAVE_PROC));
+      list = g_list_append (list, g_strdup (SAVE_FILES_PROC));
     }
 #if LIBHEIF_HAVE_VERSION(1,8,0)
-  if (heif_have_decoder_for_format (heif_compression_AV1))
+  if (heifplugin_have_codec (heif_compression_AV1, FALSE))
     {
       list = g_list_append (list, g_strdup (LOAD_PROC_AV1));
+
+      if (! heifplugin_have_codec (heif_compression_HEVC, FALSE))
+        {
+          list = g_list_append (list, g_strdup (LOAD_REGION_PROC));
+          list = g_list_append (list, g_strdup (LOAD_THUMB_PROC));
+          list = g_list_append (list, g_strdup (LOAD_LAYERS_PROC));
+          list = g_list_append (list, g_strdup (LOAD_FILES_PROC));
+        }
     }
 
-  if (heif_have_encoder_for_format (heif_compression_AV1))
+  if (heifplugin_have_codec (heif_compression_AV1, TRUE))
     {
       list = g_list_append (list, g_strdup (SAVE_PROC_AV1));
+      list = g_list_append (list, g_strdup (SAVE_FILES_PROC_AV1));
     }
 #endif
+
+  if (list)
+    list = g_list_append (list, g_strdup (EXTENSION_PROC));
+
+  g_debug ("%s: %u procedures in %.3f ms", G_STRFUNC, g_list_length (list),
+           (g_get_monotonic_time () - start) / 1000.0);
+
   return list;
 }
 
 static GimpProcedure *
-heif_create_procedure (GimpPlugIn  *plug_in,
-                       const gchar *name)
+heif_create_procedure_full (GimpPlugIn      *plug_in,
+                            const gchar     *name,
+                            const gchar     *proc_name,
+                            GimpPDBProcType  proc_type)
 {
   GimpProcedure *procedure = NULL;
 
   if (! strcmp (name, LOAD_PROC))
     {
-      procedure = gimp_load_procedure_new (plug_in, name,
-                                           GIMP_PDB_PROC_TYPE_PLUGIN,
+      procedure = gimp_load_procedure_new (plug_in, proc_name,
+                                           proc_type,
                                            heif_load, NULL, NULL);
 
       gimp_procedure_set_menu_label (procedure, N_("HEIF/HEIC"));
@@ -203,6 +441,9 @@ heif_create_procedure (GimpPlugIn  *plug_in,
       gimp_file_procedure_set_extensions (GIMP_FILE_PROCEDURE (procedure),
                                           "heif,heic");
 
+      gimp_load_procedure_set_thumbnail_loader (GIMP_LOAD_PROCEDURE (procedure),
+                                                LOAD_THUMB_PROC);
+
       /* HEIF is an ISOBMFF format whose "brand" (the value after "ftyp")
        * can be of various values.
        * See also: https://gitlab.gnome.org/GNOME/gimp/issues/2209
@@ -214,10 +455,231 @@ heif_create_procedure (GimpPlugIn  *plug_in,
                                       "4,string,ftyphevs,4,string,ftypmif1,"
                                       "4,string,ftypmsf1");
     }
+  else if (! strcmp (name, LOAD_THUMB_PROC))
+    {
+      procedure = gimp_thumbnail_procedure_new (plug_in, proc_name,
+                                                proc_type,
+                                                heif_load_thumb, NULL, NULL);
+
+      gimp_procedure_set_documentation (procedure,
+                                        _("Loads a thumbnail from a HEIF or AVIF image"),
+                                        _("Load the smallest embedded thumbnail "
+                                          "of at least the requested size, or a "
+                                          "downscaled version of the image if it "
+                                          "has no thumbnails."),
+                                        name);
+      gimp_procedure_set_attribution (procedure,
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "2022");
+    }
+  else if (! strcmp (name, LOAD_REGION_PROC))
+    {
+      procedure = gimp_procedure_new (plug_in, proc_name,
+                                      proc_type,
+                                      heif_load_region, NULL, NULL);
+
+      gimp_procedure_set_documentation (procedure,
+                                        _("Loads a region of a HEIF or AVIF image"),
+                                        _("Load a rectangular part of an image "
+                                          "stored in HEIF or AVIF format. For "
+                                          "images made of tiles, only the tiles "
+                                          "overlapping the region are decoded."),
+                                        name);
+      gimp_procedure_set_attribution (procedure,
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "2022");
+
+      GIMP_PROC_ARG_ENUM (procedure, "run-mode",
+                          "Run mode",
+                          "The run mode",
+                          GIMP_TYPE_RUN_MODE,
+                          GIMP_RUN_NONINTERACTIVE,
+                          G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_FILE (procedure, "file",
+                          "File",
+                          "The file to load",
+                          G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "x",
+                         "X",
+                         "X coordinate of the region",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "y",
+                         "Y",
+                         "Y coordinate of the region",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "width",
+                         "Width",
+                         "Width of the region",
+                         1, G_MAXINT, 1,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "height",
+                         "Height",
+                         "Height of the region",
+                         1, G_MAXINT, 1,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "max-threads",
+                         "Maximum threads",
+                         "Maximum number of threads to use, 0 for all "
+                         "processors available to the plug-in",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_VAL_IMAGE (procedure, "image",
+                           "Image",
+                           "Output image",
+                           FALSE,
+                           G_PARAM_READWRITE);
+    }
+  else if (! strcmp (name, LOAD_LAYERS_PROC))
+    {
+      procedure = gimp_procedure_new (plug_in, proc_name,
+                                      proc_type,
+                                      heif_load_layers, NULL, NULL);
+
+      gimp_procedure_set_documentation (procedure,
+                                        _("Loads several images of a HEIF or "
+                                          "AVIF file as layers"),
+                                        _("Load the top level images of a HEIF "
+                                          "or AVIF file, or the ones given by "
+                                          "their item IDs, as layers of a "
+                                          "single image. The file is only "
+                                          "parsed once and the images are "
+                                          "decoded in parallel."),
+                                        name);
+      gimp_procedure_set_attribution (procedure,
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "2022");
+
+      GIMP_PROC_ARG_ENUM (procedure, "run-mode",
+                          "Run mode",
+                          "The run mode",
+                          GIMP_TYPE_RUN_MODE,
+                          GIMP_RUN_NONINTERACTIVE,
+                          G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_FILE (procedure, "file",
+                          "File",
+                          "The file to load",
+                          G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "num-item-ids",
+                         "Number of item IDs",
+                         "Number of item IDs, 0 to load all top level images",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT32_ARRAY (procedure, "item-ids",
+                                 "Item IDs",
+                                 "IDs of the top level images to load",
+                                 G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_BOOLEAN (procedure, "load-metadata",
+                             "Load metadata",
+                             "Load the Exif and XMP metadata",
+                             TRUE,
+                             G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "max-threads",
+                         "Maximum threads",
+                         "Maximum number of threads to use, 0 for all "
+                         "processors available to the plug-in",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_VAL_IMAGE (procedure, "image",
+                           "Image",
+                           "Output image",
+                           FALSE,
+                           G_PARAM_READWRITE);
+    }
+  else if (! strcmp (name, LOAD_FILES_PROC))
+    {
+      procedure = gimp_procedure_new (plug_in, proc_name,
+                                      proc_type,
+                                      heif_load_files, NULL, NULL);
+
+      gimp_procedure_set_documentation (procedure,
+                                        _("Loads several HEIF or AVIF files"),
+                                        _("Load the primary images of a list "
+                                          "of HEIF or AVIF files, several of "
+                                          "them at the same time. Files which "
+                                          "fail to load are reported in "
+                                          "\"errors\" and don't stop the "
+                                          "others from loading."),
+                                        name);
+      gimp_procedure_set_attribution (procedure,
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "2022");
+
+      GIMP_PROC_ARG_ENUM (procedure, "run-mode",
+                          "Run mode",
+                          "The run mode",
+                          GIMP_TYPE_RUN_MODE,
+                          GIMP_RUN_NONINTERACTIVE,
+                          G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_STRV (procedure, "uris",
+                          "URIs",
+                          "The URIs of the files to load",
+                          G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "max-jobs",
+                         "Maximum jobs",
+                         "Maximum number of files loaded at the same "
+                         "time, 0 for one per processor",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "max-decode-threads",
+                         "Maximum decode threads",
+                         "Maximum number of threads decoding one file, "
+                         "0 to share the processors between the files "
+                         "loaded at the same time",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "max-threads",
+                         "Maximum threads",
+                         "Maximum number of threads to use, 0 for all "
+                         "processors available to the plug-in",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_VAL_INT (procedure, "num-images",
+                         "Number of images",
+                         "Number of loaded images",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_VAL_OBJECT_ARRAY (procedure, "images",
+                                  "Images",
+                                  "The loaded images, in the order of "
+                                  "their URIs",
+                                  GIMP_TYPE_IMAGE,
+                                  G_PARAM_READWRITE);
+
+      GIMP_PROC_VAL_STRV (procedure, "errors",
+                          "Errors",
+                          "One error message per URI, empty for the "
+                          "files which were loaded",
+                          G_PARAM_READWRITE);
+    }
   else if (! strcmp (name, SAVE_PROC))
     {
-      procedure = gimp_save_procedure_new (plug_in, name,
-                                           GIMP_PDB_PROC_TYPE_PLUGIN,
+      procedure = gimp_save_procedure_new (plug_in, proc_name,
+                                           proc_type,
                                            heif_save, NULL, NULL);
 
       gimp_procedure_set_image_types (procedure, "RGB*");
@@ -290,12 +752,210 @@ heif_create_procedure (GimpPlugIn  *plug_in,
                              "Toggle saving XMP data",
                              gimp_export_xmp (),
                              G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "max-threads",
+                         "Maximum threads",
+                         "Maximum number of threads to use, 0 for all "
+                         "processors available to the plug-in",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+    }
+  else if (! strcmp (name, SAVE_FILES_PROC) ||
+           ! strcmp (name, SAVE_FILES_PROC_AV1))
+    {
+      gboolean av1 = ! strcmp (name, SAVE_FILES_PROC_AV1);
+
+      procedure = gimp_procedure_new (plug_in, proc_name,
+                                      proc_type,
+                                      heif_save_files, NULL, NULL);
+
+      if (av1)
+        gimp_procedure_set_documentation (procedure,
+                                          _("Exports several AVIF images"),
+                                          _("Save a list of images in AV1 "
+                                            "Image File Format (AVIF), "
+                                            "several of them at the same "
+                                            "time. All images are saved "
+                                            "with the same settings."),
+                                          name);
+      else
+        gimp_procedure_set_documentation (procedure,
+                                          _("Exports several HEIF images"),
+                                          _("Save a list of images in HEIF "
+                                            "format (High Efficiency Image "
+                                            "File Format), several of them "
+                                            "at the same time. All images "
+                                            "are saved with the same "
+                                            "settings."),
+                                          name);
+
+      gimp_procedure_set_attribution (procedure,
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "2022");
+
+      GIMP_PROC_ARG_ENUM (procedure, "run-mode",
+                          "Run mode",
+                          "The run mode",
+                          GIMP_TYPE_RUN_MODE,
+                          GIMP_RUN_NONINTERACTIVE,
+                          G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "num-images",
+                         "Number of images",
+                         "Number of images to export",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_OBJECT_ARRAY (procedure, "images",
+                                  "Images",
+                                  "The images to export",
+                                  GIMP_TYPE_IMAGE,
+                                  G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "num-drawables",
+                         "Number of drawables",
+                         "Number of drawables, one per image",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_OBJECT_ARRAY (procedure, "drawables",
+                                  "Drawables",
+                                  "The RGB drawable to export of each image",
+                                  GIMP_TYPE_DRAWABLE,
+                                  G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_STRV (procedure, "uris",
+                          "URIs",
+                          "The URIs to export to, one per image",
+                          G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "max-jobs",
+                         "Maximum jobs",
+                         "Maximum number of images encoded at the same "
+                         "time, 0 for one per processor",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "quality",
+                         "Quality",
+                         "Quality factor (0 = worst, 100 = best)",
+                         0, 100, 50,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_BOOLEAN (procedure, "lossless",
+                             "Lossless",
+                             "Use lossless compression",
+                             FALSE,
+                             G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_BOOLEAN (procedure, "save-color-profile",
+                             "Save color profile",
+                             "Save the image's color profile",
+                             gimp_export_color_profile (),
+                             G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "save-bit-depth",
+                         "Bit depth",
+                         "Bit depth of exported image",
+                         8, 12, 8,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "pixel-format",
+                         "Pixel format",
+                         "Format of color sub-sampling",
+                         HEIFPLUGIN_EXPORT_FORMAT_RGB, HEIFPLUGIN_EXPORT_FORMAT_YUV420,
+                         HEIFPLUGIN_EXPORT_FORMAT_YUV420,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "encoder-speed",
+                         "Encoder speed",
+                         "Tradeoff between speed and compression",
+                         HEIFPLUGIN_ENCODER_SPEED_SLOW, HEIFPLUGIN_ENCODER_SPEED_FASTER,
+                         HEIFPLUGIN_ENCODER_SPEED_BALANCED,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_BOOLEAN (procedure, "save-exif",
+                             "Save Exif",
+                             "Toggle saving Exif data",
+                             gimp_export_exif (),
+                             G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_BOOLEAN (procedure, "save-xmp",
+                             "Save XMP",
+                             "Toggle saving XMP data",
+                             gimp_export_xmp (),
+                             G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "max-threads",
+                         "Maximum threads",
+                         "Maximum number of threads to use, 0 for all "
+                         "processors available to the plug-in",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      if (av1)
+        {
+          GIMP_PROC_ARG_INT (procedure, "tile-rows",
+                             "Tile rows",
+                             "Number of AV1 tile rows, 0 to choose from the "
+                             "image size and the number of threads",
+                             0, 64, 0,
+                             G_PARAM_READWRITE);
+
+          GIMP_PROC_ARG_INT (procedure, "tile-cols",
+                             "Tile columns",
+                             "Number of AV1 tile columns, 0 to choose from "
+                             "the image size and the number of threads",
+                             0, 64, 0,
+                             G_PARAM_READWRITE);
+
+          GIMP_PROC_ARG_BOOLEAN (procedure, "row-mt",
+                                 "Row multithreading",
+                                 "Toggle encoding AV1 tile rows in parallel",
+                                 TRUE,
+                                 G_PARAM_READWRITE);
+        }
+
+      GIMP_PROC_VAL_STRV (procedure, "errors",
+                          "Errors",
+                          "One error message per URI, empty for the "
+                          "images which were exported",
+                          G_PARAM_READWRITE);
+    }
+  else if (! strcmp (name, EXTENSION_PROC))
+    {
+      procedure = gimp_procedure_new (plug_in, proc_name,
+                                      GIMP_PDB_PROC_TYPE_EXTENSION,
+                                      heif_extension, NULL, NULL);
+
+      gimp_procedure_set_documentation (procedure,
+                                        _("Keeps the HEIF plug-in resident"),
+                                        _("Stays running and provides a "
+                                          "copy of every HEIF procedure "
+                                          "with a \"-resident\" suffix. "
+                                          "Calling those skips the start-up "
+                                          "of the plug-in and of libheif, "
+                                          "which matters when loading or "
+                                          "exporting many small files."),
+                                        name);
+      gimp_procedure_set_attribution (procedure,
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "Daniel Novomesky <dnovomesky@gmail.com>",
+                                      "2022");
+
+      GIMP_PROC_ARG_ENUM (procedure, "run-mode",
+                          "Run mode",
+                          "The run mode",
+                          GIMP_TYPE_RUN_MODE,
+                          GIMP_RUN_NONINTERACTIVE,
+                          G_PARAM_READWRITE);
     }
 #if LIBHEIF_HAVE_VERSION(1,8,0)
   else if (! strcmp (name, LOAD_PROC_AV1))
     {
-      procedure = gimp_load_procedure_new (plug_in, name,
-                                           GIMP_PDB_PROC_TYPE_PLUGIN,
+      procedure = gimp_load_procedure_new (plug_in, proc_name,
+                                           proc_type,
                                            heif_load, NULL, NULL);
 
       gimp_procedure_set_menu_label (procedure, "HEIF/AVIF");
@@ -319,12 +979,15 @@ heif_create_procedure (GimpPlugIn  *plug_in,
       gimp_file_procedure_set_magics (GIMP_FILE_PROCEDURE (procedure),
                                       "4,string,ftypmif1,4,string,ftypavif");
 
+      gimp_load_procedure_set_thumbnail_loader (GIMP_LOAD_PROCEDURE (procedure),
+                                                LOAD_THUMB_PROC);
+
       gimp_file_procedure_set_priority (GIMP_FILE_PROCEDURE (procedure), 100);
     }
   else if (! strcmp (name, SAVE_PROC_AV1))
     {
-      procedure = gimp_save_procedure_new (plug_in, name,
-                                           GIMP_PDB_PROC_TYPE_PLUGIN,
+      procedure = gimp_save_procedure_new (plug_in, proc_name,
+                                           proc_type,
                                            heif_av1_save, NULL, NULL);
 
       gimp_procedure_set_image_types (procedure, "RGB*");
@@ -398,45 +1061,344 @@ heif_create_procedure (GimpPlugIn  *plug_in,
                              "Toggle saving XMP data",
                              gimp_export_xmp (),
                              G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "max-threads",
+                         "Maximum threads",
+                         "Maximum number of threads to use, 0 for all "
+                         "processors available to the plug-in",
+                         0, G_MAXINT, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "tile-rows",
+                         "Tile rows",
+                         "Number of AV1 tile rows, 0 to choose from the "
+                         "image size and the number of threads",
+                         0, 64, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_INT (procedure, "tile-cols",
+                         "Tile columns",
+                         "Number of AV1 tile columns, 0 to choose from the "
+                         "image size and the number of threads",
+                         0, 64, 0,
+                         G_PARAM_READWRITE);
+
+      GIMP_PROC_ARG_BOOLEAN (procedure, "row-mt",
+                             "Row multithreading",
+                             "Toggle encoding AV1 tile rows in parallel",
+                             TRUE,
+                             G_PARAM_READWRITE);
     }
 #endif
   return procedure;
 }
 
+static GimpProcedure *
+heif_create_procedure (GimpPlugIn  *plug_in,
+                       const gchar *name)
+{
+  /* the procedure is about to run, get libheif ready */
+  heifplugin_init_libheif ();
+
+  return heif_create_procedure_full (plug_in, name, name,
+                                     GIMP_PDB_PROC_TYPE_PLUGIN);
+}
+
+/* Install a temporary copy of every procedure of the plug-in and serve
+ * calls to them until GIMP quits. gegl, libheif's codec plug-ins and
+ * the cached encoder descriptors stay initialized between the calls.
+ */
 static GimpValueArray *
-heif_load (GimpProcedure        *procedure,
-           GimpRunMode           run_mode,
-           GFile                *file,
-           const GimpValueArray *args,
-           gpointer              run_data)
+heif_extension (GimpProcedure        *procedure,
+                const GimpValueArray *args,
+                gpointer              run_data)
 {
-  GimpValueArray    *return_vals;
-  GimpPDBStatusType  status = GIMP_PDB_SUCCESS;
-  GimpImage         *image;
-  gboolean           interactive;
-  GError            *error = NULL;
+  GimpPlugIn *plug_in = gimp_procedure_get_plug_in (procedure);
+  GList      *names;
+  GList      *list;
 
   INIT_I18N ();
   gegl_init (NULL, NULL);
 
-  interactive = (run_mode == GIMP_RUN_INTERACTIVE);
+  names = heif_init_procedures (plug_in);
 
-  if (interactive)
-    gimp_ui_init (PLUG_IN_BINARY);
+  for (list = names; list; list = g_list_next (list))
+    {
+      const gchar   *name = list->data;
+      GimpProcedure *temp_procedure;
+      gchar         *temp_name;
 
-  image = load_image (file, interactive, &status, &error);
+      if (! strcmp (name, EXTENSION_PROC))
+        continue;
 
-  if (! image)
-    return gimp_procedure_new_return_values (procedure, status, error);
+      temp_name = g_strconcat (name, RESIDENT_SUFFIX, NULL);
 
-  return_vals = gimp_procedure_new_return_values (procedure,
-                                                  GIMP_PDB_SUCCESS,
-                                                  NULL);
+      temp_procedure = heif_create_procedure_full (plug_in, name, temp_name,
+                                                   GIMP_PDB_PROC_TYPE_TEMPORARY);
 
-  GIMP_VALUES_SET_IMAGE (return_vals, 1, image);
+      /* the copies are only meant to be called by name, the regular
+       * procedures stay the file handlers
+       */
+      if (GIMP_IS_FILE_PROCEDURE (temp_procedure))
+        {
+          GimpFileProcedure *file_procedure = GIMP_FILE_PROCEDURE (temp_procedure);
 
-  return return_vals;
-}
+          gimp_file_procedure_set_mime_types (file_procedure, NULL);
+          gimp_file_procedure_set_extensions (file_procedure, NULL);
+          gimp_file_procedure_set_magics     (file_procedure, NULL);
+        }
+
+      gimp_plug_in_add_temp_procedure (plug_in, temp_procedure);
+
+      g_object_unref (temp_procedure);
+      g_free (temp_name);
+    }
+
+  g_list_free_full (names, g_free);
+
+  gimp_procedure_extension_ready (procedure);
+
+  while (TRUE)
+    {
+      gimp_plug_in_extension_process (plug_in, 0);
+
+      /* don't keep other processes' threads waiting while idle */
+      heifplugin_release_thread_budget ();
+    }
+
+  return gimp_procedure_new_return_values (procedure, GIMP_PDB_SUCCESS, NULL);
+}
+
+static GimpValueArray *
+heif_load (GimpProcedure        *procedure,
+           GimpRunMode           run_mode,
+           GFile                *file,
+           const GimpValueArray *args,
+           gpointer              run_data)
+{
+  GimpValueArray    *return_vals;
+  GimpPDBStatusType  status = GIMP_PDB_SUCCESS;
+  GimpImage         *image;
+  gboolean           interactive;
+  GError            *error = NULL;
+
+  INIT_I18N ();
+  gegl_init (NULL, NULL);
+
+  heifplugin_set_thread_budget (0);
+
+  interactive = (run_mode == GIMP_RUN_INTERACTIVE);
+
+  if (interactive)
+    gimp_ui_init (PLUG_IN_BINARY);
+
+  image = load_image (file, interactive, NULL, &status, &error);
+
+  if (! image)
+    return gimp_procedure_new_return_values (procedure, status, error);
+
+  return_vals = gimp_procedure_new_return_values (procedure,
+                                                  GIMP_PDB_SUCCESS,
+                                                  NULL);
+
+  GIMP_VALUES_SET_IMAGE (return_vals, 1, image);
+
+  return return_vals;
+}
+
+static GimpValueArray *
+heif_load_thumb (GimpProcedure        *procedure,
+                 GFile                *file,
+                 gint                  size,
+                 const GimpValueArray *args,
+                 gpointer              run_data)
+{
+  GimpValueArray *return_vals;
+  GimpImage      *image;
+  gint            width  = 0;
+  gint            height = 0;
+  GimpImageType   type   = GIMP_RGB_IMAGE;
+  GError         *error  = NULL;
+
+  INIT_I18N ();
+  gegl_init (NULL, NULL);
+
+  heifplugin_set_thread_budget (0);
+
+  image = load_thumbnail_image (file, size, &width, &height, &type, &error);
+
+  if (! image)
+    return gimp_procedure_new_return_values (procedure,
+                                             GIMP_PDB_EXECUTION_ERROR,
+                                             error);
+
+  return_vals = gimp_procedure_new_return_values (procedure,
+                                                  GIMP_PDB_SUCCESS,
+                                                  NULL);
+
+  GIMP_VALUES_SET_IMAGE (return_vals, 1, image);
+  GIMP_VALUES_SET_INT   (return_vals, 2, width);
+  GIMP_VALUES_SET_INT   (return_vals, 3, height);
+  GIMP_VALUES_SET_ENUM  (return_vals, 4, type);
+  GIMP_VALUES_SET_INT   (return_vals, 5, 1);
+
+  return return_vals;
+}
+
+static GimpValueArray *
+heif_load_region (GimpProcedure        *procedure,
+                  const GimpValueArray *args,
+                  gpointer              run_data)
+{
+  GimpValueArray        *return_vals;
+  GimpPDBStatusType      status  = GIMP_PDB_SUCCESS;
+  HeifpluginLoadOptions  options = { 0, };
+  GimpImage             *image;
+  GimpRunMode            run_mode;
+  GFile                 *file;
+  gboolean               interactive;
+  GError                *error = NULL;
+
+  INIT_I18N ();
+  gegl_init (NULL, NULL);
+
+  run_mode = GIMP_VALUES_GET_ENUM (args, 0);
+  file     = GIMP_VALUES_GET_FILE (args, 1);
+
+  options.use_region    = TRUE;
+  options.region.x      = GIMP_VALUES_GET_INT (args, 2);
+  options.region.y      = GIMP_VALUES_GET_INT (args, 3);
+  options.region.width  = GIMP_VALUES_GET_INT (args, 4);
+  options.region.height = GIMP_VALUES_GET_INT (args, 5);
+
+  heifplugin_set_thread_budget (GIMP_VALUES_GET_INT (args, 6));
+
+  interactive = (run_mode == GIMP_RUN_INTERACTIVE);
+
+  if (interactive)
+    gimp_ui_init (PLUG_IN_BINARY);
+
+  image = load_image (file, interactive, &options, &status, &error);
+
+  if (! image)
+    return gimp_procedure_new_return_values (procedure, status, error);
+
+  return_vals = gimp_procedure_new_return_values (procedure,
+                                                  GIMP_PDB_SUCCESS,
+                                                  NULL);
+
+  GIMP_VALUES_SET_IMAGE (return_vals, 1, image);
+
+  return return_vals;
+}
+
+static GimpValueArray *
+heif_load_layers (GimpProcedure        *procedure,
+                  const GimpValueArray *args,
+                  gpointer              run_data)
+{
+  GimpValueArray *return_vals;
+  GimpImage      *image;
+  GFile          *file;
+  const gint32   *ids;
+  gint            n_ids;
+  gboolean        load_metadata;
+  GError         *error = NULL;
+
+  INIT_I18N ();
+  gegl_init (NULL, NULL);
+
+  file          = GIMP_VALUES_GET_FILE        (args, 1);
+  n_ids         = GIMP_VALUES_GET_INT         (args, 2);
+  ids           = GIMP_VALUES_GET_INT32_ARRAY (args, 3);
+  load_metadata = GIMP_VALUES_GET_BOOLEAN     (args, 4);
+
+  heifplugin_set_thread_budget (GIMP_VALUES_GET_INT (args, 5));
+
+  if (! ids)
+    n_ids = 0;
+
+  image = load_layers_image (file, ids, n_ids, load_metadata, &error);
+
+  if (! image)
+    return gimp_procedure_new_return_values (procedure,
+                                             GIMP_PDB_EXECUTION_ERROR,
+                                             error);
+
+  return_vals = gimp_procedure_new_return_values (procedure,
+                                                  GIMP_PDB_SUCCESS,
+                                                  NULL);
+
+  GIMP_VALUES_SET_IMAGE (return_vals, 1, image);
+
+  return return_vals;
+}
+
+static GimpValueArray *
+heif_load_files (GimpProcedure        *procedure,
+                 const GimpValueArray *args,
+                 gpointer              run_data)
+{
+  GimpValueArray  *return_vals;
+  const gchar    **uris;
+  GFile          **files;
+  GimpImage      **images;
+  GError         **errors;
+  gchar          **messages;
+  gint             max_jobs;
+  gint             max_decode_threads;
+  gint             n_files;
+  gint             n_images = 0;
+  gint             i;
+
+  INIT_I18N ();
+  gegl_init (NULL, NULL);
+
+  uris               = GIMP_VALUES_GET_STRV (args, 1);
+  max_jobs           = GIMP_VALUES_GET_INT  (args, 2);
+  max_decode_threads = GIMP_VALUES_GET_INT  (args, 3);
+
+  heifplugin_set_thread_budget (GIMP_VALUES_GET_INT (args, 4));
+
+  n_files = uris ? g_strv_length ((gchar **) uris) : 0;
+
+  files    = g_new  (GFile *, n_files);
+  images   = g_new0 (GimpImage *, n_files);
+  errors   = g_new0 (GError *, n_files);
+  messages = g_new0 (gchar *, n_files + 1);
+
+  for (i = 0; i < n_files; i++)
+    files[i] = g_file_new_for_uri (uris[i]);
+
+  load_files (files, n_files, max_jobs, max_decode_threads, images, errors);
+
+  for (i = 0; i < n_files; i++)
+    {
+      if (images[i])
+        images[n_images++] = images[i];
+
+      messages[i] = g_strdup (errors[i] ? errors[i]->message : "");
+
+      g_clear_error (&errors[i]);
+      g_object_unref (files[i]);
+    }
+
+  return_vals = gimp_procedure_new_return_values (procedure,
+                                                  GIMP_PDB_SUCCESS,
+                                                  NULL);
+
+  GIMP_VALUES_SET_INT          (return_vals, 1, n_images);
+  GIMP_VALUES_SET_OBJECT_ARRAY (return_vals, 2, GIMP_TYPE_IMAGE,
+                                (GObject **) images, n_images);
+  GIMP_VALUES_SET_STRV         (return_vals, 3, (const gchar **) messages);
+
+  g_strfreev (messages);
+  g_free (errors);
+  g_free (images);
+  g_free (files);
+
+  return return_vals;
+}
 
 static GimpValueArray *
 heif_save (GimpProcedure        *procedure,
@@ -452,6 +1414,7 @@ heif_save (GimpProcedure        *procedure,
   GimpPDBStatusType    status = GIMP_PDB_SUCCESS;
   GimpExportReturn     export = GIMP_EXPORT_CANCEL;
   GimpMetadata        *metadata;
+  gint                 max_threads;
   GError              *error  = NULL;
 
   INIT_I18N ();
@@ -460,6 +1423,9 @@ heif_save (GimpProcedure        *procedure,
   config = gimp_procedure_create_config (procedure);
   gimp_procedure_config_begin_run (config, image, run_mode, args);
 
+  g_object_get (config, "max-threads", &max_threads, NULL);
+  heifplugin_set_thread_budget (max_threads);
+
   switch (run_mode)
     {
     case GIMP_RUN_INTERACTIVE:
@@ -526,6 +1492,117 @@ heif_save (GimpProcedure        *procedure,
   return gimp_procedure_new_return_values (procedure, status, error);
 }
 
+static GimpValueArray *
+heif_save_files (GimpProcedure        *procedure,
+                 const GimpValueArray *args,
+                 gpointer              run_data)
+{
+  GimpValueArray                *return_vals;
+  GimpProcedureConfig           *config;
+  HeifpluginSaveOptions          options;
+  enum heif_compression_format   compression = heif_compression_HEVC;
+  GimpImage                    **images;
+  GimpDrawable                 **drawables;
+  const gchar                  **uris;
+  GFile                        **files;
+  GError                       **errors;
+  gchar                        **messages;
+  gint                           n_images;
+  gint                           n_drawables;
+  gint                           n_files;
+  gint                           max_jobs;
+  gint                           max_threads;
+  gint                           i;
+  GError                        *error = NULL;
+
+  INIT_I18N ();
+  gegl_init (NULL, NULL);
+
+  n_images    = GIMP_VALUES_GET_INT (args, 1);
+  images      = (GimpImage **) GIMP_VALUES_GET_OBJECT_ARRAY (args, 2);
+  n_drawables = GIMP_VALUES_GET_INT (args, 3);
+  drawables   = (GimpDrawable **) GIMP_VALUES_GET_OBJECT_ARRAY (args, 4);
+  uris        = GIMP_VALUES_GET_STRV (args, 5);
+  max_jobs    = GIMP_VALUES_GET_INT (args, 6);
+
+  n_files = uris ? g_strv_length ((gchar **) uris) : 0;
+
+  if (! images)
+    n_images = 0;
+
+  if (! drawables)
+    n_drawables = 0;
+
+  if (n_images != n_files || n_drawables != n_files)
+    {
+      g_set_error (&error, G_FILE_ERROR, 0,
+                   _("Each image needs exactly one drawable and one URI."));
+
+      return gimp_procedure_new_return_values (procedure,
+                                               GIMP_PDB_CALLING_ERROR,
+                                               error);
+    }
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+  if (g_str_has_prefix (gimp_procedure_get_name (procedure),
+                        SAVE_FILES_PROC_AV1))
+    compression = heif_compression_AV1;
+#endif
+
+  /* the export settings are named like the ones of the save procedures */
+  config = gimp_procedure_create_config (procedure);
+  gimp_procedure_config_begin_run (config, NULL, GIMP_RUN_NONINTERACTIVE,
+                                   args);
+
+  heifplugin_save_options_init (&options, G_OBJECT (config));
+
+  g_object_get (config, "max-threads", &max_threads, NULL);
+  heifplugin_set_thread_budget (max_threads);
+
+  files    = g_new  (GFile *, n_files);
+  errors   = g_new0 (GError *, n_files);
+  messages = g_new0 (gchar *, n_files + 1);
+
+  for (i = 0; i < n_files; i++)
+    files[i] = g_file_new_for_uri (uris[i]);
+
+  if (save_files (files, images, drawables, n_files, max_jobs,
+                  &options, compression, errors, &error))
+    {
+      return_vals = gimp_procedure_new_return_values (procedure,
+                                                      GIMP_PDB_SUCCESS,
+                                                      NULL);
+
+      for (i = 0; i < n_files; i++)
+        messages[i] = g_strdup (errors[i] ? errors[i]->message : "");
+
+      GIMP_VALUES_SET_STRV (return_vals, 1, (const gchar **) messages);
+
+      gimp_procedure_config_end_run (config, GIMP_PDB_SUCCESS);
+    }
+  else
+    {
+      return_vals = gimp_procedure_new_return_values (procedure,
+                                                      GIMP_PDB_EXECUTION_ERROR,
+                                                      error);
+
+      gimp_procedure_config_end_run (config, GIMP_PDB_EXECUTION_ERROR);
+    }
+
+  for (i = 0; i < n_files; i++)
+    {
+      g_clear_error (&errors[i]);
+      g_object_unref (files[i]);
+    }
+
+  g_object_unref (config);
+  g_strfreev (messages);
+  g_free (errors);
+  g_free (files);
+
+  return return_vals;
+}
+
 #if LIBHEIF_HAVE_VERSION(1,8,0)
 static GimpValueArray *
 heif_av1_save (GimpProcedure        *procedure,
@@ -541,6 +1618,7 @@ heif_av1_save (GimpProcedure        *procedure,
   GimpPDBStatusType    status = GIMP_PDB_SUCCESS;
   GimpExportReturn     export = GIMP_EXPORT_CANCEL;
   GimpMetadata        *metadata;
+  gint                 max_threads;
   GError              *error  = NULL;
 
   INIT_I18N ();
@@ -549,6 +1627,9 @@ heif_av1_save (GimpProcedure        *procedure,
   config = gimp_procedure_create_config (procedure);
   gimp_procedure_config_begin_run (config, image, run_mode, args);
 
+  g_object_get (config, "max-threads", &max_threads, NULL);
+  heifplugin_set_thread_budget (max_threads);
+
   switch (run_mode)
     {
     case GIMP_RUN_INTERACTIVE:
@@ -637,69 +1718,248 @@ get_file_size (GFile   *file,
   return size;
 }
 
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-static void
-heifplugin_color_profile_set_tag (cmsHPROFILE      profile,
-                                  cmsTagSignature  sig,
-                                  const gchar     *tag)
+static int64_t
+heifplugin_reader_get_position (void *userdata)
 {
-  cmsMLU *mlu;
+  HeifpluginInput *input = userdata;
 
-  mlu = cmsMLUalloc (NULL, 1);
-  cmsMLUsetASCII (mlu, "en", "US", tag);
-  cmsWriteTag (profile, sig, mlu);
-  cmsMLUfree (mlu);
+  return g_seekable_tell (G_SEEKABLE (input->stream));
 }
 
-static GimpColorProfile *
-nclx_to_gimp_profile (const struct heif_color_profile_nclx *nclx)
+static int
+heifplugin_reader_read (void   *data,
+                        size_t  size,
+                        void   *userdata)
 {
-  const gchar *primaries_name = "";
-  const gchar *trc_name = "";
-  cmsHPROFILE profile = NULL;
-  cmsCIExyY whitepoint;
-  cmsCIExyYTRIPLE primaries;
-  cmsToneCurve *curve[3];
+  HeifpluginInput *input      = userdata;
+  gsize            bytes_read = 0;
 
-  cmsFloat64Number srgb_parameters[5] =
-  { 2.4, 1.0 / 1.055,  0.055 / 1.055, 1.0 / 12.92, 0.04045 };
+  if (! g_input_stream_read_all (input->stream, data, size,
+                                 &bytes_read, NULL, NULL))
+    return -1;
 
-  cmsFloat64Number rec709_parameters[5] =
-  { 2.2, 1.0 / 1.099,  0.099 / 1.099, 1.0 / 4.5, 0.081 };
+  input->bytes_read += bytes_read;
 
-  if (nclx == NULL)
-    {
-      return NULL;
-    }
+  return (bytes_read == size) ? 0 : -1;
+}
 
-  if (nclx->color_primaries == heif_color_primaries_unspecified)
-    {
-      return NULL;
-    }
+static int
+heifplugin_reader_seek (int64_t  position,
+                        void    *userdata)
+{
+  HeifpluginInput *input = userdata;
 
-  if (nclx->color_primaries == heif_color_primaries_ITU_R_BT_709_5)
+  if (! g_seekable_seek (G_SEEKABLE (input->stream), position,
+                         G_SEEK_SET, NULL, NULL))
+    return -1;
+
+  return 0;
+}
+
+static enum heif_reader_grow_status
+heifplugin_reader_wait_for_file_size (int64_t  target_size,
+                                      void    *userdata)
+{
+  HeifpluginInput *input = userdata;
+
+  if (target_size > input->file_size)
+    return heif_reader_grow_status_size_beyond_eof;
+
+  return heif_reader_grow_status_size_reached;
+}
+
+static const struct heif_reader heifplugin_reader =
+{
+  1, /* reader_api_version */
+  heifplugin_reader_get_position,
+  heifplugin_reader_read,
+  heifplugin_reader_seek,
+  heifplugin_reader_wait_for_file_size
+};
+
+/* Feed the file to libheif without buffering it twice. Native files
+ * are mapped into memory, seekable streams (typically remote files)
+ * are read on demand so that only the boxes and the image data libheif
+ * actually needs are transferred, and anything else is read into a
+ * buffer. libheif references our memory or stream in all cases, so the
+ * input has to stay alive until the heif_context is freed. There are no
+ * PDB calls in here, so batch loads can read files on worker threads.
+ */
+static gboolean
+heifplugin_context_read (struct heif_context *ctx,
+                         GFile               *file,
+                         HeifpluginInput     *input,
+                         GError             **error)
+{
+  struct heif_error  err;
+  gchar             *path;
+  const void        *data      = NULL;
+  gsize              data_size = 0;
+
+  path = g_file_get_path (file);
+
+  if (path)
     {
-      if (nclx->transfer_characteristics == heif_transfer_characteristic_IEC_61966_2_1)
+      GError *map_error = NULL;
+
+      input->mapped_file = g_mapped_file_new (path, FALSE, &map_error);
+
+      if (input->mapped_file)
         {
-          return gimp_color_profile_new_rgb_srgb();
+          data      = g_mapped_file_get_contents (input->mapped_file);
+          data_size = g_mapped_file_get_length (input->mapped_file);
         }
-
-      if (nclx->transfer_characteristics == heif_transfer_characteristic_linear)
+      else
         {
-          return gimp_color_profile_new_rgb_srgb_linear();
+          g_debug ("%s: mapping '%s' failed, reading it instead: %s",
+                   G_STRFUNC, path, map_error->message);
+          g_clear_error (&map_error);
         }
+
+      g_free (path);
     }
 
-  whitepoint.x = nclx->color_primary_white_x;
-  whitepoint.y = nclx->color_primary_white_y;
-  whitepoint.Y = 1.0f;
+  if (! data)
+    {
+      GInputStream *stream;
+      gsize         bytes_read;
 
-  primaries.Red.x = nclx->color_primary_red_x;
-  primaries.Red.y = nclx->color_primary_red_y;
-  primaries.Red.Y = 1.0f;
+      input->file_size = get_file_size (file, error);
+      if (input->file_size <= 0)
+        return FALSE;
 
-  primaries.Green.x = nclx->color_primary_green_x;
-  primaries.Green.y = nclx->color_primary_green_y;
+      stream = G_INPUT_STREAM (g_file_read (file, NULL, error));
+      if (! stream)
+        return FALSE;
+
+      if (G_IS_SEEKABLE (stream) &&
+          g_seekable_can_seek (G_SEEKABLE (stream)))
+        {
+          input->stream = stream;
+
+          err = heif_context_read_from_reader (ctx, &heifplugin_reader,
+                                               input, NULL);
+          if (err.code)
+            {
+              g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                           _("Loading HEIF image failed: %s"),
+                           err.message);
+              return FALSE;
+            }
+
+          return TRUE;
+        }
+
+      input->file_buffer = g_malloc (input->file_size);
+
+      if (! g_input_stream_read_all (stream, input->file_buffer,
+                                     input->file_size,
+                                     &bytes_read, NULL, error) &&
+          bytes_read == 0)
+        {
+          g_object_unref (stream);
+          return FALSE;
+        }
+
+      g_object_unref (stream);
+
+      data      = input->file_buffer;
+      data_size = input->file_size;
+    }
+
+  input->file_size  = data_size;
+  input->bytes_read = data_size;
+
+  err = heif_context_read_from_memory_without_copy (ctx, data, data_size,
+                                                    NULL);
+  if (err.code)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Loading HEIF image failed: %s"),
+                   err.message);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+heifplugin_input_clear (HeifpluginInput *input)
+{
+  if (input->stream)
+    g_debug ("%s: read %" G_GUINT64_FORMAT " of %" G_GINT64_FORMAT " bytes",
+             G_STRFUNC, input->bytes_read, (gint64) input->file_size);
+
+  g_clear_object (&input->stream);
+  g_clear_pointer (&input->mapped_file, g_mapped_file_unref);
+  g_clear_pointer (&input->file_buffer, g_free);
+  input->file_size  = 0;
+  input->bytes_read = 0;
+}
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+static void
+heifplugin_color_profile_set_tag (cmsHPROFILE      profile,
+                                  cmsTagSignature  sig,
+                                  const gchar     *tag)
+{
+  cmsMLU *mlu;
+
+  mlu = cmsMLUalloc (NULL, 1);
+  cmsMLUsetASCII (mlu, "en", "US", tag);
+  cmsWriteTag (profile, sig, mlu);
+  cmsMLUfree (mlu);
+}
+
+static GimpColorProfile *
+nclx_to_gimp_profile (const struct heif_color_profile_nclx *nclx)
+{
+  const gchar *primaries_name = "";
+  const gchar *trc_name = "";
+  cmsHPROFILE profile = NULL;
+  cmsCIExyY whitepoint;
+  cmsCIExyYTRIPLE primaries;
+  cmsToneCurve *curve[3];
+
+  cmsFloat64Number srgb_parameters[5] =
+  { 2.4, 1.0 / 1.055,  0.055 / 1.055, 1.0 / 12.92, 0.04045 };
+
+  cmsFloat64Number rec709_parameters[5] =
+  { 2.2, 1.0 / 1.099,  0.099 / 1.099, 1.0 / 4.5, 0.081 };
+
+  if (nclx == NULL)
+    {
+      return NULL;
+    }
+
+  if (nclx->color_primaries == heif_color_primaries_unspecified)
+    {
+      return NULL;
+    }
+
+  if (nclx->color_primaries == heif_color_primaries_ITU_R_BT_709_5)
+    {
+      if (nclx->transfer_characteristics == heif_transfer_characteristic_IEC_61966_2_1)
+        {
+          return gimp_color_profile_new_rgb_srgb();
+        }
+
+      if (nclx->transfer_characteristics == heif_transfer_characteristic_linear)
+        {
+          return gimp_color_profile_new_rgb_srgb_linear();
+        }
+    }
+
+  whitepoint.x = nclx->color_primary_white_x;
+  whitepoint.y = nclx->color_primary_white_y;
+  whitepoint.Y = 1.0f;
+
+  primaries.Red.x = nclx->color_primary_red_x;
+  primaries.Red.y = nclx->color_primary_red_y;
+  primaries.Red.Y = 1.0f;
+
+  primaries.Green.x = nclx->color_primary_green_x;
+  primaries.Green.y = nclx->color_primary_green_y;
   primaries.Green.Y = 1.0f;
 
   primaries.Blue.x = nclx->color_primary_blue_x;
@@ -809,1044 +2069,5943 @@ nclx_to_gimp_profile (const struct heif_color_profile_nclx *nclx)
 
   return NULL;
 }
-#endif
-
-GimpImage *
-load_image (GFile              *file,
-            gboolean            interactive,
-            GimpPDBStatusType  *status,
-            GError            **error)
-{
-  GInputStream             *input;
-  goffset                   file_size;
-  guchar                   *file_buffer;
-  gsize                     bytes_read;
-  struct heif_context      *ctx;
-  struct heif_error         err;
-  struct heif_image_handle *handle  = NULL;
-  struct heif_image        *img     = NULL;
-  GimpColorProfile         *profile = NULL;
-  gint                      n_images;
-  heif_item_id              primary;
-  heif_item_id              selected_image;
-  gboolean                  has_alpha;
-  gint                      width;
-  gint                      height;
-  GimpImage                *image;
-  GimpLayer                *layer;
-  GeglBuffer               *buffer;
-  const Babl               *format;
-  const guint8             *data;
-  gint                      stride;
-  gint                      bit_depth = 8;
-  enum heif_chroma          chroma    = heif_chroma_interleaved_RGB;
-  GimpPrecision             precision;
-  gboolean                  load_linear;
-  const char               *encoding;
-
-  gimp_progress_init_printf (_("Opening '%s'"),
-                             gimp_file_get_utf8_name (file));
 
-  *status = GIMP_PDB_EXECUTION_ERROR;
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+static gfloat
+heifplugin_transfer_to_linear (enum heif_transfer_characteristics transfer,
+                               gfloat                             v)
+{
+  switch (transfer)
+    {
+    case heif_transfer_characteristic_IEC_61966_2_1:
+      return v <= 0.04045f ? v / 12.92f : powf ((v + 0.055f) / 1.055f, 2.4f);
+    case heif_transfer_characteristic_ITU_R_BT_470_6_System_M:
+      return powf (v, 2.2f);
+    case heif_transfer_characteristic_ITU_R_BT_470_6_System_B_G:
+      return powf (v, 2.8f);
+    default: /* linear */
+      return v;
+    }
+}
 
-  file_size = get_file_size (file, error);
-  if (file_size <= 0)
-    return NULL;
+/* The reverse of nclx_to_gimp_profile(), for the nclx written along
+ * with an ICC profile by YCbCr exports: fill in the primaries and transfer of profile
+ * where nclx has a code point for them. The colorants of matrix/TRC
+ * profiles are compared against BT.709, BT.2020 and Display P3, the
+ * curves against the sRGB, linear and gamma 2.2 and 2.8 curves.
+ * Anything else is left unspecified, decoders use the ICC profile.
+ */
+static void
+heifplugin_profile_to_nclx (GimpColorProfile               *profile,
+                            struct heif_color_profile_nclx *nclx)
+{
+  /* D65 primaries adapted to D50 with Bradford, as stored in ICC
+   * profiles
+   */
+  static const struct
+  {
+    enum heif_color_primaries primaries;
+    gdouble                   colorants[3][3];
+  }
+  known_primaries[] =
+  {
+    {
+      heif_color_primaries_ITU_R_BT_709_5,
+      { { 0.4360, 0.2225,  0.0139 },
+        { 0.3851, 0.7169,  0.0971 },
+        { 0.1430, 0.0606,  0.7139 } }
+    },
+    {
+      heif_color_primaries_ITU_R_BT_2020_2_and_2100_0,
+      { { 0.6735, 0.2790, -0.0019 },
+        { 0.1657, 0.6753,  0.0300 },
+        { 0.1250, 0.0456,  0.7969 } }
+    },
+    {
+      heif_color_primaries_SMPTE_EG_432_1,
+      { { 0.5151, 0.2412, -0.0011 },
+        { 0.2920, 0.6922,  0.0419 },
+        { 0.1571, 0.0666,  0.7841 } }
+    }
+  };
+  static const enum heif_transfer_characteristics known_transfers[] =
+  {
+    heif_transfer_characteristic_IEC_61966_2_1,
+    heif_transfer_characteristic_linear,
+    heif_transfer_characteristic_ITU_R_BT_470_6_System_M,
+    heif_transfer_characteristic_ITU_R_BT_470_6_System_B_G
+  };
+  static const cmsTagSignature colorant_tags[3] =
+  {
+    cmsSigRedColorantTag, cmsSigGreenColorantTag, cmsSigBlueColorantTag
+  };
+  static const cmsTagSignature trc_tags[3] =
+  {
+    cmsSigRedTRCTag, cmsSigGreenTRCTag, cmsSigBlueTRCTag
+  };
+  static const gfloat samples[] = { 0.02f, 0.1f, 0.25f, 0.5f, 0.75f };
+  cmsHPROFILE         lcms_profile;
+  gint                i, j, k;
 
-  input = G_INPUT_STREAM (g_file_read (file, NULL, error));
-  if (! input)
-    return NULL;
+  nclx->color_primaries          = heif_color_primaries_unspecified;
+  nclx->transfer_characteristics = heif_transfer_characteristic_unspecified;
 
-  file_buffer = g_malloc (file_size);
+  lcms_profile = gimp_color_profile_get_lcms_profile (profile);
 
-  if (! g_input_stream_read_all (input, file_buffer, file_size,
-                                 &bytes_read, NULL, error) &&
-      bytes_read == 0)
+  for (i = 0; i < (gint) G_N_ELEMENTS (known_primaries); i++)
     {
-      g_free (file_buffer);
-      g_object_unref (input);
-      return NULL;
-    }
+      gboolean match = TRUE;
 
-  gimp_progress_update (0.25);
+      for (j = 0; j < 3 && match; j++)
+        {
+          const cmsCIEXYZ *xyz      = cmsReadTag (lcms_profile,
+                                                  colorant_tags[j]);
+          const gdouble   *expected = known_primaries[i].colorants[j];
+
+          match = (xyz &&
+                   fabs (xyz->X - expected[0]) < 0.002 &&
+                   fabs (xyz->Y - expected[1]) < 0.002 &&
+                   fabs (xyz->Z - expected[2]) < 0.002);
+        }
 
-  ctx = heif_context_alloc ();
-  if (!ctx)
-    {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   "cannot allocate heif_context");
-      g_free (file_buffer);
-      g_object_unref (input);
-      return NULL;
+      if (match)
+        {
+          nclx->color_primaries = known_primaries[i].primaries;
+          break;
+        }
     }
 
-  err = heif_context_read_from_memory (ctx, file_buffer, file_size, NULL);
-  if (err.code)
+  for (i = 0; i < (gint) G_N_ELEMENTS (known_transfers); i++)
     {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   _("Loading HEIF image failed: %s"),
-                   err.message);
-      heif_context_free (ctx);
-      g_free (file_buffer);
-      g_object_unref (input);
+      gboolean match = TRUE;
 
-      return NULL;
+      for (j = 0; j < 3 && match; j++)
+        {
+          const cmsToneCurve *curve = cmsReadTag (lcms_profile, trc_tags[j]);
+
+          match = (curve != NULL);
+
+          for (k = 0; k < (gint) G_N_ELEMENTS (samples) && match; k++)
+            {
+              gfloat expected;
+
+              expected = heifplugin_transfer_to_linear (known_transfers[i],
+                                                        samples[k]);
+              match = fabsf (cmsEvalToneCurveFloat (curve, samples[k]) -
+                             expected) < 0.002f;
+            }
+        }
+
+      if (match)
+        {
+          nclx->transfer_characteristics = known_transfers[i];
+          break;
+        }
     }
+}
+#endif /* LIBHEIF_HAVE_VERSION(1,10,0) */
 
-  g_free (file_buffer);
-  g_object_unref (input);
+/* The matrix for YCbCr exports with the primaries of nclx: BT.2020
+ * content is coded with its own matrix, everything else with BT.601,
+ * libheif's default.
+ */
+static gint
+heifplugin_get_save_matrix (const struct heif_color_profile_nclx *nclx)
+{
+  if (nclx->color_primaries == heif_color_primaries_ITU_R_BT_2020_2_and_2100_0)
+    return heif_matrix_coefficients_ITU_R_BT_2020_2_non_constant_luminance;
 
-  gimp_progress_update (0.5);
+  return heif_matrix_coefficients_ITU_R_BT_601_6;
+}
+#endif
 
-  /* analyze image content
-   * Is there more than one image? Which image is the primary image?
-   */
+/*  bit depth conversion kernels  */
 
-  n_images = heif_context_get_number_of_top_level_images (ctx);
-  if (n_images == 0)
-    {
-      g_set_error_literal (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                           _("Loading HEIF image failed: "
-                             "Input file contains no readable images"));
-      heif_context_free (ctx);
+/* Rescaling between the high bit depths of HEIF and GIMP's u16 is done
+ * as  dest = src * base + ((src * mul + add) >> shift)  on 32 bit
+ * integers. The constants were chosen so that the result is identical
+ * to the float computations in the scalar reference implementations
+ * for every possible input value.
+ */
+typedef struct
+{
+  guint16 mask;
+  guint16 base;
+  guint32 mul;
+  guint32 add;
+  gint    shift;
+} HeifpluginRescale;
+
+static const HeifpluginRescale heifplugin_rescale_10_to_16 = { 0x03ff, 64, 1009,  8204, 14 };
+static const HeifpluginRescale heifplugin_rescale_12_to_16 = { 0x0fff, 16, 1921, 261872, 19 };
+static const HeifpluginRescale heifplugin_rescale_16_to_10 = { 0xffff, 0, 65473, 2097204, 22 };
+static const HeifpluginRescale heifplugin_rescale_16_to_12 = { 0xffff, 0, 65521,  524400, 20 };
+
+typedef void (* HeifpluginRescaleFunc) (const guint16           *src,
+                                        guint16                 *dest,
+                                        gsize                    n_samples,
+                                        const HeifpluginRescale *rescale);
 
-      return NULL;
-    }
+static void
+heifplugin_expand_reference (const guint16 *src,
+                             guint16       *dest,
+                             gsize          n_samples,
+                             gint           bit_depth)
+{
+  gsize i;
+  int   tmp_pixelval;
 
-  err = heif_context_get_primary_image_ID (ctx, &primary);
-  if (err.code)
+  switch (bit_depth)
     {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   _("Loading HEIF image failed: %s"),
-                   err.message);
-      heif_context_free (ctx);
-
-      return NULL;
+    case 10:
+      for (i = 0; i < n_samples; i++)
+        {
+          tmp_pixelval = (int) ( ( (float) (0x03ff & src[i]) / 1023.0f) * 65535.0f + 0.5f);
+          dest[i] = CLAMP (tmp_pixelval, 0, 65535);
+        }
+      break;
+    case 12:
+      for (i = 0; i < n_samples; i++)
+        {
+          tmp_pixelval = (int) ( ( (float) (0x0fff & src[i]) / 4095.0f) * 65535.0f + 0.5f);
+          dest[i] = CLAMP (tmp_pixelval, 0, 65535);
+        }
+      break;
+    default:
+      if (dest != src)
+        memcpy (dest, src, n_samples * sizeof (guint16));
+      break;
     }
+}
 
-  /* if primary image is no top level image or not present (invalid
-   * file), just take the first image
-   */
+static void
+heifplugin_rescale_c (const guint16           *src,
+                      guint16                 *dest,
+                      gsize                    n_samples,
+                      const HeifpluginRescale *rescale)
+{
+  gsize i;
 
-  if (! heif_context_is_top_level_image_ID (ctx, primary))
+  for (i = 0; i < n_samples; i++)
     {
-      gint n = heif_context_get_list_of_top_level_image_IDs (ctx, &primary, 1);
-      g_assert (n == 1);
+      guint32 v = src[i] & rescale->mask;
+
+      dest[i] = v * rescale->base + ((v * rescale->mul + rescale->add) >> rescale->shift);
     }
+}
 
-  selected_image = primary;
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+__attribute__ ((target ("sse2")))
+static void
+heifplugin_rescale_sse2 (const guint16           *src,
+                         guint16                 *dest,
+                         gsize                    n_samples,
+                         const HeifpluginRescale *rescale)
+{
+  const __m128i mask  = _mm_set1_epi16 ((gint16) rescale->mask);
+  const __m128i base  = _mm_set1_epi16 ((gint16) rescale->base);
+  const __m128i mul   = _mm_set1_epi16 ((gint16) rescale->mul);
+  const __m128i add   = _mm_set1_epi32 ((gint32) rescale->add);
+  const __m128i shift = _mm_cvtsi32_si128 (rescale->shift);
+  const __m128i bias  = _mm_set1_epi32 (0x8000);
+  const __m128i sign  = _mm_set1_epi16 ((gint16) 0x8000);
+  gsize         i     = 0;
+
+  for (; i + 8 <= n_samples; i += 8)
+    {
+      __m128i v  = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *) (src + i)), mask);
+      __m128i lo = _mm_mullo_epi16 (v, mul);
+      __m128i hi = _mm_mulhi_epu16 (v, mul);
+      __m128i p0 = _mm_unpacklo_epi16 (lo, hi);
+      __m128i p1 = _mm_unpackhi_epi16 (lo, hi);
 
-  /* if there are several images in the file and we are running
-   * interactive, let the user choose a picture
-   */
+      p0 = _mm_srl_epi32 (_mm_add_epi32 (p0, add), shift);
+      p1 = _mm_srl_epi32 (_mm_add_epi32 (p1, add), shift);
 
-  if (interactive && n_images > 1)
-    {
-      if (! load_dialog (ctx, &selected_image))
-        {
-          heif_context_free (ctx);
+      /* SSE2 has no unsigned 32 -> 16 bit pack, go through signed */
+      p0 = _mm_sub_epi32 (p0, bias);
+      p1 = _mm_sub_epi32 (p1, bias);
+      p0 = _mm_xor_si128 (_mm_packs_epi32 (p0, p1), sign);
 
-          *status = GIMP_PDB_CANCEL;
+      p0 = _mm_add_epi16 (p0, _mm_mullo_epi16 (v, base));
 
-          return NULL;
-        }
+      _mm_storeu_si128 ((__m128i *) (dest + i), p0);
     }
 
-  /* load the picture */
+  heifplugin_rescale_c (src + i, dest + i, n_samples - i, rescale);
+}
+#endif
 
-  err = heif_context_get_image_handle (ctx, selected_image, &handle);
-  if (err.code)
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE4_1_INTRINISICS)
+__attribute__ ((target ("sse4.1")))
+static void
+heifplugin_rescale_sse4_1 (const guint16           *src,
+                           guint16                 *dest,
+                           gsize                    n_samples,
+                           const HeifpluginRescale *rescale)
+{
+  const __m128i mask  = _mm_set1_epi16 ((gint16) rescale->mask);
+  const __m128i base  = _mm_set1_epi16 ((gint16) rescale->base);
+  const __m128i mul   = _mm_set1_epi16 ((gint16) rescale->mul);
+  const __m128i add   = _mm_set1_epi32 ((gint32) rescale->add);
+  const __m128i shift = _mm_cvtsi32_si128 (rescale->shift);
+  gsize         i     = 0;
+
+  for (; i + 8 <= n_samples; i += 8)
     {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   _("Loading HEIF image failed: %s"),
-                   err.message);
-      heif_context_free (ctx);
+      __m128i v  = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *) (src + i)), mask);
+      __m128i lo = _mm_mullo_epi16 (v, mul);
+      __m128i hi = _mm_mulhi_epu16 (v, mul);
+      __m128i p0 = _mm_unpacklo_epi16 (lo, hi);
+      __m128i p1 = _mm_unpackhi_epi16 (lo, hi);
 
-      return NULL;
+      p0 = _mm_srl_epi32 (_mm_add_epi32 (p0, add), shift);
+      p1 = _mm_srl_epi32 (_mm_add_epi32 (p1, add), shift);
+      p0 = _mm_packus_epi32 (p0, p1);
+
+      p0 = _mm_add_epi16 (p0, _mm_mullo_epi16 (v, base));
+
+      _mm_storeu_si128 ((__m128i *) (dest + i), p0);
     }
 
-  has_alpha = heif_image_handle_has_alpha_channel (handle);
+  heifplugin_rescale_c (src + i, dest + i, n_samples - i, rescale);
+}
+#endif
 
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-  bit_depth = heif_image_handle_get_luma_bits_per_pixel (handle);
-  if (bit_depth < 0)
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (HEIFPLUGIN_COMPILE_AVX2)
+__attribute__ ((target ("avx2")))
+static void
+heifplugin_rescale_avx2 (const guint16           *src,
+                         guint16                 *dest,
+                         gsize                    n_samples,
+                         const HeifpluginRescale *rescale)
+{
+  const __m256i mask  = _mm256_set1_epi16 ((gint16) rescale->mask);
+  const __m256i base  = _mm256_set1_epi16 ((gint16) rescale->base);
+  const __m256i mul   = _mm256_set1_epi16 ((gint16) rescale->mul);
+  const __m256i add   = _mm256_set1_epi32 ((gint32) rescale->add);
+  const __m128i shift = _mm_cvtsi32_si128 (rescale->shift);
+  gsize         i     = 0;
+
+  /* unpack and pack both work within 128 bit lanes, so the samples
+   * come out in their original order
+   */
+  for (; i + 16 <= n_samples; i += 16)
     {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   "Input image has undefined bit-depth");
-      heif_image_handle_release (handle);
-      heif_context_free (ctx);
+      __m256i v  = _mm256_and_si256 (_mm256_loadu_si256 ((const __m256i *) (src + i)), mask);
+      __m256i lo = _mm256_mullo_epi16 (v, mul);
+      __m256i hi = _mm256_mulhi_epu16 (v, mul);
+      __m256i p0 = _mm256_unpacklo_epi16 (lo, hi);
+      __m256i p1 = _mm256_unpackhi_epi16 (lo, hi);
 
-      return NULL;
+      p0 = _mm256_srl_epi32 (_mm256_add_epi32 (p0, add), shift);
+      p1 = _mm256_srl_epi32 (_mm256_add_epi32 (p1, add), shift);
+      p0 = _mm256_packus_epi32 (p0, p1);
+
+      p0 = _mm256_add_epi16 (p0, _mm256_mullo_epi16 (v, base));
+
+      _mm256_storeu_si256 ((__m256i *) (dest + i), p0);
     }
+
+  heifplugin_rescale_c (src + i, dest + i, n_samples - i, rescale);
+}
 #endif
 
-  if (bit_depth == 8)
+static HeifpluginRescaleFunc
+heifplugin_get_rescale_func (void)
+{
+  static gsize                 initialized = 0;
+  static HeifpluginRescaleFunc func        = NULL;
+
+  if (g_once_init_enter (&initialized))
     {
-      if (has_alpha)
-        {
-          chroma = heif_chroma_interleaved_RGBA;
-        }
-      else
-        {
-          chroma = heif_chroma_interleaved_RGB;
-        }
+#if defined (HEIFPLUGIN_X86_INTRINSICS)
+      GimpCpuAccelFlags accel = gimp_cpu_accel_get_support ();
+#endif
+
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (HEIFPLUGIN_COMPILE_AVX2)
+      if (! func && __builtin_cpu_supports ("avx2"))
+        func = heifplugin_rescale_avx2;
+#endif
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE4_1_INTRINISICS)
+      if (! func && (accel & GIMP_CPU_ACCEL_X86_SSE4_1))
+        func = heifplugin_rescale_sse4_1;
+#endif
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+      if (! func && (accel & GIMP_CPU_ACCEL_X86_SSE2))
+        func = heifplugin_rescale_sse2;
+#endif
+
+      g_once_init_leave (&initialized, 1);
     }
-  else /* high bit depth */
+
+  return func;
+}
+
+/* Expand bit_depth samples to u16. Works in place when src == dest. */
+static void
+heifplugin_expand_to_u16 (const guint16 *src,
+                          guint16       *dest,
+                          gsize          n_samples,
+                          gint           bit_depth)
+{
+  HeifpluginRescaleFunc func = heifplugin_get_rescale_func ();
+
+  if (func && bit_depth == 10)
+    func (src, dest, n_samples, &heifplugin_rescale_10_to_16);
+  else if (func && bit_depth == 12)
+    func (src, dest, n_samples, &heifplugin_rescale_12_to_16);
+  else
+    heifplugin_expand_reference (src, dest, n_samples, bit_depth);
+}
+
+static void
+heifplugin_quantize_reference (const guint16 *src,
+                               guint16       *dest,
+                               gsize          n_samples,
+                               gint           bit_depth)
+{
+  gsize i;
+  int   tmp_pixelval;
+
+  switch (bit_depth)
     {
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-#if ( G_BYTE_ORDER == G_LITTLE_ENDIAN )
-      if (has_alpha)
-        {
-          chroma = heif_chroma_interleaved_RRGGBBAA_LE;
-        }
-      else
-        {
-          chroma = heif_chroma_interleaved_RRGGBB_LE;
-        }
-#else
-      if (has_alpha)
+    case 10:
+      for (i = 0; i < n_samples; i++)
         {
-          chroma = heif_chroma_interleaved_RRGGBBAA_BE;
+          tmp_pixelval = (int) ( ( (float) src[i] / 65535.0f) * 1023.0f + 0.5f);
+          dest[i] = CLAMP (tmp_pixelval, 0, 1023);
         }
-      else
+      break;
+    case 12:
+      for (i = 0; i < n_samples; i++)
         {
-          chroma = heif_chroma_interleaved_RRGGBB_BE;
+          tmp_pixelval = (int) ( ( (float) src[i] / 65535.0f) * 4095.0f + 0.5f);
+          dest[i] = CLAMP (tmp_pixelval, 0, 4095);
         }
-#endif
-#endif
+      break;
+    default:
+      if (dest != src)
+        memcpy (dest, src, n_samples * sizeof (guint16));
+      break;
     }
+}
 
-  err = heif_decode_image (handle,
-                           &img,
-                           heif_colorspace_RGB,
-                           chroma,
-                           NULL);
-  if (err.code)
+/* Quantize u16 samples to bit_depth. Works in place when src == dest. */
+static void
+heifplugin_quantize_from_u16 (const guint16 *src,
+                              guint16       *dest,
+                              gsize          n_samples,
+                              gint           bit_depth)
+{
+  HeifpluginRescaleFunc func = heifplugin_get_rescale_func ();
+
+  if (func && bit_depth == 10)
+    func (src, dest, n_samples, &heifplugin_rescale_16_to_10);
+  else if (func && bit_depth == 12)
+    func (src, dest, n_samples, &heifplugin_rescale_16_to_12);
+  else
+    heifplugin_quantize_reference (src, dest, n_samples, bit_depth);
+}
+
+/* Direct quantization of float data, used for high precision images
+ * so they don't get rounded to u16 by babl first.
+ */
+static void
+heifplugin_quantize_float_c (const gfloat *src,
+                             guint16      *dest,
+                             gsize         n_samples,
+                             gfloat        max_value)
+{
+  gsize i;
+
+  for (i = 0; i < n_samples; i++)
     {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   _("Loading HEIF image failed: %s"),
-                   err.message);
-      heif_image_handle_release (handle);
-      heif_context_free (ctx);
+      gfloat v = src[i];
 
-      return NULL;
+      /* also maps NaN to 0 */
+      if (! (v > 0.0f))
+        v = 0.0f;
+      else if (v > 1.0f)
+        v = 1.0f;
+
+      dest[i] = (guint16) (int) (v * max_value + 0.5f);
     }
+}
 
-#if LIBHEIF_HAVE_VERSION(1,4,0)
-  switch (heif_image_handle_get_color_profile_type (handle))
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+__attribute__ ((target ("sse2")))
+static void
+heifplugin_quantize_float_sse2 (const gfloat *src,
+                                guint16      *dest,
+                                gsize         n_samples,
+                                gfloat        max_value)
+{
+  const __m128 zero  = _mm_setzero_ps ();
+  const __m128 one   = _mm_set1_ps (1.0f);
+  const __m128 max   = _mm_set1_ps (max_value);
+  const __m128 half  = _mm_set1_ps (0.5f);
+  gsize        i     = 0;
+
+  for (; i + 8 <= n_samples; i += 8)
     {
-    case heif_color_profile_type_not_present:
-      break;
-    case heif_color_profile_type_rICC:
-    case heif_color_profile_type_prof:
-      /* I am unsure, but it looks like both these types represent an
-       * ICC color profile. XXX
-       */
-      {
-        void   *profile_data;
-        size_t  profile_size;
+      __m128  f0 = _mm_loadu_ps (src + i);
+      __m128  f1 = _mm_loadu_ps (src + i + 4);
+      __m128i p0;
+      __m128i p1;
 
-        profile_size = heif_image_handle_get_raw_color_profile_size (handle);
-        profile_data = g_malloc0 (profile_size);
-        err = heif_image_handle_get_raw_color_profile (handle, profile_data);
+      /* max (x, 0) returns the second operand for NaN */
+      f0 = _mm_min_ps (_mm_max_ps (f0, zero), one);
+      f1 = _mm_min_ps (_mm_max_ps (f1, zero), one);
 
-        if (err.code)
-          g_warning ("%s: ICC profile loading failed and discarded.",
-                     G_STRFUNC);
-        else
-          profile = gimp_color_profile_new_from_icc_profile ((guint8 *) profile_data,
-                                                             profile_size, NULL);
+      p0 = _mm_cvttps_epi32 (_mm_add_ps (_mm_mul_ps (f0, max), half));
+      p1 = _mm_cvttps_epi32 (_mm_add_ps (_mm_mul_ps (f1, max), half));
 
-        g_free (profile_data);
-      }
-      break;
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-    case heif_color_profile_type_nclx:
-      {
-        struct heif_color_profile_nclx *nclx = NULL;
+      /* values are at most 4095, a signed pack is enough */
+      _mm_storeu_si128 ((__m128i *) (dest + i), _mm_packs_epi32 (p0, p1));
+    }
 
-        err = heif_image_handle_get_nclx_color_profile (handle, &nclx);
-        if (err.code)
-          {
-            g_warning ("%s: NCLX profile loading failed and discarded.",
-                       G_STRFUNC);
-          }
-        else
-          {
-            profile = nclx_to_gimp_profile (nclx);
-            heif_nclx_color_profile_free (nclx);
-          }
-      }
-      break;
+  heifplugin_quantize_float_c (src + i, dest + i, n_samples - i, max_value);
+}
 #endif
-    default:
-      g_warning ("%s: unknown color profile type has been discarded.",
-                 G_STRFUNC);
-      break;
+
+static void
+heifplugin_quantize_from_float (const gfloat *src,
+                                guint16      *dest,
+                                gsize         n_samples,
+                                gint          bit_depth)
+{
+  gfloat max_value = (gfloat) ((1 << bit_depth) - 1);
+
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+  if (gimp_cpu_accel_get_support () & GIMP_CPU_ACCEL_X86_SSE2)
+    {
+      heifplugin_quantize_float_sse2 (src, dest, n_samples, max_value);
+      return;
     }
-#endif /* LIBHEIF_HAVE_VERSION(1,4,0) */
+#endif
 
-  gimp_progress_update (0.75);
+  heifplugin_quantize_float_c (src, dest, n_samples, max_value);
+}
 
-  width  = heif_image_get_width  (img, heif_channel_interleaved);
-  height = heif_image_get_height (img, heif_channel_interleaved);
+/*  parallel processing  */
 
-  /* create GIMP image and copy HEIF image into the GIMP image
-   * (converting it to RGB)
-   */
+/* Work is split into independent jobs (usually bands of rows) which are
+ * picked up by the threads of a shared pool and by the calling thread
+ * itself. Each job writes its own part of the output, so the result
+ * does not depend on the number of threads.
+ */
+typedef void (* HeifpluginParallelFunc) (gint     job,
+                                         gpointer user_data);
 
-  if (profile)
-    {
-      load_linear = gimp_color_profile_is_linear (profile);
-    }
-  else
-    {
-      load_linear = FALSE;
-    }
+typedef struct _HeifpluginParallelTask
+{
+  HeifpluginParallelFunc func;
+  gpointer               user_data;
+  gint                   n_jobs;
+  gint                   next_job;
+  gint                   n_finished;
+  gint                   ref_count;
+  GMutex                 mutex;
+  GCond                  cond;
+} HeifpluginParallelTask;
+
+/* The number of threads a call may keep busy, 0 while there is no limit
+ * for the running procedure.
+ */
+static gint heifplugin_thread_budget = 0;
 
-  if (load_linear)
+/* The max-threads argument of the running procedure, 0 for none */
+static gint heifplugin_thread_limit = 0;
+
+/* Whether the comma separated list of cgroup controllers or mount
+ * options has the cpu controller.
+ */
+static gboolean
+heifplugin_has_cpu_controller (const gchar *list)
+{
+  gchar    **items = g_strsplit (list, ",", -1);
+  gboolean   found = g_strv_contains ((const gchar * const *) items, "cpu");
+
+  g_strfreev (items);
+
+  return found;
+}
+
+/* The path of the cgroup of the process in the v2 hierarchy, or in the
+ * v1 one with the cpu controller, from /proc/self/cgroup.
+ */
+static gchar *
+heifplugin_get_cgroup_path (gboolean v2)
+{
+  gchar  *contents = NULL;
+  gchar **lines;
+  gchar  *path     = NULL;
+  gint    i;
+
+  if (! g_file_get_contents ("/proc/self/cgroup", &contents, NULL, NULL))
+    return NULL;
+
+  lines = g_strsplit (contents, "\n", -1);
+
+  for (i = 0; lines[i] && ! path; i++)
     {
-      if (bit_depth == 8)
-        {
-          precision = GIMP_PRECISION_U8_LINEAR;
-          encoding = has_alpha ? "RGBA u8" : "RGB u8";
-        }
-      else
+      /* "<hierarchy id>:<controllers>:<path>", "0::<path>" for v2 */
+      gchar **fields = g_strsplit (lines[i], ":", 3);
+
+      if (g_strv_length (fields) == 3)
         {
-          precision = GIMP_PRECISION_U16_LINEAR;
-          encoding = has_alpha ? "RGBA u16" : "RGB u16";
+          if (v2 ? (fields[1][0] == '\0')
+                 : heifplugin_has_cpu_controller (fields[1]))
+            path = g_strdup (fields[2]);
         }
+
+      g_strfreev (fields);
     }
-  else /* non-linear profiles */
+
+  g_strfreev (lines);
+  g_free (contents);
+
+  return path;
+}
+
+/* Where the v2 hierarchy, or the v1 one with the cpu controller, is
+ * mounted, and which of its cgroups is the root of the mount, from
+ * /proc/self/mountinfo.
+ */
+static gboolean
+heifplugin_get_cgroup_mount (gboolean   v2,
+                             gchar    **mount_root,
+                             gchar    **mount_point)
+{
+  gchar    *contents = NULL;
+  gchar   **lines;
+  gboolean  found    = FALSE;
+  gint      i;
+
+  if (! g_file_get_contents ("/proc/self/mountinfo", &contents, NULL, NULL))
+    return FALSE;
+
+  lines = g_strsplit (contents, "\n", -1);
+
+  for (i = 0; lines[i] && ! found; i++)
     {
-      if (bit_depth == 8)
-        {
-          precision = GIMP_PRECISION_U8_NON_LINEAR;
-          encoding = has_alpha ? "R'G'B'A u8" : "R'G'B' u8";
-        }
-      else
+      /* "<id> <parent> <dev> <root> <mount point> <options> [<tags>...]
+       *  - <type> <source> <super options>"
+       */
+      const gchar  *separator = strstr (lines[i], " - ");
+      gchar       **fields;
+      gchar       **fs_fields;
+
+      if (! separator)
+        continue;
+
+      fields    = g_strsplit (lines[i], " ", 6);
+      fs_fields = g_strsplit (separator + 3, " ", 3);
+
+      if (g_strv_length (fields) >= 5 && g_strv_length (fs_fields) == 3 &&
+          (v2 ? strcmp (fs_fields[0], "cgroup2") == 0
+              : (strcmp (fs_fields[0], "cgroup") == 0 &&
+                 heifplugin_has_cpu_controller (fs_fields[2]))))
         {
-          precision = GIMP_PRECISION_U16_NON_LINEAR;
-          encoding = has_alpha ? "R'G'B'A u16" : "R'G'B' u16";
+          /* spaces and the like are escaped as octal */
+          *mount_root  = g_strcompress (fields[3]);
+          *mount_point = g_strcompress (fields[4]);
+          found = TRUE;
         }
+
+      g_strfreev (fs_fields);
+      g_strfreev (fields);
     }
 
-  image = gimp_image_new_with_precision (width, height, GIMP_RGB, precision);
-  gimp_image_set_file (image, file);
+  g_strfreev (lines);
+  g_free (contents);
 
-  if (profile)
+  return found;
+}
+
+/* The number of CPUs the cgroup directory dir allows, 0 if it doesn't
+ * limit them.
+ */
+static gint
+heifplugin_read_cgroup_cpus (const gchar *dir,
+                             gboolean     v2)
+{
+  gchar  *filename;
+  gchar  *contents = NULL;
+  gchar  *end;
+  gint64  quota    = -1;
+  gint64  period   = 0;
+
+  if (v2)
     {
-      if (gimp_color_profile_is_rgb (profile))
+      filename = g_build_filename (dir, "cpu.max", NULL);
+
+      if (g_file_get_contents (filename, &contents, NULL, NULL))
         {
-          gimp_image_set_color_profile (image, profile);
+          /* "max 100000" or "<quota> <period>" */
+          if (! g_str_has_prefix (contents, "max"))
+            {
+              quota  = g_ascii_strtoll (contents, &end, 10);
+              period = g_ascii_strtoll (end, NULL, 10);
+            }
+
+          g_free (contents);
         }
-      else if (gimp_color_profile_is_gray (profile))
+
+      g_free (filename);
+    }
+  else
+    {
+      filename = g_build_filename (dir, "cpu.cfs_quota_us", NULL);
+
+      if (g_file_get_contents (filename, &contents, NULL, NULL))
         {
-          g_warning ("Gray ICC profile was not applied to the imported image.");
+          quota = g_ascii_strtoll (contents, NULL, 10);
+          g_free (contents);
         }
-      else
+
+      g_free (filename);
+      filename = g_build_filename (dir, "cpu.cfs_period_us", NULL);
+
+      if (g_file_get_contents (filename, &contents, NULL, NULL))
         {
-          g_warning ("ICC profile was not applied to the imported image.");
+          period = g_ascii_strtoll (contents, NULL, 10);
+          g_free (contents);
         }
+
+      g_free (filename);
     }
 
-  layer = gimp_layer_new (image,
-                          _("image content"),
-                          width, height,
-                          has_alpha ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE,
-                          100.0,
-                          gimp_image_get_default_new_layer_mode (image));
+  if (quota <= 0 || period <= 0)
+    return 0;
 
-  gimp_image_insert_layer (image, layer, NULL, 0);
+  return MAX ((quota + period - 1) / period, 1);
+}
 
-  buffer = gimp_drawable_get_buffer (GIMP_DRAWABLE (layer));
+/* The number of CPUs the cgroup of the process may use in the v2
+ * hierarchy, or the v1 one with the cpu controller, 0 if it isn't
+ * limited. A quota set on any parent cgroup applies too, so the
+ * tightest one on the way up to the mount point is taken.
+ */
+static gint
+heifplugin_get_cgroup_hierarchy_cpus (gboolean v2)
+{
+  gchar       *path;
+  gchar       *mount_root  = NULL;
+  gchar       *mount_point = NULL;
+  const gchar *relative    = NULL;
+  gchar       *dir;
+  gint         n_cpus      = 0;
 
-  data = heif_image_get_plane_readonly (img, heif_channel_interleaved,
-                                        &stride);
+  path = heifplugin_get_cgroup_path (v2);
 
-  format = babl_format_with_space (encoding,
-                                   gegl_buffer_get_format (buffer));
+  if (! path)
+    return 0;
 
-  if (bit_depth == 8)
+  if (! heifplugin_get_cgroup_mount (v2, &mount_root, &mount_point))
     {
-      gegl_buffer_set (buffer,
-                       GEGL_RECTANGLE (0, 0, width, height),
-                       0, format, data, stride);
+      g_free (path);
+      return 0;
     }
-  else /* high bit depth */
+
+  /* the part of the path below the mount root, which is the container's
+   * own cgroup when it has no cgroup namespace
+   */
+  if (strcmp (mount_root, "/") == 0)
+    relative = path;
+  else if (g_str_has_prefix (path, mount_root) &&
+           (path[strlen (mount_root)] == '/' ||
+            path[strlen (mount_root)] == '\0'))
+    relative = path + strlen (mount_root);
+
+  while (relative && *relative == '/')
+    relative++;
+
+  /* a cgroup outside of our namespace can't be walked */
+  if (relative && strstr (relative, ".."))
+    relative = NULL;
+
+  if (relative && *relative)
+    dir = g_build_filename (mount_point, relative, NULL);
+  else
+    dir = g_strdup (mount_point);
+
+  while (TRUE)
     {
-      uint16_t       *data16;
-      const uint16_t *src16;
-      uint16_t       *dest16;
-      gint            x, y, rowentries;
-      int             tmp_pixelval;
+      gint n_dir_cpus = heifplugin_read_cgroup_cpus (dir, v2);
+      gchar *parent;
 
-      if (has_alpha)
-        {
-          rowentries = width * 4;
-        }
-      else /* no alpha */
-        {
-          rowentries = width * 3;
-        }
+      if (n_dir_cpus > 0 && (n_cpus == 0 || n_dir_cpus < n_cpus))
+        n_cpus = n_dir_cpus;
 
-      data16 = g_malloc_n (height, rowentries * 2);
-      dest16 = data16;
+      if (strlen (dir) <= strlen (mount_point))
+        break;
 
-      switch (bit_depth)
-        {
-        case 10:
-          for (y = 0; y < height; y++)
-            {
-              src16 = (const uint16_t *) (y * stride + data);
-              for (x = 0; x < rowentries; x++)
-                {
-                  tmp_pixelval = (int) ( ( (float) (0x03ff & (*src16)) / 1023.0f) * 65535.0f + 0.5f);
-                  *dest16 = CLAMP (tmp_pixelval, 0, 65535);
-                  dest16++;
-                  src16++;
-                }
-            }
-          break;
-        case 12:
-          for (y = 0; y < height; y++)
-            {
-              src16 = (const uint16_t *) (y * stride + data);
-              for (x = 0; x < rowentries; x++)
-                {
-                  tmp_pixelval = (int) ( ( (float) (0x0fff & (*src16))  / 4095.0f) * 65535.0f + 0.5f);
-                  *dest16 = CLAMP (tmp_pixelval, 0, 65535);
-                  dest16++;
-                  src16++;
-                }
-            }
-          break;
-        default:
-          for (y = 0; y < height; y++)
-            {
-              src16 = (const uint16_t *) (y * stride + data);
-              for (x = 0; x < rowentries; x++)
-                {
-                  *dest16 = *src16;
-                  dest16++;
-                  src16++;
-                }
-            }
-          break;
-        }
+      parent = g_path_get_dirname (dir);
+      g_free (dir);
+      dir = parent;
+    }
 
-      gegl_buffer_set (buffer,
-                       GEGL_RECTANGLE (0, 0, width, height),
-                       0, format, data16, GEGL_AUTO_ROWSTRIDE);
+  g_free (dir);
+  g_free (mount_point);
+  g_free (mount_root);
+  g_free (path);
 
-      g_free (data16);
-    }
+  return n_cpus;
+}
 
-  g_object_unref (buffer);
+/* The number of CPUs the cgroups (v2 and v1) of the process may use, 0
+ * if they aren't limited. Containers usually restrict CPU time this way
+ * rather than by hiding processors.
+ */
+static gint
+heifplugin_get_cgroup_cpus (void)
+{
+  gint n_v2 = heifplugin_get_cgroup_hierarchy_cpus (TRUE);
+  gint n_v1 = heifplugin_get_cgroup_hierarchy_cpus (FALSE);
 
-  {
-    size_t        exif_data_size = 0;
-    uint8_t      *exif_data      = NULL;
-    size_t        xmp_data_size  = 0;
-    uint8_t      *xmp_data       = NULL;
-    gint          n_metadata;
-    heif_item_id  metadata_id;
-
-    n_metadata =
-      heif_image_handle_get_list_of_metadata_block_IDs (handle,
-                                                        "Exif",
-                                                        &metadata_id, 1);
-    if (n_metadata > 0)
-      {
-        exif_data_size = heif_image_handle_get_metadata_size (handle,
-                                                              metadata_id);
-        exif_data = g_alloca (exif_data_size);
+  if (n_v2 > 0 && n_v1 > 0)
+    return MIN (n_v2, n_v1);
 
-        err = heif_image_handle_get_metadata (handle, metadata_id, exif_data);
-        if (err.code != 0)
-          {
-            exif_data      = NULL;
-            exif_data_size = 0;
-          }
-      }
+  return MAX (n_v2, n_v1);
+}
 
-    n_metadata =
-      heif_image_handle_get_list_of_metadata_block_IDs (handle,
-                                                        "mime",
-                                                        &metadata_id, 1);
-    if (n_metadata > 0)
-      {
-        if (g_strcmp0 (
-              heif_image_handle_get_metadata_content_type (handle, metadata_id),
-              "application/rdf+xml") == 0)
-          {
-            xmp_data_size = heif_image_handle_get_metadata_size (handle,
-                            metadata_id);
-            xmp_data = g_alloca (xmp_data_size);
-
-            err = heif_image_handle_get_metadata (handle, metadata_id, xmp_data);
-            if (err.code != 0)
-              {
-                xmp_data      = NULL;
-                xmp_data_size = 0;
-              }
-          }
-      }
+/* The number of threads which can actually run at the same time: the
+ * smallest of GIMP's processor setting, the CPU affinity mask and the
+ * cgroup CPU quota. GIMP_HEIF_THREADS replaces all of them.
+ */
+static gint
+heifplugin_get_usable_cpus (void)
+{
+  const gchar *env;
+  gint         n_cpus;
+  gint         n_affinity = 0;
+  gint         n_cgroup;
 
-    if (exif_data || xmp_data)
-      {
-        GimpMetadata          *metadata = gimp_metadata_new ();
-        GimpMetadataLoadFlags  flags    = GIMP_METADATA_LOAD_COMMENT | GIMP_METADATA_LOAD_RESOLUTION;
+  env = g_getenv ("GIMP_HEIF_THREADS");
+  if (env && g_ascii_strtoll (env, NULL, 10) > 0)
+    return (gint) MIN (g_ascii_strtoll (env, NULL, 10), G_MAXINT);
 
-        if (exif_data)
-          {
-            const guint8 tiffHeaderBE[4] = { 'M', 'M', 0, 42 };
-            const guint8 tiffHeaderLE[4] = { 'I', 'I', 42, 0 };
-            GExiv2Metadata *exif_metadata = GEXIV2_METADATA (metadata);
-            const guint8 *tiffheader = exif_data;
-            glong new_exif_size = exif_data_size;
-
-            while (new_exif_size >= 4)  /*Searching for TIFF Header*/
-              {
-                if (tiffheader[0] == tiffHeaderBE[0] && tiffheader[1] == tiffHeaderBE[1] &&
-                    tiffheader[2] == tiffHeaderBE[2] && tiffheader[3] == tiffHeaderBE[3])
-                  {
-                    break;
-                  }
-                if (tiffheader[0] == tiffHeaderLE[0] && tiffheader[1] == tiffHeaderLE[1] &&
-                    tiffheader[2] == tiffHeaderLE[2] && tiffheader[3] == tiffHeaderLE[3])
-                  {
-                    break;
-                  }
-                new_exif_size--;
-                tiffheader++;
-              }
-
-            if (new_exif_size > 4)   /* TIFF header + some data found*/
-              {
-                if (! gexiv2_metadata_open_buf (exif_metadata, tiffheader, new_exif_size, error))
-                  {
-                    g_printerr ("%s: Failed to set EXIF metadata: %s\n", G_STRFUNC, (*error)->message);
-                    g_clear_error (error);
-                  }
-              }
-            else
-              {
-                g_printerr ("%s: EXIF metadata not set\n", G_STRFUNC);
-              }
-          }
+  n_cpus = MAX (gimp_get_num_processors (), 1);
 
-        if (xmp_data)
-          {
-            if (!gimp_metadata_set_from_xmp (metadata, xmp_data, xmp_data_size, error))
-              {
-                g_printerr ("%s: Failed to set XMP metadata: %s\n", G_STRFUNC, (*error)->message);
-                g_clear_error (error);
-              }
-          }
+#ifdef __linux__
+  {
+    cpu_set_t set;
 
-        gimp_image_metadata_load_finish (image, "image/heif",
-                                         metadata, flags);
-      }
+    CPU_ZERO (&set);
+
+    if (sched_getaffinity (0, sizeof (set), &set) == 0)
+      n_affinity = CPU_COUNT (&set);
   }
+#endif
 
-  if (profile)
-    g_object_unref (profile);
+  if (n_affinity > 0)
+    n_cpus = MIN (n_cpus, n_affinity);
 
-  heif_image_handle_release (handle);
-  heif_context_free (ctx);
-  heif_image_release (img);
+  n_cgroup = heifplugin_get_cgroup_cpus ();
 
-  gimp_progress_update (1.0);
+  if (n_cgroup > 0)
+    n_cpus = MIN (n_cpus, n_cgroup);
 
-  if (image)
+  g_debug ("%s: %d (GIMP %d, affinity %d, cgroup %d)", G_STRFUNC,
+           n_cpus, gimp_get_num_processors (), n_affinity, n_cgroup);
+
+  return n_cpus;
+}
+
+/* The number of threads to use for one piece of work when nothing else
+ * limits it. This is the default of the decoders, the encoders and the
+ * conversion pool alike.
+ */
+static gint
+heifplugin_get_num_threads (void)
+{
+  static gsize initialized = 0;
+  static gint  usable_cpus = 1;
+  gint         budget;
+
+  if (g_once_init_enter (&initialized))
     {
-      *status = GIMP_PDB_SUCCESS;
+      usable_cpus = heifplugin_get_usable_cpus ();
+
+      g_once_init_leave (&initialized, 1);
     }
-  return image;
+
+  budget = g_atomic_int_get (&heifplugin_thread_budget);
+
+  return budget > 0 ? budget : usable_cpus;
 }
 
-static const gchar *
-heifplugin_fix_xmp_tag (const gchar *tag)
+static void
+heifplugin_parallel_task_unref (HeifpluginParallelTask *task)
 {
-  gchar *substring;
+  if (g_atomic_int_dec_and_test (&task->ref_count))
+    {
+      g_mutex_clear (&task->mutex);
+      g_cond_clear (&task->cond);
+      g_slice_free (HeifpluginParallelTask, task);
+    }
+}
 
-  /* Due to problems using /Iptc4xmpExt namespace (/iptcExt is used
-   * instead by Exiv2) we replace all occurrences with /iptcExt which
-   * is valid but less common. Not doing so would cause saving xmp
-   * metadata to fail. This has to be done after getting the values
-   * from the source metadata since that source uses the original
-   * tag names and would otherwise return NULL as value.
-   * /Iptc4xmpExt length = 12
-   * /iptcExt     length =  8
-   */
+static void
+heifplugin_parallel_task_process (HeifpluginParallelTask *task)
+{
+  gint job;
 
-  substring = strstr (tag, "/Iptc4xmpExt");
-  while (substring)
+  while ((job = g_atomic_int_add (&task->next_job, 1)) < task->n_jobs)
     {
-      gint len_tag = strlen (tag);
-      gint len_end;
-
-      len_end = len_tag - (substring - tag) - 12;
-      strncpy (substring, "/iptcExt", 8);
-      substring += 8;
-      /* Using memmove: we have overlapping source and dest */
-      memmove (substring, substring+4, len_end);
-      substring[len_end] = '\0';
-      g_debug ("Fixed tag value: %s", tag);
+      task->func (job, task->user_data);
 
-      /* Multiple occurrences are possible: e.g.:
-       * Xmp.iptcExt.ImageRegion[3]/Iptc4xmpExt:RegionBoundary/Iptc4xmpExt:rbVertices[1]/Iptc4xmpExt:rbX
-       */
-      substring = strstr (tag, "/Iptc4xmpExt");
+      g_mutex_lock (&task->mutex);
+      if (++task->n_finished == task->n_jobs)
+        g_cond_signal (&task->cond);
+      g_mutex_unlock (&task->mutex);
     }
-  return tag;
 }
 
 static void
-heifplugin_image_metadata_copy_tag (GExiv2Metadata *src,
-                                    GExiv2Metadata *dest,
-                                    const gchar    *tag)
+heifplugin_parallel_worker (gpointer data,
+                            gpointer user_data)
 {
-  gchar **values = gexiv2_metadata_try_get_tag_multiple (src, tag, NULL);
+  HeifpluginParallelTask *task = data;
 
-  if (values)
-    {
-      gchar *temp_tag;
+  heifplugin_parallel_task_process (task);
+  heifplugin_parallel_task_unref (task);
+}
 
-      /* Xmp always seems to return multiple values */
-      if (g_str_has_prefix (tag, "Xmp."))
-        temp_tag = (gchar *) heifplugin_fix_xmp_tag (g_strdup (tag));
-      else
-        temp_tag = g_strdup (tag);
+static GThreadPool *
+heifplugin_parallel_get_pool (void)
+{
+  static gsize        initialized = 0;
+  static GThreadPool *pool        = NULL;
 
-      gexiv2_metadata_try_set_tag_multiple (dest, temp_tag, (const gchar **) values, NULL);
-      g_free (temp_tag);
-      g_strfreev (values);
+  if (g_once_init_enter (&initialized))
+    {
+      pool = g_thread_pool_new (heifplugin_parallel_worker, NULL,
+                                heifplugin_get_num_threads (),
+                                FALSE, NULL);
+
+      g_once_init_leave (&initialized, 1);
     }
-  else
+
+  return pool;
+}
+
+/*  thread tokens shared between processes  */
+
+#ifdef G_OS_UNIX
+/* With GIMP_HEIF_TOKEN_POOL set, concurrent plug-in processes share one
+ * thread budget, like make's jobserver: every process may run one
+ * thread, each further thread needs a token from the pool. The pool is
+ * a file, the path in GIMP_HEIF_TOKEN_POOL or a default one in the
+ * user's runtime directory, and a token is a byte of it locked with
+ * fcntl(), so the kernel gives back the tokens of a process that dies.
+ * Anybody who can open the file can lock its bytes, so it is created
+ * private to the user and must not be a symbolic link. The tokens are
+ * only taken and given back on the main thread.
+ */
+typedef struct
+{
+  gint      fd;
+  gint      n_tokens;
+  gboolean *held;
+  gint      n_held;
+} HeifpluginTokenPool;
+
+static HeifpluginTokenPool *
+heifplugin_token_pool_get (void)
+{
+  static gboolean             initialized = FALSE;
+  static HeifpluginTokenPool *pool        = NULL;
+
+  if (! initialized)
     {
-      gchar *value = gexiv2_metadata_try_get_tag_string (src, tag, NULL);
+      const gchar *env = g_getenv ("GIMP_HEIF_TOKEN_POOL");
 
-      if (value)
+      initialized = TRUE;
+
+      if (env && *env)
         {
-          gexiv2_metadata_try_set_tag_string (dest, tag, value, NULL);
-          g_free (value);
+          gchar       *path;
+          gint         fd;
+          struct stat  st;
+          gint         flags = O_RDWR | O_CREAT;
+
+#ifdef O_NOFOLLOW
+          flags |= O_NOFOLLOW;
+#endif
+
+          if (g_path_is_absolute (env))
+            path = g_strdup (env);
+          else
+            path = g_build_filename (g_get_user_runtime_dir (),
+                                     "gimp-heif-tokens", NULL);
+
+          fd = g_open (path, flags, 0600);
+
+          if (fd < 0)
+            {
+              g_printerr ("GIMP_HEIF_TOKEN_POOL: cannot open '%s': %s\n",
+                          path, g_strerror (errno));
+            }
+          else if (fstat (fd, &st) != 0 ||
+                   ! S_ISREG (st.st_mode) ||
+                   st.st_uid != getuid ())
+            {
+              /* somebody else's file could hold every token */
+              g_printerr ("GIMP_HEIF_TOKEN_POOL: '%s' is not a regular file "
+                          "owned by the user, ignoring it\n", path);
+              close (fd);
+            }
+          else
+            {
+              fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+              pool = g_new0 (HeifpluginTokenPool, 1);
+              pool->fd       = fd;
+              pool->n_tokens = MAX (heifplugin_get_usable_cpus () - 1, 0);
+              pool->held     = g_new0 (gboolean, MAX (pool->n_tokens, 1));
+            }
+
+          g_free (path);
         }
     }
+
+  return pool;
 }
 
-static struct heif_error
-write_callback (struct heif_context *ctx,
-                const void          *data,
-                size_t               size,
-                void                *userdata)
+/* Hold up to n_tokens tokens, without waiting for busy ones. Returns
+ * the number of tokens held.
+ */
+static gint
+heifplugin_token_pool_acquire (HeifpluginTokenPool *pool,
+                               gint                 n_tokens)
 {
-  GOutputStream     *output = userdata;
-  GError            *error  = NULL;
-  struct heif_error  heif_error;
+  gint i;
 
-  heif_error.code    = heif_error_Ok;
-  heif_error.subcode = heif_suberror_Unspecified;
-  heif_error.message = "";
-
-  if (! g_output_stream_write_all (output, data, size, NULL, NULL, &error))
+  for (i = 0; i < pool->n_tokens && pool->n_held < n_tokens; i++)
     {
-      heif_error.code    = 99; /* hmm */
-      heif_error.message = error->message;
+      struct flock lock = { 0, };
+
+      if (pool->held[i])
+        continue;
+
+      lock.l_type   = F_WRLCK;
+      lock.l_whence = SEEK_SET;
+      lock.l_start  = i;
+      lock.l_len    = 1;
+
+      if (fcntl (pool->fd, F_SETLK, &lock) == 0)
+        {
+          pool->held[i] = TRUE;
+          pool->n_held++;
+        }
     }
 
-  return heif_error;
+  return pool->n_held;
 }
 
-static gboolean
-save_image (GFile                        *file,
-            GimpImage                    *image,
-            GimpDrawable                 *drawable,
-            GObject                      *config,
-            GError                      **error,
-            enum heif_compression_format  compression,
-            GimpMetadata                 *metadata)
+static void
+heifplugin_token_pool_release (HeifpluginTokenPool *pool)
 {
-  struct heif_image                    *h_image = NULL;
-  struct heif_context                  *context = heif_context_alloc ();
-  struct heif_encoder                  *encoder = NULL;
-  const struct heif_encoder_descriptor *encoder_descriptor;
-  const char                           *encoder_name;
-  struct heif_image_handle             *handle  = NULL;
-  struct heif_writer                    writer;
-  struct heif_error                     err;
-  GOutputStream                        *output;
-  GeglBuffer                           *buffer;
-  const gchar                          *encoding;
-  const Babl                           *format;
-  const Babl                           *space   = NULL;
-  guint8                               *data;
-  gint                                  stride;
-  gint                                  width;
-  gint                                  height;
-  gboolean                              has_alpha;
-  gboolean                              out_linear = FALSE;
-  gboolean                              lossless;
-  gint                                  quality;
-  gboolean                              save_profile;
-  gint                                  save_bit_depth = 8;
-#if LIBHEIF_HAVE_VERSION(1,10,0)
-  HeifpluginExportFormat    pixel_format = HEIFPLUGIN_EXPORT_FORMAT_YUV420;
-#endif
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-  HeifpluginEncoderSpeed    encoder_speed = HEIFPLUGIN_ENCODER_SPEED_BALANCED;
-  const char               *parameter_value;
-  struct heif_color_profile_nclx nclx_profile;
-#endif
-  gboolean                  save_exif = FALSE;
-  gboolean                  save_xmp = FALSE;
+  gint i;
 
-  if (!context)
+  for (i = 0; i < pool->n_tokens && pool->n_held > 0; i++)
     {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   "cannot allocate heif_context");
-      return FALSE;
+      struct flock lock = { 0, };
+
+      if (! pool->held[i])
+        continue;
+
+      lock.l_type   = F_UNLCK;
+      lock.l_whence = SEEK_SET;
+      lock.l_start  = i;
+      lock.l_len    = 1;
+
+      fcntl (pool->fd, F_SETLK, &lock);
+
+      pool->held[i] = FALSE;
+      pool->n_held--;
     }
+}
+#endif /* G_OS_UNIX */
 
-  g_object_get (config,
-                "lossless",           &lossless,
-                "quality",            &quality,
-#if LIBHEIF_HAVE_VERSION(1,10,0)
-                "pixel-format",       &pixel_format,
-#endif
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-                "save-bit-depth",     &save_bit_depth,
-                "encoder-speed",      &encoder_speed,
+/* Take the tokens of the running procedure anew, without waiting for
+ * busy ones, so it gets the ones other processes gave back since and
+ * leaves the ones they took. Called between the rounds of a batch.
+ */
+static void
+heifplugin_refresh_thread_budget (void)
+{
+#ifdef G_OS_UNIX
+  HeifpluginTokenPool *pool = heifplugin_token_pool_get ();
 #endif
-                "save-color-profile", &save_profile,
-                "save-exif", &save_exif,
-                "save-xmp", &save_xmp,
-                NULL);
 
-  if (compression == heif_compression_HEVC)
-    {
-      if (heif_context_get_encoder_descriptors (context,
-                                                heif_compression_HEVC,
-                                                NULL,
-                                                &encoder_descriptor, 1) == 1)
-        {
-          encoder_name = heif_encoder_descriptor_get_id_name (encoder_descriptor);
-        }
-      else
-        {
-          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                       "Unable to find suitable HEIF encoder");
-          heif_context_free (context);
-          return FALSE;
-        }
-    }
-  else /* AV1 compression */
+  g_atomic_int_set (&heifplugin_thread_budget, heifplugin_thread_limit);
+
+#ifdef G_OS_UNIX
+  if (pool)
     {
-      if (heif_context_get_encoder_descriptors (context,
-                                                compression,
-                                                "aom", /* we prefer aom rather than rav1e */
-                                                &encoder_descriptor, 1) == 1)
-        {
-          encoder_name = heif_encoder_descriptor_get_id_name (encoder_descriptor);
-        }
-      else if (heif_context_get_encoder_descriptors (context,
-                                                     compression,
-                                                     NULL,
-                                                     &encoder_descriptor, 1) == 1)
-        {
-          encoder_name = heif_encoder_descriptor_get_id_name (encoder_descriptor);
-        }
-      else
-        {
-          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                       "Unable to find suitable AVIF encoder");
-          heif_context_free (context);
-          return FALSE;
-        }
+      gint n_threads;
+
+      heifplugin_token_pool_release (pool);
+
+      n_threads = heifplugin_get_num_threads ();
+      n_threads = 1 + heifplugin_token_pool_acquire (pool, n_threads - 1);
+
+      g_debug ("%s: %d threads from the token pool", G_STRFUNC, n_threads);
+
+      g_atomic_int_set (&heifplugin_thread_budget, n_threads);
     }
+#endif
 
-  gimp_progress_init_printf (_("Exporting '%s' using %s encoder"),
-                             gimp_file_get_utf8_name (file), encoder_name);
+  g_thread_pool_set_max_threads (heifplugin_parallel_get_pool (),
+                                 heifplugin_get_num_threads (),
+                                 NULL);
+}
 
-  width   = gimp_drawable_get_width  (drawable);
-  height  = gimp_drawable_get_height (drawable);
+/* Limit the running procedure to max_threads threads in total, 0 for
+ * the usable processors, and to the tokens it gets from the shared
+ * pool if there is one. Called at the start of every procedure, so a
+ * limit doesn't outlive its call in the resident extension.
+ */
+static void
+heifplugin_set_thread_budget (gint max_threads)
+{
+  heifplugin_thread_limit = MAX (max_threads, 0);
 
-  has_alpha = gimp_drawable_has_alpha (drawable);
+  heifplugin_refresh_thread_budget ();
+}
 
-  switch (save_bit_depth)
-    {
-    case 8:
-      err = heif_image_create (width, height,
-                               heif_colorspace_RGB,
-                               has_alpha ?
-                               heif_chroma_interleaved_RGBA :
-                               heif_chroma_interleaved_RGB,
-                               &h_image);
-      break;
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-    case 10:
-    case 12:
-#if ( G_BYTE_ORDER == G_LITTLE_ENDIAN )
-      err = heif_image_create (width, height,
-                               heif_colorspace_RGB,
-                               has_alpha ?
-                               heif_chroma_interleaved_RRGGBBAA_LE :
-                               heif_chroma_interleaved_RRGGBB_LE,
-                               &h_image);
-#else
-      err = heif_image_create (width, height,
-                               heif_colorspace_RGB,
-                               has_alpha ?
-                               heif_chroma_interleaved_RRGGBBAA_BE :
-                               heif_chroma_interleaved_RRGGBB_BE,
-                               &h_image);
-#endif
-      break;
+/* Give the tokens of the last procedure back to the shared pool. */
+static void
+heifplugin_release_thread_budget (void)
+{
+#ifdef G_OS_UNIX
+  HeifpluginTokenPool *pool = heifplugin_token_pool_get ();
+
+  if (pool)
+    heifplugin_token_pool_release (pool);
 #endif
-    default:
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   "Unsupported bit depth: %d",
-                   save_bit_depth);
-      heif_context_free (context);
-      return FALSE;
-      break;
-    }
+}
 
-  if (err.code != 0)
+/* Run func for every job in [0, n_jobs) on up to max_threads threads
+ * (0 for the default) and return when all of them are finished. The
+ * calling thread takes part in the work, so nested calls from within a
+ * job can't dead-lock the pool.
+ */
+static void
+heifplugin_parallel_run (gint                   n_jobs,
+                         gint                   max_threads,
+                         HeifpluginParallelFunc func,
+                         gpointer               user_data)
+{
+  HeifpluginParallelTask *task;
+  gint                    n_threads;
+  gint                    i;
+
+  if (max_threads <= 0)
+    max_threads = heifplugin_get_num_threads ();
+
+  n_threads = MIN (max_threads, n_jobs);
+
+  if (n_threads <= 1)
     {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   _("Encoding HEIF image failed: %s"),
-                   err.message);
-      heif_context_free (context);
-      return FALSE;
+      for (i = 0; i < n_jobs; i++)
+        func (i, user_data);
+
+      return;
     }
 
-#if LIBHEIF_HAVE_VERSION(1,4,0)
-  if (save_profile)
+  task = g_slice_new0 (HeifpluginParallelTask);
+  task->func      = func;
+  task->user_data = user_data;
+  task->n_jobs    = n_jobs;
+  task->ref_count = 1;
+  g_mutex_init (&task->mutex);
+  g_cond_init (&task->cond);
+
+  for (i = 1; i < n_threads; i++)
     {
-      GimpColorProfile *profile = NULL;
-      const guint8     *icc_data;
-      gsize             icc_length;
+      g_atomic_int_inc (&task->ref_count);
+      g_thread_pool_push (heifplugin_parallel_get_pool (), task, NULL);
+    }
 
-      profile = gimp_image_get_color_profile (image);
-      if (profile && gimp_color_profile_is_linear (profile))
-        out_linear = TRUE;
+  heifplugin_parallel_task_process (task);
 
-      if (! profile)
-        {
-          profile = gimp_image_get_effective_color_profile (image);
+  g_mutex_lock (&task->mutex);
+  while (task->n_finished < task->n_jobs)
+    g_cond_wait (&task->cond, &task->mutex);
+  g_mutex_unlock (&task->mutex);
 
-          if (gimp_color_profile_is_linear (profile))
-            {
-              if (gimp_image_get_precision (image) != GIMP_PRECISION_U8_LINEAR)
-                {
-                  /* If stored data was linear, let's convert the profile. */
-                  GimpColorProfile *saved_profile;
+  heifplugin_parallel_task_unref (task);
+}
 
-                  saved_profile = gimp_color_profile_new_srgb_trc_from_color_profile (profile);
-                  g_clear_object (&profile);
-                  profile = saved_profile;
-                }
-              else
-                {
-                  /* Keep linear profile as-is for 8-bit linear image. */
-                  out_linear = TRUE;
-                }
-            }
+
+/*  pixel transfer between heif planes and GEGL buffers  */
+
+typedef struct
+{
+  GeglBuffer   *buffer;
+  const Babl   *format;
+  guint8       *data;         /* first row of the interleaved plane */
+  gint          stride;
+  gint          dest_x;       /* buffer position of the plane */
+  gint          dest_y;
+  gint          width;
+  gint          height;
+  gint          n_components;
+  gint          bit_depth;
+  gint          band_height;
+  gboolean      high_precision;
+} HeifpluginBands;
+
+static void
+heifplugin_bands_init (HeifpluginBands *bands,
+                       GeglBuffer      *buffer,
+                       const Babl      *format,
+                       guint8          *data,
+                       gint             stride,
+                       gint             width,
+                       gint             height,
+                       gboolean         has_alpha,
+                       gint             bit_depth)
+{
+  memset (bands, 0, sizeof (HeifpluginBands));
+
+  bands->buffer       = buffer;
+  bands->format       = format;
+  bands->data         = data;
+  bands->stride       = stride;
+  bands->width        = width;
+  bands->height       = height;
+  bands->n_components = has_alpha ? 4 : 3;
+  bands->bit_depth    = bit_depth;
+  bands->band_height  = gimp_tile_height ();
+}
+
+static gint
+heifplugin_bands_get_n_jobs (const HeifpluginBands *bands)
+{
+  return (bands->height + bands->band_height - 1) / bands->band_height;
+}
+
+/* Expand one band of a decoded interleaved plane in place and send it
+ * to the buffer.
+ */
+static void
+heifplugin_load_band (gint     job,
+                      gpointer user_data)
+{
+  const HeifpluginBands *bands = user_data;
+  gint                   y     = job * bands->band_height;
+  gint                   n_rows;
+  guint8                *band;
+  gint                   row;
+
+  n_rows = MIN (bands->band_height, bands->height - y);
+  band   = bands->data + (gsize) y * bands->stride;
+
+  if (bands->bit_depth > 8)
+    {
+      gsize rowentries = (gsize) bands->width * bands->n_components;
+
+      for (row = 0; row < n_rows; row++)
+        {
+          uint16_t *row16 = (uint16_t *) (band + (gsize) row * bands->stride);
+
+          heifplugin_expand_to_u16 (row16, row16, rowentries,
+                                    bands->bit_depth);
         }
+    }
 
-#if LIBHEIF_HAVE_VERSION(1,10,0)
-      if (pixel_format == HEIFPLUGIN_EXPORT_FORMAT_RGB)
+  gegl_buffer_set (bands->buffer,
+                   GEGL_RECTANGLE (bands->dest_x, bands->dest_y + y,
+                                   bands->width, n_rows),
+                   0, bands->format, band, bands->stride);
+}
+
+/* Fetch one band from the buffer into an interleaved plane, quantizing
+ * it to the plane's bit depth.
+ */
+static void
+heifplugin_save_band (gint     job,
+                      gpointer user_data)
+{
+  const HeifpluginBands *bands = user_data;
+  gint                   y     = job * bands->band_height;
+  gsize                  rowentries;
+  gint                   n_rows;
+  guint8                *band;
+  gfloat                *band_float = NULL;
+  gint                   row;
+
+  n_rows     = MIN (bands->band_height, bands->height - y);
+  band       = bands->data + (gsize) y * bands->stride;
+  rowentries = (gsize) bands->width * bands->n_components;
+
+  if (bands->high_precision)
+    band_float = g_malloc_n (n_rows, rowentries * sizeof (gfloat));
+
+  gegl_buffer_get (bands->buffer,
+                   GEGL_RECTANGLE (bands->dest_x, bands->dest_y + y,
+                                   bands->width, n_rows),
+                   1.0, bands->format,
+                   band_float ? (gpointer) band_float : (gpointer) band,
+                   band_float ? GEGL_AUTO_ROWSTRIDE : bands->stride,
+                   GEGL_ABYSS_NONE);
+
+  if (bands->bit_depth > 8)
+    {
+      for (row = 0; row < n_rows; row++)
         {
-          nclx_profile.version = 1;
-          nclx_profile.color_primaries = heif_color_primaries_unspecified;
+          uint16_t *row16 = (uint16_t *) (band + (gsize) row * bands->stride);
 
-          if (out_linear)
-            {
-              nclx_profile.transfer_characteristics = heif_transfer_characteristic_linear;
-            }
+          if (band_float)
+            heifplugin_quantize_from_float (band_float + row * rowentries,
+                                            row16, rowentries,
+                                            bands->bit_depth);
           else
-            {
-              nclx_profile.transfer_characteristics = heif_transfer_characteristic_unspecified;
-            }
+            heifplugin_quantize_from_u16 (row16, row16, rowentries,
+                                          bands->bit_depth);
+        }
+    }
 
-          nclx_profile.matrix_coefficients = heif_matrix_coefficients_RGB_GBR;
-          nclx_profile.full_range_flag = 1;
+  g_free (band_float);
+}
 
-          heif_image_set_nclx_color_profile (h_image, &nclx_profile);
-        }
+/*  YCbCr to RGB conversion  */
+
+/* R'G'B' = coeffs * (Y', Cb', Cr', 1) on the raw samples, giving R'G'B'
+ * in [0, 1]. The range offsets and scales of the samples are folded
+ * into the coefficients, so every matrix, GBR and monochrome included,
+ * is the same nine multiply-adds per pixel.
+ */
+typedef struct
+{
+  gfloat coeffs[3][4];   /* per component: Y', Cb', Cr' and constant */
+} HeifpluginYCbCrMatrix;
+
+/* The luma weights Kr and Kb of an nclx matrix_coefficients value.
+ * Returns FALSE for matrices that aren't such a weighting of R'G'B'.
+ */
+static gboolean
+heifplugin_get_luma_weights (gint    matrix_coefficients,
+                             gfloat *kr,
+                             gfloat *kb)
+{
+  switch (matrix_coefficients)
+    {
+    case 1: /* BT.709 */
+      *kr = 0.2126f;
+      *kb = 0.0722f;
+      return TRUE;
+
+    case 4: /* FCC */
+      *kr = 0.30f;
+      *kb = 0.11f;
+      return TRUE;
+
+    case 7: /* SMPTE 240M */
+      *kr = 0.212f;
+      *kb = 0.087f;
+      return TRUE;
+
+    case 9: /* BT.2020 non-constant luminance */
+      *kr = 0.2627f;
+      *kb = 0.0593f;
+      return TRUE;
+
+    case 2: /* unspecified */
+    case 5: /* BT.470 B/G */
+    case 6: /* BT.601 */
+      *kr = 0.299f;
+      *kb = 0.114f;
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
+
+static gboolean
+heifplugin_matrix_is_supported (gint matrix_coefficients)
+{
+  gfloat kr;
+  gfloat kb;
+
+  return (matrix_coefficients == 0 || /* RGB, GBR */
+          matrix_coefficients == 8 || /* YCgCo */
+          heifplugin_get_luma_weights (matrix_coefficients, &kr, &kb));
+}
+
+/* Set up the conversion for the planes of img, a natively decoded image
+ * of handle. The nclx profile is taken from img, where libheif merges
+ * the container's with the one of the bitstream, and from handle only
+ * if img has none. Returns FALSE if the matrix isn't supported here,
+ * the matrix is then set up for BT.601, like libheif does.
+ */
+static gboolean
+heifplugin_ycbcr_matrix_init (HeifpluginYCbCrMatrix    *matrix,
+                              struct heif_image        *img,
+                              struct heif_image_handle *handle,
+                              gint                      bit_depth)
+{
+  gint     matrix_coefficients = 2;  /* unspecified */
+  gboolean full_range          = TRUE;
+  gfloat   max_value           = (1 << bit_depth) - 1;
+  gfloat   range_scale         = (gfloat) (1 << bit_depth) / 256.0f;
+  gboolean supported           = TRUE;
+  gfloat   y_offset;
+  gfloat   y_scale;
+  gfloat   c_offset;
+  gfloat   c_scale;
+  gfloat   m[3][3];                  /* R'G'B' from Y', Cb', Cr' */
+  gfloat   kr;
+  gfloat   kb;
+  gfloat   kg;
+  gint     i;
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+  {
+    struct heif_color_profile_nclx *nclx = NULL;
+    struct heif_error               err;
+
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+    err = heif_image_get_nclx_color_profile (img, &nclx);
+
+    if (err.code || ! nclx)
 #endif
+      err = heif_image_handle_get_nclx_color_profile (handle, &nclx);
 
-      icc_data = gimp_color_profile_get_icc_profile (profile, &icc_length);
-      heif_image_set_raw_color_profile (h_image, "prof", icc_data, icc_length);
-      space = gimp_color_profile_get_space (profile,
-                                            GIMP_COLOR_RENDERING_INTENT_RELATIVE_COLORIMETRIC,
-                                            error);
-      if (error && *error)
-        {
-          /* Don't make this a hard failure yet output the error. */
-          g_printerr ("%s: error getting the profile space: %s",
-                      G_STRFUNC, (*error)->message);
-          g_clear_error (error);
-        }
+    if (! err.code && nclx)
+      {
+        matrix_coefficients = nclx->matrix_coefficients;
+        full_range          = nclx->full_range_flag;
 
-      g_object_unref (profile);
+        heif_nclx_color_profile_free (nclx);
+      }
+  }
+#endif
+
+  /* planar RGB, the planes are used as G, B and R */
+  if (heif_image_get_colorspace (img) == heif_colorspace_RGB)
+    matrix_coefficients = 0;
+
+  if (full_range)
+    {
+      y_offset = 0.0f;
+      y_scale  = 1.0f / max_value;
+      c_offset = 1 << (bit_depth - 1);
+      c_scale  = 1.0f / max_value;
     }
   else
     {
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-      /* We save as sRGB */
+      y_offset = 16.0f * range_scale;
+      y_scale  = 1.0f / (219.0f * range_scale);
+      c_offset = 128.0f * range_scale;
+      c_scale  = 1.0f / (224.0f * range_scale);
+    }
 
-      nclx_profile.version = 1;
-      nclx_profile.color_primaries = heif_color_primaries_ITU_R_BT_709_5;
-      nclx_profile.transfer_characteristics = heif_transfer_characteristic_IEC_61966_2_1;
-      nclx_profile.matrix_coefficients = heif_matrix_coefficients_ITU_R_BT_601_6;
-      nclx_profile.full_range_flag = 1;
+  memset (m, 0, sizeof (m));
 
-#if LIBHEIF_HAVE_VERSION(1,10,0)
-      if (pixel_format == HEIFPLUGIN_EXPORT_FORMAT_RGB)
+  if (heif_image_get_chroma_format (img) == heif_chroma_monochrome)
+    {
+      m[0][0] = m[1][0] = m[2][0] = 1.0f;
+    }
+  else if (matrix_coefficients == 0) /* RGB, GBR */
+    {
+      c_offset = y_offset;
+      c_scale  = y_scale;
+
+      m[0][2] = 1.0f;
+      m[1][0] = 1.0f;
+      m[2][1] = 1.0f;
+    }
+  else if (matrix_coefficients == 8) /* YCgCo, Cb' is Cg' and Cr' Co' */
+    {
+      m[0][0] = m[1][0] = m[2][0] = 1.0f;
+
+      m[0][1] = -1.0f;
+      m[0][2] =  1.0f;
+      m[1][1] =  1.0f;
+      m[2][1] = -1.0f;
+      m[2][2] = -1.0f;
+    }
+  else
+    {
+      if (! heifplugin_get_luma_weights (matrix_coefficients, &kr, &kb))
         {
-          nclx_profile.matrix_coefficients = heif_matrix_coefficients_RGB_GBR;
+          supported = FALSE;
+          kr = 0.299f;
+          kb = 0.114f;
         }
-#endif
 
-      heif_image_set_nclx_color_profile (h_image, &nclx_profile);
+      kg = 1.0f - kr - kb;
 
-      space = babl_space ("sRGB");
-      out_linear = FALSE;
-#endif
+      m[0][0] = m[1][0] = m[2][0] = 1.0f;
+
+      m[0][2] = 2.0f * (1.0f - kr);
+      m[1][1] = -2.0f * kb * (1.0f - kb) / kg;
+      m[1][2] = -2.0f * kr * (1.0f - kr) / kg;
+      m[2][1] = 2.0f * (1.0f - kb);
     }
-#endif /* LIBHEIF_HAVE_VERSION(1,4,0) */
 
-  if (! space)
-    space = gimp_drawable_get_format (drawable);
+  for (i = 0; i < 3; i++)
+    {
+      matrix->coeffs[i][0] = m[i][0] * y_scale;
+      matrix->coeffs[i][1] = m[i][1] * c_scale;
+      matrix->coeffs[i][2] = m[i][2] * c_scale;
+      matrix->coeffs[i][3] = -(m[i][0] * y_scale * y_offset +
+                               (m[i][1] + m[i][2]) * c_scale * c_offset);
+    }
+
+  return supported;
+}
+
+/* Cb and Cr are ignored for monochrome images, pass 0. */
+static inline void
+heifplugin_ycbcr_to_rgb (const HeifpluginYCbCrMatrix *matrix,
+                         gfloat                       y,
+                         gfloat                       cb,
+                         gfloat                       cr,
+                         gfloat                      *rgb)
+{
+  gint i;
+
+  for (i = 0; i < 3; i++)
+    rgb[i] = matrix->coeffs[i][0] * y  +
+             matrix->coeffs[i][1] * cb +
+             matrix->coeffs[i][2] * cr +
+             matrix->coeffs[i][3];
+}
+
+static inline guint8
+heifplugin_float_to_u8 (gfloat value)
+{
+  return (guint8) (CLAMP (value, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+/* Add rows [y0, y1) of a plane to the per-column sums. */
+static void
+heifplugin_accumulate_rows_c (const guint8 *data,
+                              gint          stride,
+                              gint          width,
+                              gint          y0,
+                              gint          y1,
+                              gint          bit_depth,
+                              guint64      *sums)
+{
+  gint x, y;
 
+  memset (sums, 0, width * sizeof (guint64));
 
-  if (save_bit_depth > 8)
+  for (y = y0; y < y1; y++)
     {
-      uint16_t       *data16;
-      const uint16_t *src16;
-      uint16_t       *dest16;
-      gint            x, y, rowentries;
-      int             tmp_pixelval;
+      const guint8 *row = data + (gsize) y * stride;
 
-      if (has_alpha)
+      if (bit_depth > 8)
         {
-          rowentries = width * 4;
+          const guint16 *row16 = (const guint16 *) row;
 
-          if (out_linear)
-            encoding = "RGBA u16";
-          else
-            encoding = "R'G'B'A u16";
+          for (x = 0; x < width; x++)
+            sums[x] += row16[x];
         }
-      else /* no alpha */
+      else
         {
-          rowentries = width * 3;
+          for (x = 0; x < width; x++)
+            sums[x] += row[x];
+        }
+    }
+}
 
-          if (out_linear)
-            encoding = "RGB u16";
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+/* Sum a block of 8 (high bit depth) or 16 columns down all the rows in
+ * 32 bit lanes before adding it to the 64 bit sums, so the sums are
+ * touched once per block rather than once per row. 65536 rows of 16 bit
+ * samples still fit in 32 bits, taller areas go in several passes.
+ */
+__attribute__ ((target ("sse2")))
+static void
+heifplugin_accumulate_rows_sse2 (const guint8 *data,
+                                 gint          stride,
+                                 gint          width,
+                                 gint          y0,
+                                 gint          y1,
+                                 gint          bit_depth,
+                                 guint64      *sums)
+{
+  const __m128i zero  = _mm_setzero_si128 ();
+  const gint    block = bit_depth > 8 ? 8 : 16;
+  gint          x     = 0;
+
+  memset (sums, 0, width * sizeof (guint64));
+
+  for (; x + block <= width; x += block)
+    {
+      gint y;
+
+      for (y = y0; y < y1; y += 65536)
+        {
+          gint    y_end = MIN (y1, y + 65536);
+          __m128i s[4]  = { zero, zero, zero, zero };
+          guint32 tmp[16];
+          gint    i;
+
+          if (bit_depth > 8)
+            {
+              for (i = y; i < y_end; i++)
+                {
+                  const guint16 *row = (const guint16 *) (data + (gsize) i * stride);
+                  __m128i        v   = _mm_loadu_si128 ((const __m128i *) (row + x));
+
+                  s[0] = _mm_add_epi32 (s[0], _mm_unpacklo_epi16 (v, zero));
+                  s[1] = _mm_add_epi32 (s[1], _mm_unpackhi_epi16 (v, zero));
+                }
+            }
           else
-            encoding = "R'G'B' u16";
+            {
+              for (i = y; i < y_end; i++)
+                {
+                  const guint8 *row = data + (gsize) i * stride;
+                  __m128i       v   = _mm_loadu_si128 ((const __m128i *) (row + x));
+                  __m128i       lo  = _mm_unpacklo_epi8 (v, zero);
+                  __m128i       hi  = _mm_unpackhi_epi8 (v, zero);
+
+                  s[0] = _mm_add_epi32 (s[0], _mm_unpacklo_epi16 (lo, zero));
+                  s[1] = _mm_add_epi32 (s[1], _mm_unpackhi_epi16 (lo, zero));
+                  s[2] = _mm_add_epi32 (s[2], _mm_unpacklo_epi16 (hi, zero));
+                  s[3] = _mm_add_epi32 (s[3], _mm_unpackhi_epi16 (hi, zero));
+                }
+            }
+
+          for (i = 0; i < 4; i++)
+            _mm_storeu_si128 ((__m128i *) tmp + i, s[i]);
+
+          for (i = 0; i < block; i++)
+            sums[x + i] += tmp[i];
         }
+    }
 
-      data16 = g_malloc_n (height, rowentries * 2);
-      src16 = data16;
+  heifplugin_accumulate_rows_c (data + x * (bit_depth > 8 ? 2 : 1), stride,
+                                width - x, y0, y1, bit_depth, sums + x);
+}
+#endif
 
-      format = babl_format_with_space (encoding, space);
+static void
+heifplugin_accumulate_rows (const guint8 *data,
+                            gint          stride,
+                            gint          width,
+                            gint          y0,
+                            gint          y1,
+                            gint          bit_depth,
+                            guint64      *sums)
+{
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+  if (gimp_cpu_accel_get_support () & GIMP_CPU_ACCEL_X86_SSE2)
+    {
+      heifplugin_accumulate_rows_sse2 (data, stride, width, y0, y1,
+                                       bit_depth, sums);
+      return;
+    }
+#endif
 
-      buffer = gimp_drawable_get_buffer (drawable);
+  heifplugin_accumulate_rows_c (data, stride, width, y0, y1, bit_depth, sums);
+}
 
-      gegl_buffer_get (buffer,
-                       GEGL_RECTANGLE (0, 0, width, height),
-                       1.0, format, data16, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+static inline gfloat
+heifplugin_box_average (const guint64 *sums,
+                        gint           x0,
+                        gint           x1,
+                        gint           n_rows)
+{
+  guint64 sum = 0;
+  gint    x;
+
+  for (x = x0; x < x1; x++)
+    sum += sums[x];
+
+  return (gfloat) sum / (gfloat) ((x1 - x0) * n_rows);
+}
+
+/* Box filter a natively decoded YCbCr (or monochrome) image down to
+ * width x height and convert it to 8 bit interleaved RGB(A) in the same
+ * pass, so no full resolution RGB image is ever built. Since the color
+ * conversion is affine, averaging before converting gives the same
+ * result as converting first. Summing the full resolution rows is
+ * the only per source pixel work, so that is what has a SIMD kernel;
+ * the conversion runs once per thumbnail pixel. Returns NULL if the
+ * image isn't in a layout handled here.
+ */
+static struct heif_image *
+heifplugin_downscale_ycbcr (struct heif_image           *src,
+                            struct heif_image_handle    *handle,
+                            gint                         width,
+                            gint                         height,
+                            gboolean                     with_alpha)
+{
+  struct heif_image     *dest       = NULL;
+  HeifpluginYCbCrMatrix  matrix;
+  enum heif_chroma       chroma;
+  const guint8          *planes[4]  = { NULL, };
+  gint                   strides[4] = { 0, };
+  gint                   widths[4]  = { 0, };
+  gint                   heights[4] = { 0, };
+  guint64               *sums[4]    = { NULL, };
+  gint                   shift_x    = 0;
+  gint                   shift_y    = 0;
+  gint                   bit_depth;
+  gint                   n_planes;
+  guint8                *dest_data;
+  gint                   dest_stride;
+  gint                   n_components;
+  gint                   src_width;
+  gint                   src_height;
+  gint                   x, y, i;
+
+  if (heif_image_get_colorspace (src) != heif_colorspace_YCbCr &&
+      heif_image_get_colorspace (src) != heif_colorspace_monochrome)
+    return NULL;
+
+  chroma = heif_image_get_chroma_format (src);
+
+  switch (chroma)
+    {
+    case heif_chroma_monochrome:
+      n_planes = 1;
+      break;
+
+    case heif_chroma_420:
+      shift_y = 1;
+      /* fall through */
+    case heif_chroma_422:
+      shift_x = 1;
+      /* fall through */
+    case heif_chroma_444:
+      n_planes = 3;
+      break;
+
+    default:
+      return NULL;
+    }
+
+  bit_depth = heif_image_get_bits_per_pixel_range (src, heif_channel_Y);
+  if (bit_depth < 1 || bit_depth > 16)
+    return NULL;
+
+  heifplugin_ycbcr_matrix_init (&matrix, src, handle, bit_depth);
+
+  src_width  = heif_image_get_width  (src, heif_channel_Y);
+  src_height = heif_image_get_height (src, heif_channel_Y);
+
+  for (i = 0; i < 4; i++)
+    {
+      static const enum heif_channel channels[4] =
+        {
+          heif_channel_Y, heif_channel_Cb, heif_channel_Cr, heif_channel_Alpha
+        };
+
+      if (i >= n_planes && i != 3)
+        continue;
+
+      if (i == 3 && ! (with_alpha &&
+                       heif_image_has_channel (src, heif_channel_Alpha)))
+        continue;
+
+      if (heif_image_get_bits_per_pixel_range (src, channels[i]) != bit_depth)
+        return NULL;
+
+      planes[i]  = heif_image_get_plane_readonly (src, channels[i],
+                                                  &strides[i]);
+      widths[i]  = heif_image_get_width  (src, channels[i]);
+      heights[i] = heif_image_get_height (src, channels[i]);
+
+      if (! planes[i])
+        return NULL;
+    }
+
+  n_components = with_alpha ? 4 : 3;
+
+  heif_image_create (width, height, heif_colorspace_RGB,
+                     with_alpha ?
+                     heif_chroma_interleaved_RGBA :
+                     heif_chroma_interleaved_RGB,
+                     &dest);
+  heif_image_add_plane (dest, heif_channel_interleaved, width, height, 8);
+
+  dest_data = heif_image_get_plane (dest, heif_channel_interleaved,
+                                    &dest_stride);
+
+  for (i = 0; i < 4; i++)
+    if (planes[i])
+      sums[i] = g_new (guint64, widths[i]);
+
+  for (y = 0; y < height; y++)
+    {
+      guint8 *dest_row = dest_data + (gsize) y * dest_stride;
+      gint    y0       = (gint64) y * src_height / height;
+      gint    y1       = MAX ((gint64) (y + 1) * src_height / height, y0 + 1);
+      gint    c_y0     = y0 >> shift_y;
+      gint    c_y1     = MIN (((y1 - 1) >> shift_y) + 1, heights[1]);
+
+      heifplugin_accumulate_rows (planes[0], strides[0], widths[0],
+                                  y0, y1, bit_depth, sums[0]);
+
+      if (planes[3])
+        heifplugin_accumulate_rows (planes[3], strides[3], widths[3],
+                                    y0, y1, bit_depth, sums[3]);
+
+      if (n_planes == 3)
+        {
+          heifplugin_accumulate_rows (planes[1], strides[1], widths[1],
+                                      c_y0, c_y1, bit_depth, sums[1]);
+          heifplugin_accumulate_rows (planes[2], strides[2], widths[2],
+                                      c_y0, c_y1, bit_depth, sums[2]);
+        }
+
+      for (x = 0; x < width; x++)
+        {
+          guint8 *pixel = dest_row + x * n_components;
+          gint    x0    = (gint64) x * src_width / width;
+          gint    x1    = MAX ((gint64) (x + 1) * src_width / width, x0 + 1);
+          gfloat  cb    = 0.0f;
+          gfloat  cr    = 0.0f;
+          gfloat  luma;
+          gfloat  rgb[3];
+
+          luma = heifplugin_box_average (sums[0], x0, x1, y1 - y0);
+
+          if (n_planes == 3)
+            {
+              gint c_x0 = x0 >> shift_x;
+              gint c_x1 = MIN (((x1 - 1) >> shift_x) + 1, widths[1]);
+
+              cb = heifplugin_box_average (sums[1], c_x0, c_x1, c_y1 - c_y0);
+              cr = heifplugin_box_average (sums[2], c_x0, c_x1, c_y1 - c_y0);
+            }
+
+          heifplugin_ycbcr_to_rgb (&matrix, luma, cb, cr, rgb);
+
+          pixel[0] = heifplugin_float_to_u8 (rgb[0]);
+          pixel[1] = heifplugin_float_to_u8 (rgb[1]);
+          pixel[2] = heifplugin_float_to_u8 (rgb[2]);
+
+          if (with_alpha)
+            {
+              if (planes[3])
+                pixel[3] =
+                  heifplugin_float_to_u8 (heifplugin_box_average (sums[3],
+                                                                  x0, x1,
+                                                                  y1 - y0) /
+                                          ((1 << bit_depth) - 1));
+              else
+                pixel[3] = 255;
+            }
+        }
+    }
+
+  for (i = 0; i < 4; i++)
+    g_free (sums[i]);
+
+  return dest;
+}
+
+/*  YCbCr row kernels  */
+
+/* What the row kernels need to turn rows of raw Y', Cb', Cr' and alpha
+ * samples, already converted to float, into pixels of the layer format.
+ */
+typedef struct
+{
+  gfloat   coeffs[3][4];    /* the matrix, scaled to max_value */
+  gfloat   alpha_scale;     /* raw alpha to max_value */
+  gfloat   max_value;       /* 255 or 65535 */
+  gint     n_components;
+  gboolean high_bit_depth;  /* u16 rather than u8 pixels */
+  gboolean premultiplied;   /* R'G'B' were multiplied by alpha */
+} HeifpluginYCbCrPack;
+
+typedef void (* HeifpluginYCbCrPackFunc) (const HeifpluginYCbCrPack *pack,
+                                          const gfloat              *y,
+                                          const gfloat              *cb,
+                                          const gfloat              *cr,
+                                          const gfloat              *alpha,
+                                          gint                       width,
+                                          gpointer                   dest);
+
+static void
+heifplugin_ycbcr_pack_c (const HeifpluginYCbCrPack *pack,
+                         const gfloat              *y,
+                         const gfloat              *cb,
+                         const gfloat              *cr,
+                         const gfloat              *alpha,
+                         gint                       width,
+                         gpointer                   dest)
+{
+  guint8  *dest8  = dest;
+  guint16 *dest16 = dest;
+  gint     x;
+
+  for (x = 0; x < width; x++)
+    {
+      gfloat v[4];
+      gint   i;
+
+      v[3] = alpha[x] * pack->alpha_scale;
+
+      for (i = 0; i < 3; i++)
+        {
+          v[i] = pack->coeffs[i][0] * y[x]  +
+                 pack->coeffs[i][1] * cb[x] +
+                 pack->coeffs[i][2] * cr[x] +
+                 pack->coeffs[i][3];
+
+          if (pack->premultiplied)
+            v[i] = v[3] > 0.0f ? v[i] * pack->max_value / v[3] : 0.0f;
+        }
+
+      for (i = 0; i < pack->n_components; i++)
+        {
+          gfloat value = CLAMP (v[i], 0.0f, pack->max_value) + 0.5f;
+
+          if (pack->high_bit_depth)
+            dest16[x * pack->n_components + i] = (guint16) value;
+          else
+            dest8[x * pack->n_components + i] = (guint8) value;
+        }
+    }
+}
+
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+/* Four pixels at a time: the matrix on four Y', Cb', Cr' each, then the
+ * R, G, B and A vectors are packed and interleaved to RGBA. SSE2 can't
+ * drop every fourth sample cheaply, so RGB goes through a small buffer.
+ */
+__attribute__ ((target ("sse2")))
+static void
+heifplugin_ycbcr_pack_sse2 (const HeifpluginYCbCrPack *pack,
+                            const gfloat              *y,
+                            const gfloat              *cb,
+                            const gfloat              *cr,
+                            const gfloat              *alpha,
+                            gint                       width,
+                            gpointer                   dest)
+{
+  const __m128  zero   = _mm_setzero_ps ();
+  const __m128  max    = _mm_set1_ps (pack->max_value);
+  const __m128  half   = _mm_set1_ps (0.5f);
+  const __m128  ascale = _mm_set1_ps (pack->alpha_scale);
+  const __m128i bias   = _mm_set1_epi32 (0x8000);
+  const __m128i sign   = _mm_set1_epi16 ((gint16) 0x8000);
+  const gint    n      = pack->n_components;
+  const gint    size   = pack->high_bit_depth ? 2 : 1;
+  guint8       *dest8  = dest;
+  __m128        c[3][4];
+  gint          x      = 0;
+  gint          i;
+
+  for (i = 0; i < 3; i++)
+    {
+      c[i][0] = _mm_set1_ps (pack->coeffs[i][0]);
+      c[i][1] = _mm_set1_ps (pack->coeffs[i][1]);
+      c[i][2] = _mm_set1_ps (pack->coeffs[i][2]);
+      c[i][3] = _mm_set1_ps (pack->coeffs[i][3]);
+    }
+
+  for (; x + 4 <= width; x += 4)
+    {
+      __m128  vy = _mm_loadu_ps (y + x);
+      __m128  vb = _mm_loadu_ps (cb + x);
+      __m128  vr = _mm_loadu_ps (cr + x);
+      __m128  v[4];
+      __m128i p[4];
+      __m128i rg;
+      __m128i ba;
+      __m128i t0;
+      __m128i t1;
+      guint8 *out = dest8 + (gsize) x * n * size;
+      guint8  tmp[32];
+
+      v[3] = _mm_mul_ps (_mm_loadu_ps (alpha + x), ascale);
+
+      for (i = 0; i < 3; i++)
+        {
+          /* in the order of the C version, for identical results */
+          v[i] = _mm_add_ps (_mm_mul_ps (c[i][0], vy),
+                             _mm_mul_ps (c[i][1], vb));
+          v[i] = _mm_add_ps (_mm_add_ps (v[i], _mm_mul_ps (c[i][2], vr)),
+                             c[i][3]);
+
+          if (pack->premultiplied)
+            {
+              /* 0 where alpha is 0, which also drops the inf and NaN
+               * of the division
+               */
+              __m128 mask = _mm_cmpgt_ps (v[3], zero);
+
+              v[i] = _mm_and_ps (_mm_div_ps (_mm_mul_ps (v[i], max), v[3]),
+                                 mask);
+            }
+        }
+
+      for (i = 0; i < 4; i++)
+        {
+          v[i] = _mm_min_ps (_mm_max_ps (v[i], zero), max);
+          p[i] = _mm_cvttps_epi32 (_mm_add_ps (v[i], half));
+        }
+
+      if (pack->high_bit_depth)
+        {
+          /* SSE2 has no unsigned 32 -> 16 bit pack, go through signed */
+          rg = _mm_xor_si128 (_mm_packs_epi32 (_mm_sub_epi32 (p[0], bias),
+                                               _mm_sub_epi32 (p[1], bias)),
+                              sign);
+          ba = _mm_xor_si128 (_mm_packs_epi32 (_mm_sub_epi32 (p[2], bias),
+                                               _mm_sub_epi32 (p[3], bias)),
+                              sign);
+        }
+      else
+        {
+          rg = _mm_packs_epi32 (p[0], p[1]);
+          ba = _mm_packs_epi32 (p[2], p[3]);
+        }
+
+      /* r0..r3 g0..g3 and b0..b3 a0..a3 to r0 g0 b0 a0 r1 ... */
+      t0 = _mm_unpacklo_epi16 (rg, ba);
+      t1 = _mm_unpackhi_epi16 (rg, ba);
+      rg = _mm_unpacklo_epi16 (t0, t1);
+      ba = _mm_unpackhi_epi16 (t0, t1);
+
+      if (n == 4)
+        {
+          if (pack->high_bit_depth)
+            {
+              _mm_storeu_si128 ((__m128i *) out, rg);
+              _mm_storeu_si128 ((__m128i *) (out + 16), ba);
+            }
+          else
+            {
+              _mm_storeu_si128 ((__m128i *) out, _mm_packus_epi16 (rg, ba));
+            }
+        }
+      else
+        {
+          if (pack->high_bit_depth)
+            {
+              _mm_storeu_si128 ((__m128i *) tmp, rg);
+              _mm_storeu_si128 ((__m128i *) (tmp + 16), ba);
+            }
+          else
+            {
+              _mm_storeu_si128 ((__m128i *) tmp, _mm_packus_epi16 (rg, ba));
+            }
+
+          for (i = 0; i < 4; i++)
+            memcpy (out + i * 3 * size, tmp + i * 4 * size, 3 * size);
+        }
+    }
+
+  heifplugin_ycbcr_pack_c (pack, y + x, cb + x, cr + x, alpha + x,
+                           width - x, dest8 + (gsize) x * n * size);
+}
+#endif
+
+static HeifpluginYCbCrPackFunc
+heifplugin_get_ycbcr_pack_func (void)
+{
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+  if (gimp_cpu_accel_get_support () & GIMP_CPU_ACCEL_X86_SSE2)
+    return heifplugin_ycbcr_pack_sse2;
+#endif
+
+  return heifplugin_ycbcr_pack_c;
+}
+
+/* Convert width samples of row, starting at x, to float. */
+static void
+heifplugin_samples_to_float (const guint8 *row,
+                             gint          x,
+                             gint          width,
+                             gboolean      high_bit_depth,
+                             gfloat       *dest)
+{
+  gint i;
+
+  if (high_bit_depth)
+    {
+      const guint16 *row16 = (const guint16 *) row + x;
+
+      for (i = 0; i < width; i++)
+        dest[i] = row16[i];
+    }
+  else
+    {
+      row += x;
+
+      for (i = 0; i < width; i++)
+        dest[i] = row[i];
+    }
+}
+
+/* Converting natively decoded YCbCr planes ourselves saves libheif's
+ * conversion to interleaved RGB and the separate bit depth expansion:
+ * each band is upsampled, converted and expanded in one pass into the
+ * layer's format and handed to GEGL from there.
+ */
+typedef struct
+{
+  HeifpluginBands          bands;
+  HeifpluginYCbCrPack      pack;
+  HeifpluginYCbCrPackFunc  pack_func;
+  const guint8            *planes[4];     /* Y, Cb, Cr and alpha */
+  gint                     strides[4];
+  gint                     n_planes;
+  gint                     alpha_bit_depth;
+  gint                     shift_x;
+  gint                     shift_y;
+  gint                     chroma_width;
+  gint                     chroma_height;
+  gint                     src_x;         /* position of the area in the planes */
+  gint                     src_y;
+} HeifpluginYCbCrBands;
+
+/* Whether the planes libheif decodes handle to natively can be
+ * converted by heifplugin_load_ycbcr_band. Deciding this from the
+ * handle means images that need libheif's RGB conversion are only
+ * decoded once. heifplugin_ycbcr_bands_init can still refuse the
+ * decoded image if the bitstream signals a matrix the container
+ * doesn't, or, with libheif before 1.16, a layout we can't convert.
+ */
+static gboolean
+heifplugin_can_load_ycbcr (struct heif_image_handle *handle,
+                           gint                      bit_depth)
+{
+  gint chroma_bit_depth;
+
+  if (bit_depth < 1 || bit_depth > 16)
+    return FALSE;
+
+  chroma_bit_depth = heif_image_handle_get_chroma_bits_per_pixel (handle);
+  if (chroma_bit_depth > 0 && chroma_bit_depth != bit_depth)
+    return FALSE;
+
+#if LIBHEIF_HAVE_VERSION(1,16,0)
+  {
+    enum heif_colorspace colorspace;
+    enum heif_chroma     chroma;
+    struct heif_error    err;
+
+    err = heif_image_handle_get_preferred_decoding_colorspace (handle,
+                                                               &colorspace,
+                                                               &chroma);
+    if (! err.code)
+      {
+        switch (chroma)
+          {
+          case heif_chroma_monochrome:
+          case heif_chroma_420:
+          case heif_chroma_422:
+            if (colorspace != heif_colorspace_YCbCr &&
+                colorspace != heif_colorspace_monochrome)
+              return FALSE;
+            break;
+
+          case heif_chroma_444:
+            break;
+
+          default:
+            return FALSE;
+          }
+      }
+  }
+#endif
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+  {
+    struct heif_color_profile_nclx *nclx = NULL;
+    struct heif_error               err;
+    gboolean                        supported = TRUE;
+
+    err = heif_image_handle_get_nclx_color_profile (handle, &nclx);
+
+    if (! err.code && nclx)
+      {
+        supported = heifplugin_matrix_is_supported (nclx->matrix_coefficients);
+
+        heif_nclx_color_profile_free (nclx);
+      }
+
+    if (! supported)
+      return FALSE;
+  }
+#endif
+
+  return TRUE;
+}
+
+static gboolean
+heifplugin_ycbcr_bands_init (HeifpluginYCbCrBands     *ycbcr,
+                             struct heif_image        *img,
+                             struct heif_image_handle *handle,
+                             GeglBuffer               *buffer,
+                             const Babl               *format,
+                             const GeglRectangle      *area,
+                             gboolean                  has_alpha,
+                             gint                      bit_depth)
+{
+  static const enum heif_channel ycbcr_channels[4] =
+    {
+      heif_channel_Y, heif_channel_Cb, heif_channel_Cr, heif_channel_Alpha
+    };
+  static const enum heif_channel gbr_channels[4] =
+    {
+      heif_channel_G, heif_channel_B, heif_channel_R, heif_channel_Alpha
+    };
+  const enum heif_channel *channels = ycbcr_channels;
+  HeifpluginYCbCrMatrix    matrix;
+  HeifpluginYCbCrPack     *pack     = &ycbcr->pack;
+  gint                     i;
+
+  memset (ycbcr, 0, sizeof (HeifpluginYCbCrBands));
+
+  switch (heif_image_get_colorspace (img))
+    {
+    case heif_colorspace_YCbCr:
+    case heif_colorspace_monochrome:
+      break;
+
+    case heif_colorspace_RGB:
+      /* libheif decodes identity matrix images to planar RGB */
+      if (heif_image_get_chroma_format (img) != heif_chroma_444)
+        return FALSE;
+
+      channels = gbr_channels;
+      break;
+
+    default:
+      return FALSE;
+    }
+
+  switch (heif_image_get_chroma_format (img))
+    {
+    case heif_chroma_monochrome:
+      ycbcr->n_planes = 1;
+      break;
+
+    case heif_chroma_420:
+      ycbcr->shift_y = 1;
+      /* fall through */
+    case heif_chroma_422:
+      ycbcr->shift_x = 1;
+      /* fall through */
+    case heif_chroma_444:
+      ycbcr->n_planes = 3;
+      break;
+
+    default:
+      return FALSE;
+    }
+
+  if (! heifplugin_ycbcr_matrix_init (&matrix, img, handle, bit_depth))
+    return FALSE;
+
+  for (i = 0; i < 4; i++)
+    {
+      if (i >= ycbcr->n_planes && i != 3)
+        continue;
+
+      if (i == 3)
+        {
+          if (! (has_alpha && heif_image_has_channel (img, channels[i])))
+            continue;
+
+          ycbcr->alpha_bit_depth =
+            heif_image_get_bits_per_pixel_range (img, channels[i]);
+
+          if (ycbcr->alpha_bit_depth < 1 || ycbcr->alpha_bit_depth > 16)
+            return FALSE;
+        }
+      else if (heif_image_get_bits_per_pixel_range (img, channels[i]) != bit_depth)
+        {
+          return FALSE;
+        }
+
+      ycbcr->planes[i] = heif_image_get_plane_readonly (img, channels[i],
+                                                        &ycbcr->strides[i]);
+      if (! ycbcr->planes[i])
+        return FALSE;
+    }
+
+  if (ycbcr->n_planes == 3)
+    {
+      ycbcr->chroma_width  = heif_image_get_width  (img, channels[1]);
+      ycbcr->chroma_height = heif_image_get_height (img, channels[1]);
+    }
+
+  heifplugin_bands_init (&ycbcr->bands, buffer, format, NULL, 0,
+                         area->width, area->height, has_alpha, bit_depth);
+
+  ycbcr->src_x = area->x;
+  ycbcr->src_y = area->y;
+
+  pack->n_components   = ycbcr->bands.n_components;
+  pack->high_bit_depth = bit_depth > 8;
+  pack->max_value      = pack->high_bit_depth ? 65535.0f : 255.0f;
+
+  for (i = 0; i < 3; i++)
+    {
+      pack->coeffs[i][0] = matrix.coeffs[i][0] * pack->max_value;
+      pack->coeffs[i][1] = matrix.coeffs[i][1] * pack->max_value;
+      pack->coeffs[i][2] = matrix.coeffs[i][2] * pack->max_value;
+      pack->coeffs[i][3] = matrix.coeffs[i][3] * pack->max_value;
+    }
+
+  /* without an alpha plane the kernels get a row of 1.0 */
+  if (ycbcr->planes[3])
+    pack->alpha_scale = pack->max_value /
+                        ((1 << ycbcr->alpha_bit_depth) - 1);
+  else
+    pack->alpha_scale = pack->max_value;
+
+#if LIBHEIF_HAVE_VERSION(1,12,0)
+  pack->premultiplied = (ycbcr->planes[3] &&
+                         heif_image_handle_is_premultiplied_alpha (handle));
+#endif
+
+  ycbcr->pack_func = heifplugin_get_ycbcr_pack_func ();
+
+  return TRUE;
+}
+
+/* Upsample the chroma of plane for luma row y to full resolution the
+ * way libheif does when it converts to RGB, so both paths give the same
+ * image: 4:2:0 is interpolated bilinearly since libheif 1.16, weighting
+ * the nearest chroma sample 3:1 against its neighbor in both
+ * directions, everything else repeats the nearest sample. Like
+ * libheif's, the interpolation assumes chroma sited between the luma
+ * samples and ignores the chroma sample position of the stream.
+ */
+static void
+heifplugin_upsample_chroma_row (const HeifpluginYCbCrBands *ycbcr,
+                                gint                        plane,
+                                gint                        y,
+                                gfloat                     *row_tmp,
+                                gfloat                     *dest)
+{
+  const HeifpluginBands *bands  = &ycbcr->bands;
+  const guint8          *row0;
+  const guint8          *row1;
+  gint                   c_y    = y >> ycbcr->shift_y;
+  gint                   c_y1   = c_y;
+  gint                   c_x0   = ycbcr->src_x >> ycbcr->shift_x;
+  gint                   c_x1;
+  gfloat                 weight = 1.0f;
+  gint                   x;
+
+#if LIBHEIF_HAVE_VERSION(1,16,0)
+  if (ycbcr->shift_x && ycbcr->shift_y)
+    weight = 0.75f;
+#endif
+
+  if (ycbcr->shift_y)
+    c_y1 = CLAMP ((y & 1) ? c_y + 1 : c_y - 1, 0, ycbcr->chroma_height - 1);
+
+  row0 = ycbcr->planes[plane] + (gsize) c_y  * ycbcr->strides[plane];
+  row1 = ycbcr->planes[plane] + (gsize) c_y1 * ycbcr->strides[plane];
+
+  c_x1 = MIN (((ycbcr->src_x + bands->width - 1) >> ycbcr->shift_x) + 2,
+              ycbcr->chroma_width);
+  c_x0 = MAX (c_x0 - 1, 0);
+
+  /* vertical pass over the chroma columns the area needs */
+
+  if (bands->bit_depth > 8)
+    {
+      const guint16 *row0_16 = (const guint16 *) row0;
+      const guint16 *row1_16 = (const guint16 *) row1;
+
+      for (x = c_x0; x < c_x1; x++)
+        row_tmp[x] = weight * row0_16[x] + (1.0f - weight) * row1_16[x];
+    }
+  else
+    {
+      for (x = c_x0; x < c_x1; x++)
+        row_tmp[x] = weight * row0[x] + (1.0f - weight) * row1[x];
+    }
+
+  /* horizontal pass */
+
+  if (! ycbcr->shift_x)
+    {
+      memcpy (dest, row_tmp + ycbcr->src_x, bands->width * sizeof (gfloat));
+      return;
+    }
+
+  for (x = 0; x < bands->width; x++)
+    {
+      gint src_x = ycbcr->src_x + x;
+      gint c_x   = src_x >> 1;
+      gint c_xn  = CLAMP ((src_x & 1) ? c_x + 1 : c_x - 1,
+                          0, ycbcr->chroma_width - 1);
+
+      dest[x] = weight * row_tmp[c_x] + (1.0f - weight) * row_tmp[c_xn];
+    }
+}
+
+static void
+heifplugin_load_ycbcr_band (gint     job,
+                            gpointer user_data)
+{
+  const HeifpluginYCbCrBands *ycbcr  = user_data;
+  const HeifpluginBands      *bands  = &ycbcr->bands;
+  gint                        y      = job * bands->band_height;
+  gboolean                    high   = bands->bit_depth > 8;
+  gsize                       stride;
+  gint                        n_rows;
+  guint8                     *band;
+  gfloat                     *row_tmp = NULL;
+  gfloat                     *luma;
+  gfloat                     *cb;
+  gfloat                     *cr;
+  gfloat                     *alpha;
+  gint                        row;
+  gint                        x;
+
+  n_rows = MIN (bands->band_height, bands->height - y);
+  stride = (gsize) bands->width * bands->n_components * (high ? 2 : 1);
+  band   = g_malloc (stride * n_rows);
+
+  /* monochrome images keep Cb and Cr at 0, which the matrix ignores */
+  luma  = g_new  (gfloat, bands->width);
+  cb    = g_new0 (gfloat, bands->width);
+  cr    = g_new0 (gfloat, bands->width);
+  alpha = g_new  (gfloat, bands->width);
+
+  if (ycbcr->n_planes == 3)
+    row_tmp = g_new (gfloat, ycbcr->chroma_width);
+
+  if (! ycbcr->planes[3])
+    for (x = 0; x < bands->width; x++)
+      alpha[x] = 1.0f;
+
+  for (row = 0; row < n_rows; row++)
+    {
+      gint src_y = ycbcr->src_y + y + row;
+
+      heifplugin_samples_to_float (ycbcr->planes[0] +
+                                   (gsize) src_y * ycbcr->strides[0],
+                                   ycbcr->src_x, bands->width, high, luma);
+
+      if (ycbcr->planes[3])
+        heifplugin_samples_to_float (ycbcr->planes[3] +
+                                     (gsize) src_y * ycbcr->strides[3],
+                                     ycbcr->src_x, bands->width,
+                                     ycbcr->alpha_bit_depth > 8, alpha);
+
+      if (ycbcr->n_planes == 3)
+        {
+          heifplugin_upsample_chroma_row (ycbcr, 1, src_y, row_tmp, cb);
+          heifplugin_upsample_chroma_row (ycbcr, 2, src_y, row_tmp, cr);
+        }
+
+      ycbcr->pack_func (&ycbcr->pack, luma, cb, cr, alpha, bands->width,
+                        band + (gsize) row * stride);
+    }
+
+  gegl_buffer_set (bands->buffer,
+                   GEGL_RECTANGLE (bands->dest_x, bands->dest_y + y,
+                                   bands->width, n_rows),
+                   0, bands->format, band, stride);
+
+  g_free (row_tmp);
+  g_free (luma);
+  g_free (cb);
+  g_free (cr);
+  g_free (alpha);
+  g_free (band);
+}
+
+/* The export counterpart: RGBA bands fetched from GEGL as float are
+ * converted to YCbCr and subsampled in one pass, writing straight into
+ * the planes of the heif image.
+ */
+
+/* Y', Cb', Cr' = coeffs * (R', G', B', 1), as fractions of the sample
+ * range, ready for heifplugin_quantize_from_float().
+ */
+typedef struct
+{
+  gfloat coeffs[3][4];
+} HeifpluginYCbCrSaveMatrix;
+
+typedef void (* HeifpluginRGBToYCbCrFunc) (const HeifpluginYCbCrSaveMatrix *matrix,
+                                           const gfloat                    *src,
+                                           gint                             width,
+                                           gfloat                          *y,
+                                           gfloat                          *cb,
+                                           gfloat                          *cr,
+                                           gfloat                          *alpha);
+
+typedef struct
+{
+  HeifpluginBands           bands;
+  HeifpluginYCbCrSaveMatrix matrix;
+  HeifpluginRGBToYCbCrFunc  func;
+  guint8                   *planes[4];     /* Y, Cb, Cr and alpha */
+  gint                      strides[4];
+  gint                      shift_x;
+  gint                      shift_y;
+} HeifpluginYCbCrSaveBands;
+
+/* Set up the full range conversion for matrix_coefficients, one of the
+ * matrices heifplugin_get_save_matrix() picks.
+ */
+static void
+heifplugin_ycbcr_save_matrix_init (HeifpluginYCbCrSaveMatrix *matrix,
+                                   gint                       matrix_coefficients,
+                                   gint                       bit_depth)
+{
+  gfloat c_offset = (1 << (bit_depth - 1)) / (gfloat) ((1 << bit_depth) - 1);
+  gfloat kr       = 0.299f;
+  gfloat kb       = 0.114f;
+  gfloat kg;
+
+  heifplugin_get_luma_weights (matrix_coefficients, &kr, &kb);
+
+  kg = 1.0f - kr - kb;
+
+  matrix->coeffs[0][0] = kr;
+  matrix->coeffs[0][1] = kg;
+  matrix->coeffs[0][2] = kb;
+  matrix->coeffs[0][3] = 0.0f;
+
+  matrix->coeffs[1][0] = -kr / (2.0f * (1.0f - kb));
+  matrix->coeffs[1][1] = -kg / (2.0f * (1.0f - kb));
+  matrix->coeffs[1][2] = 0.5f;
+  matrix->coeffs[1][3] = c_offset;
+
+  matrix->coeffs[2][0] = 0.5f;
+  matrix->coeffs[2][1] = -kg / (2.0f * (1.0f - kr));
+  matrix->coeffs[2][2] = -kb / (2.0f * (1.0f - kr));
+  matrix->coeffs[2][3] = c_offset;
+}
+
+/* Split a row of RGBA float pixels into Y', Cb', Cr' and alpha rows. */
+static void
+heifplugin_rgb_to_ycbcr_c (const HeifpluginYCbCrSaveMatrix *matrix,
+                           const gfloat                    *src,
+                           gint                             width,
+                           gfloat                          *y,
+                           gfloat                          *cb,
+                           gfloat                          *cr,
+                           gfloat                          *alpha)
+{
+  const gfloat (*c)[4] = matrix->coeffs;
+  gint           x;
+
+  for (x = 0; x < width; x++)
+    {
+      const gfloat *pixel = src + x * 4;
+
+      y[x]     = c[0][0] * pixel[0] + c[0][1] * pixel[1] +
+                 c[0][2] * pixel[2] + c[0][3];
+      cb[x]    = c[1][0] * pixel[0] + c[1][1] * pixel[1] +
+                 c[1][2] * pixel[2] + c[1][3];
+      cr[x]    = c[2][0] * pixel[0] + c[2][1] * pixel[1] +
+                 c[2][2] * pixel[2] + c[2][3];
+      alpha[x] = pixel[3];
+    }
+}
+
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+/* Four pixels are transposed to R, G, B and A vectors, then each output
+ * is three multiply-adds.
+ */
+__attribute__ ((target ("sse2")))
+static void
+heifplugin_rgb_to_ycbcr_sse2 (const HeifpluginYCbCrSaveMatrix *matrix,
+                              const gfloat                    *src,
+                              gint                             width,
+                              gfloat                          *y,
+                              gfloat                          *cb,
+                              gfloat                          *cr,
+                              gfloat                          *alpha)
+{
+  gfloat *dest[3] = { y, cb, cr };
+  __m128  c[3][4];
+  gint    x       = 0;
+  gint    i;
+
+  for (i = 0; i < 3; i++)
+    {
+      c[i][0] = _mm_set1_ps (matrix->coeffs[i][0]);
+      c[i][1] = _mm_set1_ps (matrix->coeffs[i][1]);
+      c[i][2] = _mm_set1_ps (matrix->coeffs[i][2]);
+      c[i][3] = _mm_set1_ps (matrix->coeffs[i][3]);
+    }
+
+  for (; x + 4 <= width; x += 4)
+    {
+      __m128 r = _mm_loadu_ps (src + x * 4);
+      __m128 g = _mm_loadu_ps (src + x * 4 + 4);
+      __m128 b = _mm_loadu_ps (src + x * 4 + 8);
+      __m128 a = _mm_loadu_ps (src + x * 4 + 12);
+
+      _MM_TRANSPOSE4_PS (r, g, b, a);
+
+      for (i = 0; i < 3; i++)
+        {
+          /* in the order of the C version, for identical results */
+          __m128 v = _mm_add_ps (_mm_mul_ps (c[i][0], r),
+                                 _mm_mul_ps (c[i][1], g));
+
+          v = _mm_add_ps (_mm_add_ps (v, _mm_mul_ps (c[i][2], b)), c[i][3]);
+
+          _mm_storeu_ps (dest[i] + x, v);
+        }
+
+      _mm_storeu_ps (alpha + x, a);
+    }
+
+  heifplugin_rgb_to_ycbcr_c (matrix, src + x * 4, width - x,
+                             y + x, cb + x, cr + x, alpha + x);
+}
+#endif
+
+static HeifpluginRGBToYCbCrFunc
+heifplugin_get_rgb_to_ycbcr_func (void)
+{
+#if defined (HEIFPLUGIN_X86_INTRINSICS) && defined (COMPILE_SSE2_INTRINISICS)
+  if (gimp_cpu_accel_get_support () & GIMP_CPU_ACCEL_X86_SSE2)
+    return heifplugin_rgb_to_ycbcr_sse2;
+#endif
+
+  return heifplugin_rgb_to_ycbcr_c;
+}
+
+/* Quantize a row of fractions of the sample range into row of a plane.
+ * tmp holds width samples, used for 8 bit planes.
+ */
+static void
+heifplugin_store_row (const gfloat *src,
+                      guint8       *row,
+                      gint          width,
+                      gint          bit_depth,
+                      guint16      *tmp)
+{
+  gint x;
+
+  if (bit_depth > 8)
+    {
+      heifplugin_quantize_from_float (src, (guint16 *) row, width, bit_depth);
+      return;
+    }
+
+  heifplugin_quantize_from_float (src, tmp, width, bit_depth);
+
+  for (x = 0; x < width; x++)
+    row[x] = tmp[x];
+}
+
+static void
+heifplugin_save_ycbcr_band (gint     job,
+                            gpointer user_data)
+{
+  const HeifpluginYCbCrSaveBands *ycbcr = user_data;
+  const HeifpluginBands          *bands = &ycbcr->bands;
+  gint                            y     = job * bands->band_height;
+  gint                            width = bands->width;
+  gfloat                         *band;
+  gfloat                         *luma;
+  gfloat                         *alpha;
+  gfloat                         *cb[2];
+  gfloat                         *cr[2];
+  guint16                        *tmp;
+  gsize                           rowentries;
+  gint                            n_rows;
+  gint                            row;
+  gint                            x;
+
+  rowentries = (gsize) width * 4;
+  n_rows     = MIN (bands->band_height, bands->height - y);
+
+  band  = g_new (gfloat, rowentries * n_rows);
+  luma  = g_new (gfloat, width);
+  alpha = g_new (gfloat, width);
+  cb[0] = g_new (gfloat, width);
+  cb[1] = g_new (gfloat, width);
+  cr[0] = g_new (gfloat, width);
+  cr[1] = g_new (gfloat, width);
+  tmp   = g_new (guint16, width);
+
+  gegl_buffer_get (bands->buffer,
+                   GEGL_RECTANGLE (0, y, width, n_rows),
+                   1.0, bands->format, band,
+                   GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+
+  for (row = 0; row < n_rows; row += 1 << ycbcr->shift_y)
+    {
+      gint   c_y   = (y + row) >> ycbcr->shift_y;
+      gint   rows  = MIN (1 << ycbcr->shift_y, n_rows - row);
+      gfloat scale = 1.0f / rows;
+      gint   j;
+
+      /* luma and alpha at full resolution */
+
+      for (j = 0; j < rows; j++)
+        {
+          gint dest_y = y + row + j;
+
+          ycbcr->func (&ycbcr->matrix, band + (row + j) * rowentries, width,
+                       luma, cb[j], cr[j], alpha);
+
+          heifplugin_store_row (luma,
+                                ycbcr->planes[0] +
+                                (gsize) dest_y * ycbcr->strides[0],
+                                width, bands->bit_depth, tmp);
+
+          if (ycbcr->planes[3])
+            heifplugin_store_row (alpha,
+                                  ycbcr->planes[3] +
+                                  (gsize) dest_y * ycbcr->strides[3],
+                                  width, bands->bit_depth, tmp);
+        }
+
+      /* chroma from the average of each block of subsampled pixels, the
+       * conversion is affine so that's the same as converting the
+       * average color
+       */
+
+      if (rows == 2)
+        {
+          for (x = 0; x < width; x++)
+            {
+              cb[0][x] += cb[1][x];
+              cr[0][x] += cr[1][x];
+            }
+        }
+
+      if (ycbcr->shift_x)
+        {
+          for (x = 0; x + 1 < width; x += 2)
+            {
+              cb[0][x >> 1] = (cb[0][x] + cb[0][x + 1]) * 0.5f * scale;
+              cr[0][x >> 1] = (cr[0][x] + cr[0][x + 1]) * 0.5f * scale;
+            }
+
+          if (width & 1)
+            {
+              cb[0][width >> 1] = cb[0][width - 1] * scale;
+              cr[0][width >> 1] = cr[0][width - 1] * scale;
+            }
+        }
+      else if (rows == 2)
+        {
+          for (x = 0; x < width; x++)
+            {
+              cb[0][x] *= scale;
+              cr[0][x] *= scale;
+            }
+        }
+
+      heifplugin_store_row (cb[0],
+                            ycbcr->planes[1] + (gsize) c_y * ycbcr->strides[1],
+                            (width + ycbcr->shift_x) >> ycbcr->shift_x,
+                            bands->bit_depth, tmp);
+      heifplugin_store_row (cr[0],
+                            ycbcr->planes[2] + (gsize) c_y * ycbcr->strides[2],
+                            (width + ycbcr->shift_x) >> ycbcr->shift_x,
+                            bands->bit_depth, tmp);
+    }
+
+  g_free (band);
+  g_free (luma);
+  g_free (alpha);
+  g_free (cb[0]);
+  g_free (cb[1]);
+  g_free (cr[0]);
+  g_free (cr[1]);
+  g_free (tmp);
+}
+
+/*  decoder selection  */
+
+#if LIBHEIF_HAVE_VERSION(1,15,0)
+#define MAX_DECODER_IDS 2
+
+/* The decoders to ask libheif for, best first: the one named in the
+ * GIMP_HEIF_DECODER environment variable, then dav1d, which decodes AV1
+ * much faster than libaom. The list is NULL-terminated, NULL standing
+ * for libheif's own choice.
+ */
+static const gchar * const *
+heifplugin_get_decoder_ids (void)
+{
+  static gsize        initialized = 0;
+  static const gchar *ids[MAX_DECODER_IDS + 1];
+
+  if (g_once_init_enter (&initialized))
+    {
+      const struct heif_decoder_descriptor *descriptors[16];
+      const gchar                          *override;
+      const gchar                          *override_id = NULL;
+      const gchar                          *dav1d_id    = NULL;
+      gint                                  n_descriptors;
+      gint                                  n_ids       = 0;
+      gint                                  i;
+
+      override = g_getenv ("GIMP_HEIF_DECODER");
+
+      n_descriptors = heif_get_decoder_descriptors (heif_compression_undefined,
+                                                    descriptors,
+                                                    G_N_ELEMENTS (descriptors));
+
+      for (i = 0; i < n_descriptors; i++)
+        {
+          const gchar *id = heif_decoder_descriptor_get_id_name (descriptors[i]);
+
+          g_debug ("%s: decoder %s available", G_STRFUNC, id);
+
+          if (override && ! g_strcmp0 (id, override))
+            override_id = id;
+          else if (! g_strcmp0 (id, "dav1d"))
+            dav1d_id = id;
+        }
+
+      if (override && ! override_id)
+        g_printerr ("GIMP_HEIF_DECODER: no decoder named '%s', "
+                    "using the default ones\n", override);
+
+      if (override_id)
+        ids[n_ids++] = override_id;
+
+      if (dav1d_id)
+        ids[n_ids++] = dav1d_id;
+
+      ids[n_ids] = NULL;
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return ids;
+}
+
+/* A decoder only handles one compression format, so asking for it by
+ * name fails for the other one before anything is decoded.
+ */
+static gboolean
+heifplugin_decoder_missing (struct heif_error err)
+{
+  return (err.code == heif_error_Plugin_loading_error ||
+          (err.code    == heif_error_Unsupported_feature &&
+           err.subcode == heif_suberror_Unsupported_codec));
+}
+
+/* Decoding options with libheif's bilinear chroma upsampling asked for
+ * explicitly, which heifplugin_upsample_chroma_row() reproduces for the
+ * images loaded from their YCbCr planes.
+ */
+static struct heif_decoding_options *
+heifplugin_decoding_options_new (void)
+{
+  struct heif_decoding_options *options = heif_decoding_options_alloc ();
+
+#if LIBHEIF_HAVE_VERSION(1,16,0)
+  options->color_conversion_options.preferred_chroma_upsampling_algorithm =
+    heif_chroma_upsampling_bilinear;
+#endif
+
+  return options;
+}
+#endif
+
+/* heif_decode_image() with the preferred decoder, falling back to the
+ * next one when it can't handle the image's format.
+ */
+static struct heif_error
+heifplugin_decode_image (const struct heif_image_handle  *handle,
+                         struct heif_image              **img,
+                         enum heif_colorspace             colorspace,
+                         enum heif_chroma                 chroma)
+{
+#if LIBHEIF_HAVE_VERSION(1,15,0)
+  const gchar * const          *ids     = heifplugin_get_decoder_ids ();
+  struct heif_decoding_options *options = heifplugin_decoding_options_new ();
+  struct heif_error             err;
+  gint                          i;
+
+  for (i = 0; ; i++)
+    {
+      options->decoder_id = ids[i];
+
+      err = heif_decode_image (handle, img, colorspace, chroma, options);
+
+      if (! ids[i] || ! heifplugin_decoder_missing (err))
+        break;
+    }
+
+  heif_decoding_options_free (options);
+
+  return err;
+#else
+  return heif_decode_image (handle, img, colorspace, chroma, NULL);
+#endif
+}
+
+#if LIBHEIF_HAVE_VERSION(1,19,0)
+/*  tiled decoding  */
+
+static struct heif_error
+heifplugin_decode_image_tile (const struct heif_image_handle  *handle,
+                              struct heif_image              **img,
+                              enum heif_colorspace             colorspace,
+                              enum heif_chroma                 chroma,
+                              guint32                          column,
+                              guint32                          row)
+{
+  const gchar * const          *ids     = heifplugin_get_decoder_ids ();
+  struct heif_decoding_options *options = heifplugin_decoding_options_new ();
+  struct heif_error             err;
+  gint                          i;
+
+  for (i = 0; ; i++)
+    {
+      options->decoder_id = ids[i];
+
+      err = heif_image_handle_decode_image_tile (handle, img,
+                                                 colorspace, chroma,
+                                                 options, column, row);
+
+      if (! ids[i] || ! heifplugin_decoder_missing (err))
+        break;
+    }
+
+  heif_decoding_options_free (options);
+
+  return err;
+}
+
+/* Grid images are decoded tile by tile, straight into the layer
+ * buffer, so only as many tiles as there are threads exist at once.
+ */
+typedef struct
+{
+  const struct heif_image_handle *handle;
+  struct heif_image_tiling        tiling;
+  GeglBuffer                     *buffer;
+  const Babl                     *format;
+  enum heif_chroma                chroma;
+  gint                            bit_depth;
+  gboolean                        has_alpha;
+  GeglRectangle                   area;      /* image area held by buffer */
+  guint32                         first_column;
+  guint32                         first_row;
+  guint32                         n_columns;
+  GMutex                          mutex;
+  gchar                          *error_message;
+} HeifpluginTiles;
+
+static gboolean
+heifplugin_get_tiling (const struct heif_image_handle *handle,
+                       struct heif_image_tiling       *tiling)
+{
+  struct heif_error err;
+
+  err = heif_image_handle_get_image_tiling (handle, TRUE, tiling);
+
+  if (err.code)
+    return FALSE;
+
+  return (tiling->num_columns * tiling->num_rows > 1 &&
+          tiling->number_of_extra_dimensions == 0);
+}
+
+static void
+heifplugin_decode_tile (gint     job,
+                        gpointer user_data)
+{
+  HeifpluginTiles   *tiles  = user_data;
+  guint32            column = tiles->first_column + job % tiles->n_columns;
+  guint32            row    = tiles->first_row    + job / tiles->n_columns;
+  struct heif_image *img    = NULL;
+  struct heif_error  err;
+  GeglRectangle      tile_rect;
+  GeglRectangle      rect;
+  HeifpluginBands    bands;
+  guint8            *plane;
+  gint               stride;
+  gint               bpp;
+
+  tile_rect.x      = (gint) (column * tiles->tiling.tile_width) -
+                     (gint) tiles->tiling.left_offset;
+  tile_rect.y      = (gint) (row * tiles->tiling.tile_height) -
+                     (gint) tiles->tiling.top_offset;
+  tile_rect.width  = tiles->tiling.tile_width;
+  tile_rect.height = tiles->tiling.tile_height;
+
+  if (! gegl_rectangle_intersect (&rect, &tile_rect, &tiles->area))
+    return;
+
+  err = heifplugin_decode_image_tile (tiles->handle, &img,
+                                      heif_colorspace_RGB,
+                                      tiles->chroma,
+                                      column, row);
+  if (err.code)
+    {
+      g_mutex_lock (&tiles->mutex);
+      if (! tiles->error_message)
+        tiles->error_message = g_strdup (err.message);
+      g_mutex_unlock (&tiles->mutex);
+
+      return;
+    }
+
+  plane = heif_image_get_plane (img, heif_channel_interleaved, &stride);
+  bpp   = (tiles->has_alpha ? 4 : 3) * (tiles->bit_depth > 8 ? 2 : 1);
+
+  /* skip the parts of the tile outside of the area */
+  plane += (gsize) (rect.y - tile_rect.y) * stride +
+           (gsize) (rect.x - tile_rect.x) * bpp;
+
+  heifplugin_bands_init (&bands, tiles->buffer, tiles->format,
+                         plane, stride, rect.width, rect.height,
+                         tiles->has_alpha, tiles->bit_depth);
+  bands.dest_x      = rect.x - tiles->area.x;
+  bands.dest_y      = rect.y - tiles->area.y;
+  bands.band_height = rect.height;
+
+  heifplugin_load_band (0, &bands);
+
+  heif_image_release (img);
+}
+
+/* Decode the tiles overlapping area into buffer, which holds exactly
+ * that area of the image.
+ */
+static gboolean
+heifplugin_decode_tiles (const struct heif_image_handle *handle,
+                         const struct heif_image_tiling *tiling,
+                         const GeglRectangle            *area,
+                         GeglBuffer                     *buffer,
+                         const Babl                     *format,
+                         enum heif_chroma                chroma,
+                         gint                            bit_depth,
+                         gboolean                        has_alpha,
+                         gint                            max_threads,
+                         GError                        **error)
+{
+  HeifpluginTiles tiles = { 0, };
+  guint32         last_column;
+  guint32         last_row;
+
+  tiles.handle    = handle;
+  tiles.tiling    = *tiling;
+  tiles.buffer    = buffer;
+  tiles.format    = format;
+  tiles.chroma    = chroma;
+  tiles.bit_depth = bit_depth;
+  tiles.has_alpha = has_alpha;
+  tiles.area      = *area;
+
+  tiles.first_column = (area->x + tiling->left_offset) / tiling->tile_width;
+  tiles.first_row    = (area->y + tiling->top_offset)  / tiling->tile_height;
+  last_column        = (area->x + area->width  - 1 + tiling->left_offset) /
+                       tiling->tile_width;
+  last_row           = (area->y + area->height - 1 + tiling->top_offset) /
+                       tiling->tile_height;
+
+  last_column = MIN (last_column, tiling->num_columns - 1);
+  last_row    = MIN (last_row,    tiling->num_rows    - 1);
+
+  tiles.n_columns = last_column - tiles.first_column + 1;
+
+  g_mutex_init (&tiles.mutex);
+
+  heifplugin_parallel_run (tiles.n_columns * (last_row - tiles.first_row + 1),
+                           max_threads, heifplugin_decode_tile, &tiles);
+
+  g_mutex_clear (&tiles.mutex);
+
+  if (tiles.error_message)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Loading HEIF image failed: %s"),
+                   tiles.error_message);
+      g_free (tiles.error_message);
+
+      return FALSE;
+    }
+
+  return TRUE;
+}
+#endif /* LIBHEIF_HAVE_VERSION(1,19,0) */
+
+/*  helpers shared by the load procedures  */
+
+/* Let libheif decode the tiles of grid images on up to max_threads
+ * threads of its own, 0 for one per processor. libheif's default is
+ * much lower than that on most machines. Files read from a stream get
+ * one thread, the stream can't be read from several threads at once.
+ */
+static void
+heifplugin_set_decoding_threads (struct heif_context   *ctx,
+                                 const HeifpluginInput *input,
+                                 gint                   max_threads)
+{
+#if LIBHEIF_HAVE_VERSION(1,13,0)
+  if (input->stream)
+    max_threads = 1;
+  else if (max_threads <= 0)
+    max_threads = heifplugin_get_num_threads ();
+
+  heif_context_set_max_decoding_threads (ctx, max_threads);
+#endif
+}
+
+/* Get the primary image, or the first top level image if the primary
+ * one is missing or not a top level image.
+ */
+static gboolean
+heifplugin_get_primary_image_ID (struct heif_context  *ctx,
+                                 heif_item_id         *id,
+                                 GError              **error)
+{
+  struct heif_error err;
+
+  if (heif_context_get_number_of_top_level_images (ctx) == 0)
+    {
+      g_set_error_literal (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                           _("Loading HEIF image failed: "
+                             "Input file contains no readable images"));
+      return FALSE;
+    }
+
+  err = heif_context_get_primary_image_ID (ctx, id);
+  if (err.code)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Loading HEIF image failed: %s"),
+                   err.message);
+      return FALSE;
+    }
+
+  if (! heif_context_is_top_level_image_ID (ctx, *id))
+    heif_context_get_list_of_top_level_image_IDs (ctx, id, 1);
+
+  return TRUE;
+}
+
+static enum heif_chroma
+heifplugin_get_interleaved_chroma (gint     bit_depth,
+                                   gboolean has_alpha)
+{
+  enum heif_chroma chroma = heif_chroma_interleaved_RGB;
+
+  if (bit_depth == 8)
+    {
+      if (has_alpha)
+        {
+          chroma = heif_chroma_interleaved_RGBA;
+        }
+      else
+        {
+          chroma = heif_chroma_interleaved_RGB;
+        }
+    }
+  else /* high bit depth */
+    {
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+#if ( G_BYTE_ORDER == G_LITTLE_ENDIAN )
+      if (has_alpha)
+        {
+          chroma = heif_chroma_interleaved_RRGGBBAA_LE;
+        }
+      else
+        {
+          chroma = heif_chroma_interleaved_RRGGBB_LE;
+        }
+#else
+      if (has_alpha)
+        {
+          chroma = heif_chroma_interleaved_RRGGBBAA_BE;
+        }
+      else
+        {
+          chroma = heif_chroma_interleaved_RRGGBB_BE;
+        }
+#endif
+#endif
+    }
+
+  return chroma;
+}
+
+static GimpColorProfile *
+heifplugin_get_color_profile (struct heif_image_handle *handle)
+{
+  GimpColorProfile  *profile = NULL;
+#if LIBHEIF_HAVE_VERSION(1,4,0)
+  struct heif_error  err;
+
+  switch (heif_image_handle_get_color_profile_type (handle))
+    {
+    case heif_color_profile_type_not_present:
+      break;
+    case heif_color_profile_type_rICC:
+    case heif_color_profile_type_prof:
+      /* I am unsure, but it looks like both these types represent an
+       * ICC color profile. XXX
+       */
+      {
+        void   *profile_data;
+        size_t  profile_size;
+
+        profile_size = heif_image_handle_get_raw_color_profile_size (handle);
+        profile_data = g_malloc0 (profile_size);
+        err = heif_image_handle_get_raw_color_profile (handle, profile_data);
+
+        if (err.code)
+          g_warning ("%s: ICC profile loading failed and discarded.",
+                     G_STRFUNC);
+        else
+          profile = gimp_color_profile_new_from_icc_profile ((guint8 *) profile_data,
+                                                             profile_size, NULL);
+
+        g_free (profile_data);
+      }
+      break;
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+    case heif_color_profile_type_nclx:
+      {
+        struct heif_color_profile_nclx *nclx = NULL;
+
+        err = heif_image_handle_get_nclx_color_profile (handle, &nclx);
+        if (err.code)
+          {
+            g_warning ("%s: NCLX profile loading failed and discarded.",
+                       G_STRFUNC);
+          }
+        else
+          {
+            profile = nclx_to_gimp_profile (nclx);
+            heif_nclx_color_profile_free (nclx);
+          }
+      }
+      break;
+#endif
+    default:
+      g_warning ("%s: unknown color profile type has been discarded.",
+                 G_STRFUNC);
+      break;
+    }
+#endif /* LIBHEIF_HAVE_VERSION(1,4,0) */
+
+  return profile;
+}
+
+static void
+heifplugin_set_color_profile (GimpImage        *image,
+                              GimpColorProfile *profile)
+{
+  if (! profile)
+    return;
+
+  if (gimp_color_profile_is_rgb (profile))
+    {
+      gimp_image_set_color_profile (image, profile);
+    }
+  else if (gimp_color_profile_is_gray (profile))
+    {
+      g_warning ("Gray ICC profile was not applied to the imported image.");
+    }
+  else
+    {
+      g_warning ("ICC profile was not applied to the imported image.");
+    }
+}
+
+static GimpPrecision
+heifplugin_get_precision (gint     bit_depth,
+                          gboolean load_linear)
+{
+  if (load_linear)
+    return bit_depth == 8 ? GIMP_PRECISION_U8_LINEAR : GIMP_PRECISION_U16_LINEAR;
+  else
+    return bit_depth == 8 ? GIMP_PRECISION_U8_NON_LINEAR : GIMP_PRECISION_U16_NON_LINEAR;
+}
+
+static const gchar *
+heifplugin_get_encoding (gint     bit_depth,
+                         gboolean has_alpha,
+                         gboolean load_linear)
+{
+  const gchar *encoding;
+
+  if (load_linear)
+    {
+      if (bit_depth == 8)
+        {
+          encoding = has_alpha ? "RGBA u8" : "RGB u8";
+        }
+      else
+        {
+          encoding = has_alpha ? "RGBA u16" : "RGB u16";
+        }
+    }
+  else /* non-linear profiles */
+    {
+      if (bit_depth == 8)
+        {
+          encoding = has_alpha ? "R'G'B'A u8" : "R'G'B' u8";
+        }
+      else
+        {
+          encoding = has_alpha ? "R'G'B'A u16" : "R'G'B' u16";
+        }
+    }
+
+  return encoding;
+}
+
+/* Decode area of the image of handle into buffer, which is area sized.
+ * max_decode_threads limits how many tiles are decoded at the same
+ * time (0 for the default).
+ */
+static gboolean
+heifplugin_decode_to_buffer (struct heif_image_handle  *handle,
+                             const GeglRectangle       *area,
+                             GeglBuffer                *buffer,
+                             const Babl                *format,
+                             gint                       bit_depth,
+                             gboolean                   has_alpha,
+                             gint                       max_decode_threads,
+                             GError                   **error)
+{
+  struct heif_image        *img    = NULL;
+  struct heif_error         err;
+  enum heif_chroma          chroma;
+#if LIBHEIF_HAVE_VERSION(1,19,0)
+  struct heif_image_tiling  tiling;
+#endif
+
+  chroma = heifplugin_get_interleaved_chroma (bit_depth, has_alpha);
+
+#if LIBHEIF_HAVE_VERSION(1,19,0)
+  if (heifplugin_get_tiling (handle, &tiling))
+    {
+      if (! heifplugin_decode_tiles (handle, &tiling, area,
+                                     buffer, format, chroma,
+                                     bit_depth, has_alpha,
+                                     max_decode_threads, error))
+        return FALSE;
+    }
+  else
+#endif
+    {
+      HeifpluginYCbCrBands ycbcr;
+      HeifpluginBands      bands;
+      guint8              *plane;
+      gint                 stride;
+      gboolean             native;
+
+      /* If the codec's own layout is one we can convert, decode to it
+       * and convert band by band straight into the layer format,
+       * otherwise have libheif convert the image to RGB.
+       */
+      native = heifplugin_can_load_ycbcr (handle, bit_depth);
+
+      if (native)
+        {
+          err = heifplugin_decode_image (handle,
+                                         &img,
+                                         heif_colorspace_undefined,
+                                         heif_chroma_undefined);
+
+          /* only when the bitstream disagrees with the container */
+          if (! err.code &&
+              ! heifplugin_ycbcr_bands_init (&ycbcr, img, handle,
+                                             buffer, format, area,
+                                             has_alpha, bit_depth))
+            {
+              heif_image_release (img);
+              img    = NULL;
+              native = FALSE;
+            }
+        }
+
+      if (! native)
+        err = heifplugin_decode_image (handle,
+                                       &img,
+                                       heif_colorspace_RGB,
+                                       chroma);
+
+      if (err.code)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                       _("Loading HEIF image failed: %s"),
+                       err.message);
+          return FALSE;
+        }
+
+      if (native)
+        {
+          heifplugin_parallel_run (heifplugin_bands_get_n_jobs (&ycbcr.bands),
+                                   0, heifplugin_load_ycbcr_band,
+                                   &ycbcr);
+        }
+      else
+        {
+          /* The decoded image is ours, so high bit depth data is
+           * expanded to u16 in place. Tile-aligned bands are converted
+           * and handed to GEGL in parallel. Other image types can't be
+           * decoded partially, so regions are cropped from the full
+           * image here.
+           */
+          plane = heif_image_get_plane (img, heif_channel_interleaved,
+                                        &stride);
+
+          plane += (gsize) area->y * stride +
+                   (gsize) area->x * (has_alpha ? 4 : 3) *
+                   (bit_depth > 8 ? 2 : 1);
+
+          heifplugin_bands_init (&bands, buffer, format, plane, stride,
+                                 area->width, area->height,
+                                 has_alpha, bit_depth);
+
+          heifplugin_parallel_run (heifplugin_bands_get_n_jobs (&bands),
+                                   0, heifplugin_load_band, &bands);
+        }
+
+      heif_image_release (img);
+    }
+
+  return TRUE;
+}
+
+/* Attach the Exif and XMP metadata of handle to image. */
+static void
+heifplugin_load_metadata (struct heif_image_handle *handle,
+                          GimpImage                *image)
+{
+  GError            *error          = NULL;
+  struct heif_error  err;
+  size_t             exif_data_size = 0;
+  uint8_t           *exif_data      = NULL;
+  size_t             xmp_data_size  = 0;
+  uint8_t           *xmp_data       = NULL;
+  gint               n_metadata;
+  heif_item_id       metadata_id;
+
+  n_metadata =
+    heif_image_handle_get_list_of_metadata_block_IDs (handle,
+                                                      "Exif",
+                                                      &metadata_id, 1);
+  if (n_metadata > 0)
+    {
+      exif_data_size = heif_image_handle_get_metadata_size (handle,
+                                                            metadata_id);
+      exif_data = g_alloca (exif_data_size);
+
+      err = heif_image_handle_get_metadata (handle, metadata_id, exif_data);
+      if (err.code != 0)
+        {
+          exif_data      = NULL;
+          exif_data_size = 0;
+        }
+    }
+
+  n_metadata =
+    heif_image_handle_get_list_of_metadata_block_IDs (handle,
+                                                      "mime",
+                                                      &metadata_id, 1);
+  if (n_metadata > 0)
+    {
+      if (g_strcmp0 (
+            heif_image_handle_get_metadata_content_type (handle, metadata_id),
+            "application/rdf+xml") == 0)
+        {
+          xmp_data_size = heif_image_handle_get_metadata_size (handle,
+                          metadata_id);
+          xmp_data = g_alloca (xmp_data_size);
+
+          err = heif_image_handle_get_metadata (handle, metadata_id, xmp_data);
+          if (err.code != 0)
+            {
+              xmp_data      = NULL;
+              xmp_data_size = 0;
+            }
+        }
+    }
+
+  if (exif_data || xmp_data)
+    {
+      GimpMetadata          *metadata = gimp_metadata_new ();
+      GimpMetadataLoadFlags  flags    = GIMP_METADATA_LOAD_COMMENT | GIMP_METADATA_LOAD_RESOLUTION;
+
+      if (exif_data)
+        {
+          const guint8 tiffHeaderBE[4] = { 'M', 'M', 0, 42 };
+          const guint8 tiffHeaderLE[4] = { 'I', 'I', 42, 0 };
+          GExiv2Metadata *exif_metadata = GEXIV2_METADATA (metadata);
+          const guint8 *tiffheader = exif_data;
+          glong new_exif_size = exif_data_size;
+
+          while (new_exif_size >= 4)  /*Searching for TIFF Header*/
+            {
+              if (tiffheader[0] == tiffHeaderBE[0] && tiffheader[1] == tiffHeaderBE[1] &&
+                  tiffheader[2] == tiffHeaderBE[2] && tiffheader[3] == tiffHeaderBE[3])
+                {
+                  break;
+                }
+              if (tiffheader[0] == tiffHeaderLE[0] && tiffheader[1] == tiffHeaderLE[1] &&
+                  tiffheader[2] == tiffHeaderLE[2] && tiffheader[3] == tiffHeaderLE[3])
+                {
+                  break;
+                }
+              new_exif_size--;
+              tiffheader++;
+            }
+
+          if (new_exif_size > 4)   /* TIFF header + some data found*/
+            {
+              if (! gexiv2_metadata_open_buf (exif_metadata, tiffheader, new_exif_size, &error))
+                {
+                  g_printerr ("%s: Failed to set EXIF metadata: %s\n", G_STRFUNC, error->message);
+                  g_clear_error (&error);
+                }
+            }
+          else
+            {
+              g_printerr ("%s: EXIF metadata not set\n", G_STRFUNC);
+            }
+        }
+
+      if (xmp_data)
+        {
+          if (!gimp_metadata_set_from_xmp (metadata, xmp_data, xmp_data_size, &error))
+            {
+              g_printerr ("%s: Failed to set XMP metadata: %s\n", G_STRFUNC, error->message);
+              g_clear_error (&error);
+            }
+        }
+
+      gimp_image_metadata_load_finish (image, "image/heif",
+                                       metadata, flags);
+    }
+}
+
+GimpImage *
+load_image (GFile                        *file,
+            gboolean                      interactive,
+            const HeifpluginLoadOptions  *options,
+            GimpPDBStatusType            *status,
+            GError                      **error)
+{
+  HeifpluginInput           input   = { 0, };
+  struct heif_context      *ctx;
+  struct heif_error         err;
+  struct heif_image_handle *handle  = NULL;
+  GimpColorProfile         *profile = NULL;
+  gint                      n_images;
+  heif_item_id              primary;
+  heif_item_id              selected_image;
+  gboolean                  has_alpha;
+  gint                      width;
+  gint                      height;
+  GeglRectangle             area;
+  GimpImage                *image;
+  GimpLayer                *layer;
+  GeglBuffer               *buffer;
+  const Babl               *format;
+  gint                      bit_depth = 8;
+  GimpPrecision             precision;
+  gboolean                  load_linear;
+  const char               *encoding;
+
+  gimp_progress_init_printf (_("Opening '%s'"),
+                             gimp_file_get_utf8_name (file));
+
+  *status = GIMP_PDB_EXECUTION_ERROR;
+
+  ctx = heif_context_alloc ();
+  if (!ctx)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "cannot allocate heif_context");
+      return NULL;
+    }
+
+  if (! heifplugin_context_read (ctx, file, &input, error))
+    {
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  heifplugin_set_decoding_threads (ctx, &input, 0);
+
+  gimp_progress_update (0.5);
+
+  /* analyze image content
+   * Is there more than one image? Which image is the primary image?
+   */
+
+  n_images = heif_context_get_number_of_top_level_images (ctx);
+  if (n_images == 0)
+    {
+      g_set_error_literal (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                           _("Loading HEIF image failed: "
+                             "Input file contains no readable images"));
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  err = heif_context_get_primary_image_ID (ctx, &primary);
+  if (err.code)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Loading HEIF image failed: %s"),
+                   err.message);
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  /* if primary image is no top level image or not present (invalid
+   * file), just take the first image
+   */
+
+  if (! heif_context_is_top_level_image_ID (ctx, primary))
+    {
+      gint n = heif_context_get_list_of_top_level_image_IDs (ctx, &primary, 1);
+      g_assert (n == 1);
+    }
+
+  selected_image = primary;
+
+  /* if there are several images in the file and we are running
+   * interactive, let the user choose a picture
+   */
+
+  if (interactive && n_images > 1)
+    {
+      if (! load_dialog (ctx, &input, &selected_image))
+        {
+          heif_context_free (ctx);
+          heifplugin_input_clear (&input);
+
+          *status = GIMP_PDB_CANCEL;
+
+          return NULL;
+        }
+    }
+
+  /* load the picture */
+
+  err = heif_context_get_image_handle (ctx, selected_image, &handle);
+  if (err.code)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Loading HEIF image failed: %s"),
+                   err.message);
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  has_alpha = heif_image_handle_has_alpha_channel (handle);
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+  bit_depth = heif_image_handle_get_luma_bits_per_pixel (handle);
+  if (bit_depth < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "Input image has undefined bit-depth");
+      heif_image_handle_release (handle);
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+#endif
+
+  profile = heifplugin_get_color_profile (handle);
+
+  /* only the area of the image we load ends up in the GIMP image */
+
+  gegl_rectangle_set (&area, 0, 0,
+                      heif_image_handle_get_width  (handle),
+                      heif_image_handle_get_height (handle));
+
+  if (options && options->use_region &&
+      ! gegl_rectangle_intersect (&area, &area, &options->region))
+    {
+      g_set_error_literal (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                           _("Loading HEIF image failed: "
+                             "The region lies outside of the image"));
+      if (profile)
+        g_object_unref (profile);
+      heif_image_handle_release (handle);
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  width  = area.width;
+  height = area.height;
+
+  /* create GIMP image and copy HEIF image into the GIMP image
+   * (converting it to RGB)
+   */
+
+  if (profile)
+    {
+      load_linear = gimp_color_profile_is_linear (profile);
+    }
+  else
+    {
+      load_linear = FALSE;
+    }
+
+  precision = heifplugin_get_precision (bit_depth, load_linear);
+  encoding  = heifplugin_get_encoding (bit_depth, has_alpha, load_linear);
+
+  image = gimp_image_new_with_precision (width, height, GIMP_RGB, precision);
+  gimp_image_set_file (image, file);
+
+  heifplugin_set_color_profile (image, profile);
+
+  layer = gimp_layer_new (image,
+                          _("image content"),
+                          width, height,
+                          has_alpha ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE,
+                          100.0,
+                          gimp_image_get_default_new_layer_mode (image));
+
+  gimp_image_insert_layer (image, layer, NULL, 0);
+
+  buffer = gimp_drawable_get_buffer (GIMP_DRAWABLE (layer));
+
+  format = babl_format_with_space (encoding,
+                                   gegl_buffer_get_format (buffer));
+
+  /* libheif reads from our stream sequentially, only decode tiles in
+   * parallel when the file is in memory
+   */
+  if (! heifplugin_decode_to_buffer (handle, &area, buffer, format,
+                                     bit_depth, has_alpha,
+                                     input.stream ? 1 : 0, error))
+    {
+      g_object_unref (buffer);
+      gimp_image_delete (image);
+      if (profile)
+        g_object_unref (profile);
+      heif_image_handle_release (handle);
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  g_object_unref (buffer);
+
+  gimp_progress_update (0.75);
+
+  heifplugin_load_metadata (handle, image);
+
+  if (profile)
+    g_object_unref (profile);
+
+  heif_image_handle_release (handle);
+  heif_context_free (ctx);
+  heifplugin_input_clear (&input);
+
+  gimp_progress_update (1.0);
+
+  if (image)
+    {
+      *status = GIMP_PDB_SUCCESS;
+    }
+  return image;
+}
+
+typedef struct
+{
+  struct heif_image_handle *handle;
+  GeglRectangle             area;
+  GeglBuffer               *buffer;
+  const Babl               *format;
+  gint                      bit_depth;
+  gboolean                  has_alpha;
+  GError                   *error;
+} HeifpluginLayer;
+
+typedef struct
+{
+  HeifpluginLayer *layers;
+  gint             max_decode_threads;
+} HeifpluginLayers;
+
+static void
+heifplugin_load_layer (gint     job,
+                       gpointer user_data)
+{
+  const HeifpluginLayers *layers = user_data;
+  HeifpluginLayer        *layer  = &layers->layers[job];
+
+  heifplugin_decode_to_buffer (layer->handle, &layer->area,
+                               layer->buffer, layer->format,
+                               layer->bit_depth, layer->has_alpha,
+                               layers->max_decode_threads, &layer->error);
+}
+
+/* Get the pixel format the pixels of layer are decoded in, with the
+ * layer's own color space and transfer. gegl_buffer_set() then converts
+ * them to the image's profile, if that is a different one.
+ */
+static const Babl *
+heifplugin_get_layer_format (HeifpluginLayer  *layer,
+                             GError          **error)
+{
+  GimpColorProfile *profile;
+  const Babl       *space;
+  gboolean          linear = FALSE;
+
+  profile = heifplugin_get_color_profile (layer->handle);
+
+  if (profile)
+    {
+      linear = gimp_color_profile_is_linear (profile);
+      space  = gimp_color_profile_get_space (profile,
+                                             GIMP_COLOR_RENDERING_INTENT_RELATIVE_COLORIMETRIC,
+                                             error);
+      g_object_unref (profile);
+
+      if (! space)
+        return NULL;
+    }
+  else
+    {
+      /* images without a profile are loaded as sRGB */
+      space = babl_space ("sRGB");
+    }
+
+  return babl_format_with_space (heifplugin_get_encoding (layer->bit_depth,
+                                                          layer->has_alpha,
+                                                          linear),
+                                 space);
+}
+
+/* Load the top level images ids (all of them if n_ids is 0) of file as
+ * layers of one image, from a single parse of the container. The layers
+ * are decoded in parallel, the image takes the color profile and
+ * metadata of the primary image, or of the first one if the primary
+ * image isn't loaded. Layers with another profile are converted to the
+ * image's one.
+ */
+static GimpImage *
+load_layers_image (GFile          *file,
+                   const gint32   *ids,
+                   gint            n_ids,
+                   gboolean        load_metadata,
+                   GError        **error)
+{
+  HeifpluginInput      input     = { 0, };
+  HeifpluginLayers     layers;
+  struct heif_context *ctx;
+  struct heif_error    err;
+  heif_item_id         primary;
+  heif_item_id        *IDs;
+  GimpColorProfile    *profile   = NULL;
+  GimpImage           *image     = NULL;
+  gint                 reference = 0;
+  gint                 width     = 0;
+  gint                 height    = 0;
+  gint                 bit_depth = 8;
+  gboolean             load_linear;
+  gint                 i;
+
+  gimp_progress_init_printf (_("Opening '%s'"),
+                             gimp_file_get_utf8_name (file));
+
+  ctx = heif_context_alloc ();
+  if (!ctx)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "cannot allocate heif_context");
+      return NULL;
+    }
+
+  if (! heifplugin_context_read (ctx, file, &input, error) ||
+      ! heifplugin_get_primary_image_ID (ctx, &primary, error))
+    {
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  gimp_progress_update (0.25);
+
+  if (n_ids == 0)
+    {
+      n_ids = heif_context_get_number_of_top_level_images (ctx);
+      IDs   = g_new (heif_item_id, n_ids);
+
+      heif_context_get_list_of_top_level_image_IDs (ctx, IDs, n_ids);
+    }
+  else
+    {
+      IDs = g_new (heif_item_id, n_ids);
+
+      for (i = 0; i < n_ids; i++)
+        IDs[i] = ids[i];
+    }
+
+  layers.layers             = g_new0 (HeifpluginLayer, n_ids);
+  layers.max_decode_threads = input.stream ? 1 : 0;
+
+  /* the layers are decoded at the same time, they share the processors */
+  heifplugin_set_decoding_threads (ctx, &input,
+                                   MAX (heifplugin_get_num_threads () /
+                                        CLAMP (n_ids, 1,
+                                               heifplugin_get_num_threads ()),
+                                        1));
+
+  for (i = 0; i < n_ids; i++)
+    {
+      HeifpluginLayer *layer = &layers.layers[i];
+
+      if (! heif_context_is_top_level_image_ID (ctx, IDs[i]))
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                       _("Loading HEIF image failed: "
+                         "Item %u is not a top level image"),
+                       IDs[i]);
+          break;
+        }
+
+      err = heif_context_get_image_handle (ctx, IDs[i], &layer->handle);
+      if (err.code)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                       _("Loading HEIF image failed: %s"),
+                       err.message);
+          break;
+        }
+
+      layer->has_alpha = heif_image_handle_has_alpha_channel (layer->handle);
+      layer->bit_depth = 8;
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+      layer->bit_depth = heif_image_handle_get_luma_bits_per_pixel (layer->handle);
+      if (layer->bit_depth < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                       "Input image has undefined bit-depth");
+          break;
+        }
+#endif
+
+      gegl_rectangle_set (&layer->area, 0, 0,
+                          heif_image_handle_get_width  (layer->handle),
+                          heif_image_handle_get_height (layer->handle));
+
+      width     = MAX (width,  layer->area.width);
+      height    = MAX (height, layer->area.height);
+      bit_depth = MAX (bit_depth, layer->bit_depth);
+
+      if (IDs[i] == primary)
+        reference = i;
+    }
+
+  if (i == n_ids)
+    {
+      profile = heifplugin_get_color_profile (layers.layers[reference].handle);
+
+      load_linear = profile && gimp_color_profile_is_linear (profile);
+
+      image = gimp_image_new_with_precision (width, height, GIMP_RGB,
+                                             heifplugin_get_precision (bit_depth,
+                                                                       load_linear));
+      gimp_image_set_file (image, file);
+
+      heifplugin_set_color_profile (image, profile);
+
+      /* all PDB calls happen here, the workers only decode */
+
+      for (i = 0; i < n_ids; i++)
+        {
+          HeifpluginLayer *layer = &layers.layers[i];
+          GimpLayer       *gimp_layer;
+          gchar           *name;
+
+          name = g_strdup_printf (_("Image %u"), IDs[i]);
+
+          gimp_layer = gimp_layer_new (image, name,
+                                       layer->area.width, layer->area.height,
+                                       layer->has_alpha ?
+                                       GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE,
+                                       100.0,
+                                       gimp_image_get_default_new_layer_mode (image));
+          g_free (name);
+
+          gimp_image_insert_layer (image, gimp_layer, NULL, i);
+
+          layer->format = heifplugin_get_layer_format (layer, error);
+          if (! layer->format)
+            break;
+
+          layer->buffer = gimp_drawable_get_buffer (GIMP_DRAWABLE (gimp_layer));
+        }
+
+      gimp_progress_update (0.5);
+
+      if (i < n_ids)
+        {
+          /* a layer's profile can't be converted */
+          gimp_image_delete (image);
+          image = NULL;
+        }
+      else
+        {
+          /* libheif reads from our stream sequentially, only decode in
+           * parallel when the file is in memory
+           */
+          heifplugin_parallel_run (n_ids, layers.max_decode_threads,
+                                   heifplugin_load_layer, &layers);
+        }
+
+      gimp_progress_update (0.75);
+
+      for (i = 0; i < n_ids; i++)
+        {
+          HeifpluginLayer *layer = &layers.layers[i];
+
+          g_clear_object (&layer->buffer);
+
+          if (layer->error && image)
+            {
+              g_propagate_error (error, layer->error);
+              layer->error = NULL;
+
+              gimp_image_delete (image);
+              image = NULL;
+            }
+
+          g_clear_error (&layer->error);
+        }
+
+      if (image && load_metadata)
+        heifplugin_load_metadata (layers.layers[reference].handle, image);
+
+      if (profile)
+        g_object_unref (profile);
+    }
+
+  for (i = 0; i < n_ids; i++)
+    {
+      if (layers.layers[i].handle)
+        heif_image_handle_release (layers.layers[i].handle);
+    }
+
+  g_free (layers.layers);
+  g_free (IDs);
+
+  heif_context_free (ctx);
+  heifplugin_input_clear (&input);
+
+  gimp_progress_update (1.0);
+
+  return image;
+}
+
+typedef struct
+{
+  GFile                    *file;
+  HeifpluginInput           input;
+  struct heif_context      *ctx;
+  struct heif_image_handle *handle;
+  GimpColorProfile         *profile;
+  GeglRectangle             area;
+  gint                      bit_depth;
+  gboolean                  has_alpha;
+  GimpImage                *image;
+  GeglBuffer               *buffer;
+  const Babl               *format;
+  gint                      max_decode_threads;
+  GError                   *error;
+} HeifpluginFile;
+
+static void
+heifplugin_file_clear (HeifpluginFile *file)
+{
+  g_clear_object (&file->buffer);
+  g_clear_object (&file->profile);
+
+  if (file->handle)
+    heif_image_handle_release (file->handle);
+
+  if (file->ctx)
+    heif_context_free (file->ctx);
+
+  heifplugin_input_clear (&file->input);
+
+  file->handle = NULL;
+  file->ctx    = NULL;
+}
+
+/* Parse one file of the batch and get everything needed to create its
+ * image. Runs on a worker thread, so no PDB calls here.
+ */
+static void
+heifplugin_file_open (gint     job,
+                      gpointer user_data)
+{
+  HeifpluginFile    *file = (HeifpluginFile *) user_data + job;
+  struct heif_error  err;
+  heif_item_id       primary;
+
+  file->ctx = heif_context_alloc ();
+  if (! file->ctx)
+    {
+      g_set_error (&file->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "cannot allocate heif_context");
+      return;
+    }
+
+  if (! heifplugin_context_read (file->ctx, file->file, &file->input,
+                                 &file->error) ||
+      ! heifplugin_get_primary_image_ID (file->ctx, &primary, &file->error))
+    {
+      heifplugin_file_clear (file);
+      return;
+    }
+
+  heifplugin_set_decoding_threads (file->ctx, &file->input,
+                                   file->max_decode_threads);
+
+  err = heif_context_get_image_handle (file->ctx, primary, &file->handle);
+  if (err.code)
+    {
+      g_set_error (&file->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Loading HEIF image failed: %s"),
+                   err.message);
+      heifplugin_file_clear (file);
+      return;
+    }
+
+  file->has_alpha = heif_image_handle_has_alpha_channel (file->handle);
+  file->bit_depth = 8;
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+  file->bit_depth = heif_image_handle_get_luma_bits_per_pixel (file->handle);
+  if (file->bit_depth < 0)
+    {
+      g_set_error (&file->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "Input image has undefined bit-depth");
+      heifplugin_file_clear (file);
+      return;
+    }
+#endif
+
+  file->profile = heifplugin_get_color_profile (file->handle);
+
+  gegl_rectangle_set (&file->area, 0, 0,
+                      heif_image_handle_get_width  (file->handle),
+                      heif_image_handle_get_height (file->handle));
+}
+
+static void
+heifplugin_file_decode (gint     job,
+                        gpointer user_data)
+{
+  HeifpluginFile *file = (HeifpluginFile *) user_data + job;
+
+  if (! file->image)
+    return;
+
+  /* libheif reads from our stream sequentially, only decode tiles in
+   * parallel when the file is in memory
+   */
+  heifplugin_decode_to_buffer (file->handle, &file->area,
+                               file->buffer, file->format,
+                               file->bit_depth, file->has_alpha,
+                               file->input.stream ?
+                               1 : file->max_decode_threads,
+                               &file->error);
+}
+
+/* Create the image and layer that file is decoded into. Needs the PDB,
+ * so it runs on the calling thread.
+ */
+static void
+heifplugin_file_create_image (HeifpluginFile *file)
+{
+  GimpLayer *layer;
+  gboolean   load_linear;
+
+  load_linear = (file->profile &&
+                 gimp_color_profile_is_linear (file->profile));
+
+  file->image =
+    gimp_image_new_with_precision (file->area.width, file->area.height,
+                                   GIMP_RGB,
+                                   heifplugin_get_precision (file->bit_depth,
+                                                             load_linear));
+  gimp_image_set_file (file->image, file->file);
+
+  heifplugin_set_color_profile (file->image, file->profile);
+
+  layer = gimp_layer_new (file->image,
+                          _("image content"),
+                          file->area.width, file->area.height,
+                          file->has_alpha ?
+                          GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE,
+                          100.0,
+                          gimp_image_get_default_new_layer_mode (file->image));
+
+  gimp_image_insert_layer (file->image, layer, NULL, 0);
+
+  file->buffer = gimp_drawable_get_buffer (GIMP_DRAWABLE (layer));
+  file->format =
+    babl_format_with_space (heifplugin_get_encoding (file->bit_depth,
+                                                     file->has_alpha,
+                                                     load_linear),
+                            gegl_buffer_get_format (file->buffer));
+}
+
+/* Load the primary images of n_files files, up to max_jobs of them at
+ * the same time (0 for one per processor). Each file is decoded on up
+ * to max_decode_threads threads, 0 to share the processors between the
+ * files decoded at once. The files are loaded in rounds of max_jobs, so
+ * only that many are parsed and have buffers open at once. The thread
+ * budget is taken anew for every round. In a round, parsing and
+ * decoding run on the worker pool, image creation and metadata handling
+ * happen on the calling thread between the two. A file that fails to
+ * load gets a NULL image and its error set, and doesn't affect the
+ * others.
+ */
+static void
+load_files (GFile      **gfiles,
+            gint         n_files,
+            gint         max_jobs,
+            gint         max_decode_threads,
+            GimpImage  **images,
+            GError     **errors)
+{
+  HeifpluginFile *files;
+  gint            n_jobs;
+  gint            n_decode_threads;
+  gint            first;
+  gint            i;
+
+  gimp_progress_init (_("Opening HEIF images"));
+
+  if (max_jobs <= 0)
+    max_jobs = heifplugin_get_num_threads ();
+
+  n_jobs = CLAMP (n_files, 1, max_jobs);
+
+  files = g_new (HeifpluginFile, n_jobs);
+
+  for (first = 0; first < n_files; first += n_jobs)
+    {
+      gint n_round = MIN (n_jobs, n_files - first);
+
+      if (first > 0)
+        heifplugin_refresh_thread_budget ();
+
+      n_decode_threads = max_decode_threads;
+
+      if (n_decode_threads <= 0)
+        n_decode_threads = MAX (heifplugin_get_num_threads () / n_jobs, 1);
+
+      memset (files, 0, n_round * sizeof (HeifpluginFile));
+
+      for (i = 0; i < n_round; i++)
+        {
+          files[i].file               = gfiles[first + i];
+          files[i].max_decode_threads = n_decode_threads;
+        }
+
+      heifplugin_parallel_run (n_round, n_jobs, heifplugin_file_open, files);
+
+      for (i = 0; i < n_round; i++)
+        {
+          if (! files[i].error)
+            heifplugin_file_create_image (&files[i]);
+        }
+
+      heifplugin_parallel_run (n_round, n_jobs, heifplugin_file_decode, files);
+
+      for (i = 0; i < n_round; i++)
+        {
+          HeifpluginFile *file = &files[i];
+
+          if (file->image)
+            {
+              g_clear_object (&file->buffer);
+
+              if (file->error)
+                {
+                  gimp_image_delete (file->image);
+                  file->image = NULL;
+                }
+              else
+                {
+                  heifplugin_load_metadata (file->handle, file->image);
+                }
+            }
+
+          heifplugin_file_clear (file);
+
+          images[first + i] = file->image;
+          errors[first + i] = file->error;
+        }
+
+      gimp_progress_update ((gdouble) (first + n_round) / n_files);
+    }
+
+  g_free (files);
+
+  gimp_progress_update (1.0);
+}
+
+/* Get the smallest thumbnail of handle whose longer side has at least
+ * size pixels, or the largest one if none is big enough. Returns NULL
+ * if the image has no usable thumbnails.
+ */
+static struct heif_image_handle *
+heifplugin_get_thumbnail_handle (struct heif_image_handle *handle,
+                                 gint                      size)
+{
+  struct heif_image_handle *best      = NULL;
+  gint                      best_size = 0;
+  heif_item_id             *IDs;
+  gint                      n_thumbnails;
+  gint                      i;
+
+  n_thumbnails = heif_image_handle_get_number_of_thumbnails (handle);
+  if (n_thumbnails <= 0)
+    return NULL;
+
+  IDs = g_new (heif_item_id, n_thumbnails);
+
+  n_thumbnails = heif_image_handle_get_list_of_thumbnail_IDs (handle, IDs,
+                                                              n_thumbnails);
+
+  for (i = 0; i < n_thumbnails; i++)
+    {
+      struct heif_image_handle *thumbnail_handle = NULL;
+      struct heif_error         err;
+      gint                      thumbnail_size;
+
+      err = heif_image_handle_get_thumbnail (handle, IDs[i],
+                                             &thumbnail_handle);
+      if (err.code)
+        continue;
+
+      thumbnail_size = MAX (heif_image_handle_get_width  (thumbnail_handle),
+                            heif_image_handle_get_height (thumbnail_handle));
+
+      if (! best                                                  ||
+          (best_size < size && thumbnail_size > best_size)        ||
+          (thumbnail_size >= size && thumbnail_size < best_size))
+        {
+          if (best)
+            heif_image_handle_release (best);
+
+          best      = thumbnail_handle;
+          best_size = thumbnail_size;
+        }
+      else
+        {
+          heif_image_handle_release (thumbnail_handle);
+        }
+    }
+
+  g_free (IDs);
+
+  return best;
+}
+
+/* Compute the size of width x height scaled down to fit into a box of
+ * size x size pixels.
+ */
+static void
+heifplugin_fit_size (gint  width,
+                     gint  height,
+                     gint  size,
+                     gint *new_width,
+                     gint *new_height)
+{
+  /* compute scaling factor to fit into a max sized box */
+
+  gfloat factor_h = width  / (gfloat) size;
+  gfloat factor_v = height / (gfloat) size;
+
+  if (factor_v > factor_h)
+    {
+      *new_height = size;
+      *new_width  = MAX (width / factor_v, 1);
+    }
+  else
+    {
+      *new_height = MAX (height / factor_h, 1);
+      *new_width  = size;
+    }
+}
+
+/* Decode an 8 bit RGB(A) preview of handle which fits into a box of
+ * size x size pixels. An embedded thumbnail is used if there is one,
+ * otherwise the image itself is decoded and scaled down.
+ */
+static struct heif_image *
+heifplugin_decode_thumbnail (struct heif_image_handle  *handle,
+                             gint                       size,
+                             gboolean                   with_alpha,
+                             GError                   **error)
+{
+  struct heif_image_handle *thumbnail_handle;
+  struct heif_image_handle *decode_handle;
+  struct heif_image        *thumbnail_img = NULL;
+  struct heif_error         err;
+  gint                      thumbnail_width;
+  gint                      thumbnail_height;
+  gint                      new_width;
+  gint                      new_height;
+
+  thumbnail_handle = heifplugin_get_thumbnail_handle (handle, size);
+  decode_handle    = thumbnail_handle ? thumbnail_handle : handle;
+
+  thumbnail_width  = heif_image_handle_get_width  (decode_handle);
+  thumbnail_height = heif_image_handle_get_height (decode_handle);
+
+  /* if the image needs to be scaled down, decode it in its native
+   * YCbCr layout and convert it while downscaling
+   */
+  if (thumbnail_width  > size ||
+      thumbnail_height > size)
+    {
+      struct heif_image *native_img = NULL;
+
+      heifplugin_fit_size (thumbnail_width, thumbnail_height, size,
+                           &new_width, &new_height);
+
+      err = heifplugin_decode_image (decode_handle,
+                                     &native_img,
+                                     heif_colorspace_undefined,
+                                     heif_chroma_undefined);
+
+      if (! err.code)
+        {
+          thumbnail_img = heifplugin_downscale_ycbcr (native_img,
+                                                      decode_handle,
+                                                      new_width, new_height,
+                                                      with_alpha);
+          heif_image_release (native_img);
+        }
+
+      if (thumbnail_img)
+        {
+          if (thumbnail_handle)
+            heif_image_handle_release (thumbnail_handle);
+
+          return thumbnail_img;
+        }
+    }
+
+  err = heifplugin_decode_image (decode_handle,
+                                 &thumbnail_img,
+                                 heif_colorspace_RGB,
+                                 with_alpha ?
+                                 heif_chroma_interleaved_RGBA :
+                                 heif_chroma_interleaved_RGB);
+
+  if (thumbnail_handle)
+    heif_image_handle_release (thumbnail_handle);
+
+  if (err.code)
+    {
+      g_set_error_literal (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                           err.message);
+      return NULL;
+    }
+
+  /* if thumbnail image size exceeds the maximum, scale it down */
+
+  thumbnail_width  = heif_image_get_width  (thumbnail_img,
+                                            heif_channel_interleaved);
+  thumbnail_height = heif_image_get_height (thumbnail_img,
+                                            heif_channel_interleaved);
+
+  if (thumbnail_width  > size ||
+      thumbnail_height > size)
+    {
+      struct heif_image *scaled_img = NULL;
+
+      heifplugin_fit_size (thumbnail_width, thumbnail_height, size,
+                           &new_width, &new_height);
+
+      /* scale the image */
+
+      err = heif_image_scale_image (thumbnail_img,
+                                    &scaled_img,
+                                    new_width, new_height,
+                                    NULL);
+
+      /* release the old image and only keep the scaled down version */
+
+      heif_image_release (thumbnail_img);
+
+      if (err.code)
+        {
+          g_set_error_literal (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                               err.message);
+          return NULL;
+        }
+
+      thumbnail_img = scaled_img;
+    }
+
+  return thumbnail_img;
+}
+
+static GimpImage *
+load_thumbnail_image (GFile          *file,
+                      gint            size,
+                      gint           *width,
+                      gint           *height,
+                      GimpImageType  *type,
+                      GError        **error)
+{
+  HeifpluginInput           input  = { 0, };
+  struct heif_context      *ctx;
+  struct heif_error         err;
+  struct heif_image_handle *handle = NULL;
+  struct heif_image        *img;
+  heif_item_id              primary;
+  gboolean                  has_alpha;
+  GimpImage                *image;
+  GimpLayer                *layer;
+  GeglBuffer               *buffer;
+  const guint8             *data;
+  gint                      stride;
+  gint                      thumbnail_width;
+  gint                      thumbnail_height;
+
+  ctx = heif_context_alloc ();
+  if (!ctx)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "cannot allocate heif_context");
+      return NULL;
+    }
+
+  /* only the container is parsed, the full image is never decoded
+   * when there is a thumbnail
+   */
+  if (! heifplugin_context_read (ctx, file, &input, error) ||
+      ! heifplugin_get_primary_image_ID (ctx, &primary, error))
+    {
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  heifplugin_set_decoding_threads (ctx, &input, 0);
+
+  err = heif_context_get_image_handle (ctx, primary, &handle);
+  if (err.code)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Loading HEIF image failed: %s"),
+                   err.message);
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  has_alpha = heif_image_handle_has_alpha_channel (handle);
+
+  *width  = heif_image_handle_get_width  (handle);
+  *height = heif_image_handle_get_height (handle);
+  *type   = has_alpha ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE;
+
+  img = heifplugin_decode_thumbnail (handle, size, has_alpha, error);
+
+  heif_image_handle_release (handle);
+
+  if (! img)
+    {
+      heif_context_free (ctx);
+      heifplugin_input_clear (&input);
+
+      return NULL;
+    }
+
+  thumbnail_width  = heif_image_get_width  (img, heif_channel_interleaved);
+  thumbnail_height = heif_image_get_height (img, heif_channel_interleaved);
+
+  image = gimp_image_new (thumbnail_width, thumbnail_height, GIMP_RGB);
+
+  layer = gimp_layer_new (image,
+                          _("image content"),
+                          thumbnail_width, thumbnail_height,
+                          *type,
+                          100.0,
+                          gimp_image_get_default_new_layer_mode (image));
+
+  gimp_image_insert_layer (image, layer, NULL, 0);
+
+  buffer = gimp_drawable_get_buffer (GIMP_DRAWABLE (layer));
+
+  data = heif_image_get_plane_readonly (img, heif_channel_interleaved,
+                                        &stride);
+
+  gegl_buffer_set (buffer,
+                   GEGL_RECTANGLE (0, 0, thumbnail_width, thumbnail_height),
+                   0,
+                   babl_format (has_alpha ? "R'G'B'A u8" : "R'G'B' u8"),
+                   data, stride);
+
+  g_object_unref (buffer);
+
+  heif_image_release (img);
+  heif_context_free (ctx);
+  heifplugin_input_clear (&input);
+
+  return image;
+}
+
+static const gchar *
+heifplugin_fix_xmp_tag (const gchar *tag)
+{
+  gchar *substring;
+
+  /* Due to problems using /Iptc4xmpExt namespace (/iptcExt is used
+   * instead by Exiv2) we replace all occurrences with /iptcExt which
+   * is valid but less common. Not doing so would cause saving xmp
+   * metadata to fail. This has to be done after getting the values
+   * from the source metadata since that source uses the original
+   * tag names and would otherwise return NULL as value.
+   * /Iptc4xmpExt length = 12
+   * /iptcExt     length =  8
+   */
+
+  substring = strstr (tag, "/Iptc4xmpExt");
+  while (substring)
+    {
+      gint len_tag = strlen (tag);
+      gint len_end;
+
+      len_end = len_tag - (substring - tag) - 12;
+      strncpy (substring, "/iptcExt", 8);
+      substring += 8;
+      /* Using memmove: we have overlapping source and dest */
+      memmove (substring, substring+4, len_end);
+      substring[len_end] = '\0';
+      g_debug ("Fixed tag value: %s", tag);
+
+      /* Multiple occurrences are possible: e.g.:
+       * Xmp.iptcExt.ImageRegion[3]/Iptc4xmpExt:RegionBoundary/Iptc4xmpExt:rbVertices[1]/Iptc4xmpExt:rbX
+       */
+      substring = strstr (tag, "/Iptc4xmpExt");
+    }
+  return tag;
+}
+
+static void
+heifplugin_image_metadata_copy_tag (GExiv2Metadata *src,
+                                    GExiv2Metadata *dest,
+                                    const gchar    *tag)
+{
+  gchar **values = gexiv2_metadata_try_get_tag_multiple (src, tag, NULL);
+
+  if (values)
+    {
+      gchar *temp_tag;
+
+      /* Xmp always seems to return multiple values */
+      if (g_str_has_prefix (tag, "Xmp."))
+        temp_tag = (gchar *) heifplugin_fix_xmp_tag (g_strdup (tag));
+      else
+        temp_tag = g_strdup (tag);
+
+      gexiv2_metadata_try_set_tag_multiple (dest, temp_tag, (const gchar **) values, NULL);
+      g_free (temp_tag);
+      g_strfreev (values);
+    }
+  else
+    {
+      gchar *value = gexiv2_metadata_try_get_tag_string (src, tag, NULL);
+
+      if (value)
+        {
+          gexiv2_metadata_try_set_tag_string (dest, tag, value, NULL);
+          g_free (value);
+        }
+    }
+}
+
+static struct heif_error
+write_callback (struct heif_context *ctx,
+                const void          *data,
+                size_t               size,
+                void                *userdata)
+{
+  GOutputStream     *output = userdata;
+  GError            *error  = NULL;
+  struct heif_error  heif_error;
+
+  heif_error.code    = heif_error_Ok;
+  heif_error.subcode = heif_suberror_Unspecified;
+  heif_error.message = "";
+
+  if (! g_output_stream_write_all (output, data, size, NULL, NULL, &error))
+    {
+      heif_error.code    = 99; /* hmm */
+      heif_error.message = error->message;
+    }
+
+  return heif_error;
+}
+
+static void
+heifplugin_save_options_init (HeifpluginSaveOptions *options,
+                              GObject               *config)
+{
+  memset (options, 0, sizeof (HeifpluginSaveOptions));
+
+  options->save_bit_depth = 8;
+  options->pixel_format   = HEIFPLUGIN_EXPORT_FORMAT_YUV420;
+  options->encoder_speed  = HEIFPLUGIN_ENCODER_SPEED_BALANCED;
+
+  g_object_get (config,
+                "lossless",           &options->lossless,
+                "quality",            &options->quality,
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+                "pixel-format",       &options->pixel_format,
+#endif
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+                "save-bit-depth",     &options->save_bit_depth,
+                "encoder-speed",      &options->encoder_speed,
+#endif
+                "save-color-profile", &options->save_profile,
+                "save-exif",          &options->save_exif,
+                "save-xmp",           &options->save_xmp,
+                NULL);
+
+  options->row_mt = TRUE;
+
+  /* only the AV1 procedures have the tiling arguments */
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (config), "tile-rows"))
+    g_object_get (config,
+                  "tile-rows", &options->tile_rows,
+                  "tile-cols", &options->tile_cols,
+                  "row-mt",    &options->row_mt,
+                  NULL);
+}
+
+static const struct heif_encoder_descriptor *
+heifplugin_get_encoder_descriptor (struct heif_context           *context,
+                                   enum heif_compression_format   compression,
+                                   GError                       **error)
+{
+  /* descriptors belong to libheif and stay valid until the plug-in
+   * quits, so the resident extension looks them up only once
+   */
+  static const struct heif_encoder_descriptor *hevc_descriptor = NULL;
+  static const struct heif_encoder_descriptor *av1_descriptor  = NULL;
+
+  if (compression == heif_compression_HEVC)
+    {
+      if (hevc_descriptor ||
+          heif_context_get_encoder_descriptors (context,
+                                                heif_compression_HEVC,
+                                                NULL,
+                                                &hevc_descriptor, 1) == 1)
+        {
+          return hevc_descriptor;
+        }
+
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "Unable to find suitable HEIF encoder");
+      return NULL;
+    }
+
+  /* AV1 compression */
+  if (av1_descriptor ||
+      heif_context_get_encoder_descriptors (context,
+                                            compression,
+                                            "aom", /* we prefer aom rather than rav1e */
+                                            &av1_descriptor, 1) == 1 ||
+      heif_context_get_encoder_descriptors (context,
+                                            compression,
+                                            NULL,
+                                            &av1_descriptor, 1) == 1)
+    {
+      return av1_descriptor;
+    }
+
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+               "Unable to find suitable AVIF encoder");
+  return NULL;
+}
+
+/* Create the heif image to encode from drawable. This needs the PDB, so
+ * it must be called from the main thread; the pixel conversion itself
+ * runs on the worker pool.
+ */
+static struct heif_image *
+heifplugin_create_save_image (GimpImage                   *image,
+                              GimpDrawable                *drawable,
+                              const HeifpluginSaveOptions *options,
+                              GError                     **error)
+{
+  struct heif_image              *h_image = NULL;
+  struct heif_error               err;
+  GeglBuffer                     *buffer;
+  const gchar                    *encoding;
+  const Babl                     *format;
+  const Babl                     *space   = NULL;
+  guint8                         *data;
+  gint                            stride;
+  gint                            width;
+  gint                            height;
+  gboolean                        has_alpha;
+  gboolean                        out_linear = FALSE;
+  gint                            save_bit_depth = options->save_bit_depth;
+  gboolean                        use_ycbcr      = FALSE;
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+  struct heif_color_profile_nclx  nclx_profile;
+#endif
+
+  width   = gimp_drawable_get_width  (drawable);
+  height  = gimp_drawable_get_height (drawable);
+
+  has_alpha = gimp_drawable_has_alpha (drawable);
+
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+  /* for lossy YCbCr formats we produce the subsampled planes ourselves
+   * instead of having libheif convert an RGB image
+   */
+  use_ycbcr = (! options->lossless &&
+               options->pixel_format != HEIFPLUGIN_EXPORT_FORMAT_RGB &&
+               (save_bit_depth == 8  ||
+                save_bit_depth == 10 ||
+                save_bit_depth == 12));
+
+  if (use_ycbcr)
+    {
+      enum heif_chroma chroma;
+
+      switch (options->pixel_format)
+        {
+        case HEIFPLUGIN_EXPORT_FORMAT_YUV444:
+          chroma = heif_chroma_444;
+          break;
+        case HEIFPLUGIN_EXPORT_FORMAT_YUV422:
+          chroma = heif_chroma_422;
+          break;
+        default: /* HEIFPLUGIN_EXPORT_FORMAT_YUV420 */
+          chroma = heif_chroma_420;
+          break;
+        }
+
+      err = heif_image_create (width, height,
+                               heif_colorspace_YCbCr, chroma,
+                               &h_image);
+    }
+  else
+#endif
+  switch (save_bit_depth)
+    {
+    case 8:
+      err = heif_image_create (width, height,
+                               heif_colorspace_RGB,
+                               has_alpha ?
+                               heif_chroma_interleaved_RGBA :
+                               heif_chroma_interleaved_RGB,
+                               &h_image);
+      break;
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+    case 10:
+    case 12:
+#if ( G_BYTE_ORDER == G_LITTLE_ENDIAN )
+      err = heif_image_create (width, height,
+                               heif_colorspace_RGB,
+                               has_alpha ?
+                               heif_chroma_interleaved_RRGGBBAA_LE :
+                               heif_chroma_interleaved_RRGGBB_LE,
+                               &h_image);
+#else
+      err = heif_image_create (width, height,
+                               heif_colorspace_RGB,
+                               has_alpha ?
+                               heif_chroma_interleaved_RRGGBBAA_BE :
+                               heif_chroma_interleaved_RRGGBB_BE,
+                               &h_image);
+#endif
+      break;
+#endif
+    default:
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "Unsupported bit depth: %d",
+                   save_bit_depth);
+      return NULL;
+      break;
+    }
+
+  if (err.code != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Encoding HEIF image failed: %s"),
+                   err.message);
+      return NULL;
+    }
+
+#if LIBHEIF_HAVE_VERSION(1,4,0)
+  if (options->save_profile)
+    {
+      GimpColorProfile *profile = NULL;
+      const guint8     *icc_data;
+      gsize             icc_length;
+
+      profile = gimp_image_get_color_profile (image);
+      if (profile && gimp_color_profile_is_linear (profile))
+        out_linear = TRUE;
+
+      if (! profile)
+        {
+          profile = gimp_image_get_effective_color_profile (image);
+
+          if (gimp_color_profile_is_linear (profile))
+            {
+              if (gimp_image_get_precision (image) != GIMP_PRECISION_U8_LINEAR)
+                {
+                  /* If stored data was linear, let's convert the profile. */
+                  GimpColorProfile *saved_profile;
+
+                  saved_profile = gimp_color_profile_new_srgb_trc_from_color_profile (profile);
+                  g_clear_object (&profile);
+                  profile = saved_profile;
+                }
+              else
+                {
+                  /* Keep linear profile as-is for 8-bit linear image. */
+                  out_linear = TRUE;
+                }
+            }
+        }
+
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+      if (options->pixel_format == HEIFPLUGIN_EXPORT_FORMAT_RGB)
+        {
+          nclx_profile.version = 1;
+          nclx_profile.color_primaries = heif_color_primaries_unspecified;
+
+          if (out_linear)
+            {
+              nclx_profile.transfer_characteristics = heif_transfer_characteristic_linear;
+            }
+          else
+            {
+              nclx_profile.transfer_characteristics = heif_transfer_characteristic_unspecified;
+            }
+
+          nclx_profile.matrix_coefficients = heif_matrix_coefficients_RGB_GBR;
+          nclx_profile.full_range_flag = 1;
+
+          heif_image_set_nclx_color_profile (h_image, &nclx_profile);
+        }
+      else if (use_ycbcr)
+        {
+          /* tell the decoder which matrix our planes use */
+
+          nclx_profile.version = 1;
+          heifplugin_profile_to_nclx (profile, &nclx_profile);
+          nclx_profile.matrix_coefficients = heifplugin_get_save_matrix (&nclx_profile);
+          nclx_profile.full_range_flag = 1;
+
+          heif_image_set_nclx_color_profile (h_image, &nclx_profile);
+        }
+#endif
+
+      icc_data = gimp_color_profile_get_icc_profile (profile, &icc_length);
+      heif_image_set_raw_color_profile (h_image, "prof", icc_data, icc_length);
+      space = gimp_color_profile_get_space (profile,
+                                            GIMP_COLOR_RENDERING_INTENT_RELATIVE_COLORIMETRIC,
+                                            error);
+      if (error && *error)
+        {
+          /* Don't make this a hard failure yet output the error. */
+          g_printerr ("%s: error getting the profile space: %s",
+                      G_STRFUNC, (*error)->message);
+          g_clear_error (error);
+        }
+
+      g_object_unref (profile);
+    }
+  else
+    {
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+      /* We save as sRGB */
+
+      nclx_profile.version = 1;
+      nclx_profile.color_primaries = heif_color_primaries_ITU_R_BT_709_5;
+      nclx_profile.transfer_characteristics = heif_transfer_characteristic_IEC_61966_2_1;
+      nclx_profile.matrix_coefficients = heif_matrix_coefficients_ITU_R_BT_601_6;
+      nclx_profile.full_range_flag = 1;
+
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+      if (options->pixel_format == HEIFPLUGIN_EXPORT_FORMAT_RGB)
+        {
+          nclx_profile.matrix_coefficients = heif_matrix_coefficients_RGB_GBR;
+        }
+#endif
+
+      heif_image_set_nclx_color_profile (h_image, &nclx_profile);
+
+      space = babl_space ("sRGB");
+      out_linear = FALSE;
+#endif
+    }
+#endif /* LIBHEIF_HAVE_VERSION(1,4,0) */
+
+  if (! space)
+    space = gimp_drawable_get_format (drawable);
+
+  if (use_ycbcr)
+    {
+      HeifpluginYCbCrSaveBands ycbcr;
+      gint                     chroma_width  = width;
+      gint                     chroma_height = height;
+      gint                     i;
+
+      memset (&ycbcr, 0, sizeof (HeifpluginYCbCrSaveBands));
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+      /* nclx_profile is the one set on h_image above, always full
+       * range
+       */
+      heifplugin_ycbcr_save_matrix_init (&ycbcr.matrix,
+                                         nclx_profile.matrix_coefficients,
+                                         save_bit_depth);
+#endif
+      ycbcr.func = heifplugin_get_rgb_to_ycbcr_func ();
+
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+      if (options->pixel_format != HEIFPLUGIN_EXPORT_FORMAT_YUV444)
+        {
+          ycbcr.shift_x = 1;
+          chroma_width  = (width + 1) / 2;
+        }
+
+      if (options->pixel_format == HEIFPLUGIN_EXPORT_FORMAT_YUV420)
+        {
+          ycbcr.shift_y = 1;
+          chroma_height = (height + 1) / 2;
+        }
+#endif
+
+      heif_image_add_plane (h_image, heif_channel_Y,
+                            width, height, save_bit_depth);
+      heif_image_add_plane (h_image, heif_channel_Cb,
+                            chroma_width, chroma_height, save_bit_depth);
+      heif_image_add_plane (h_image, heif_channel_Cr,
+                            chroma_width, chroma_height, save_bit_depth);
+
+      if (has_alpha)
+        heif_image_add_plane (h_image, heif_channel_Alpha,
+                              width, height, save_bit_depth);
+
+      for (i = 0; i < (has_alpha ? 4 : 3); i++)
+        {
+          static const enum heif_channel channels[4] =
+            {
+              heif_channel_Y, heif_channel_Cb, heif_channel_Cr,
+              heif_channel_Alpha
+            };
+
+          ycbcr.planes[i] = heif_image_get_plane (h_image, channels[i],
+                                                  &ycbcr.strides[i]);
+        }
+
+      /* always with alpha, so the kernels see 4 floats per pixel */
+      if (out_linear)
+        encoding = "RGBA float";
+      else
+        encoding = "R'G'B'A float";
+
+      format = babl_format_with_space (encoding, space);
+
+      buffer = gimp_drawable_get_buffer (drawable);
+
+      heifplugin_bands_init (&ycbcr.bands, buffer, format, NULL, 0,
+                             width, height, TRUE, save_bit_depth);
+
+      /* subsampled rows must not straddle two bands */
+      ycbcr.bands.band_height += ycbcr.bands.band_height & 1;
+
+      heifplugin_parallel_run (heifplugin_bands_get_n_jobs (&ycbcr.bands),
+                               0, heifplugin_save_ycbcr_band, &ycbcr);
+
+      g_object_unref (buffer);
+    }
+  else if (save_bit_depth > 8)
+    {
+      HeifpluginBands bands;
+      gboolean        high_precision;
+
+      switch (gimp_image_get_precision (image))
+        {
+        case GIMP_PRECISION_U8_LINEAR:
+        case GIMP_PRECISION_U8_NON_LINEAR:
+        case GIMP_PRECISION_U8_PERCEPTUAL:
+        case GIMP_PRECISION_U16_LINEAR:
+        case GIMP_PRECISION_U16_NON_LINEAR:
+        case GIMP_PRECISION_U16_PERCEPTUAL:
+          high_precision = FALSE;
+          break;
+        default:
+          /* quantize directly from float instead of rounding twice */
+          high_precision = TRUE;
+          break;
+        }
+
+      if (has_alpha)
+        {
+          if (out_linear)
+            encoding = high_precision ? "RGBA float" : "RGBA u16";
+          else
+            encoding = high_precision ? "R'G'B'A float" : "R'G'B'A u16";
+        }
+      else /* no alpha */
+        {
+          if (out_linear)
+            encoding = high_precision ? "RGB float" : "RGB u16";
+          else
+            encoding = high_precision ? "R'G'B' float" : "R'G'B' u16";
+        }
+
+      format = babl_format_with_space (encoding, space);
+
+      buffer = gimp_drawable_get_buffer (drawable);
+
+      heif_image_add_plane (h_image, heif_channel_interleaved,
+                            width, height, save_bit_depth);
+
+      data = heif_image_get_plane (h_image, heif_channel_interleaved, &stride);
+
+      /* Convert in parallel bands of tile height so that the extra
+       * memory doesn't grow with the image size. u16 data is fetched
+       * straight into the rows of the heif plane and quantized in place.
+       */
+      heifplugin_bands_init (&bands, buffer, format, data, stride,
+                             width, height, has_alpha, save_bit_depth);
+      bands.high_precision = high_precision;
+
+      heifplugin_parallel_run (heifplugin_bands_get_n_jobs (&bands), 0,
+                               heifplugin_save_band, &bands);
+
+      g_object_unref (buffer);
+    }
+  else /* save_bit_depth == 8 */
+    {
+      HeifpluginBands bands;
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+      heif_image_add_plane (h_image, heif_channel_interleaved,
+                            width, height, 8);
+#else
+      /* old style settings */
+      heif_image_add_plane (h_image, heif_channel_interleaved,
+                            width, height, has_alpha ? 32 : 24);
+#endif
+
+      data = heif_image_get_plane (h_image, heif_channel_interleaved, &stride);
+
+      buffer = gimp_drawable_get_buffer (drawable);
+
+      if (has_alpha)
+        {
+          if (out_linear)
+            encoding = "RGBA u8";
+          else
+            encoding = "R'G'B'A u8";
+        }
+      else
+        {
+          if (out_linear)
+            encoding = "RGB u8";
+          else
+            encoding = "R'G'B' u8";
+        }
+      format = babl_format_with_space (encoding, space);
+
+      heifplugin_bands_init (&bands, buffer, format, data, stride,
+                             width, height, has_alpha, 8);
+
+      heifplugin_parallel_run (heifplugin_bands_get_n_jobs (&bands), 0,
+                               heifplugin_save_band, &bands);
+
+      g_object_unref (buffer);
+    }
+
+  return h_image;
+}
+
+static const struct heif_encoder_parameter *
+heifplugin_find_encoder_parameter (struct heif_encoder *encoder,
+                                   const char          *name)
+{
+  const struct heif_encoder_parameter * const *parameters;
+
+  for (parameters = heif_encoder_list_parameters (encoder);
+       parameters && *parameters;
+       parameters++)
+    {
+      if (! g_strcmp0 (heif_encoder_parameter_get_name (*parameters), name))
+        return *parameters;
+    }
+
+  return NULL;
+}
+
+/* Clamp value to the range encoder accepts for its integer parameter
+ * name, if it has one.
+ */
+static gint
+heifplugin_clamp_encoder_parameter (struct heif_encoder *encoder,
+                                    const char          *name,
+                                    gint                 value)
+{
+  const struct heif_encoder_parameter *parameter;
+  int                                  have_range;
+  int                                  minimum;
+  int                                  maximum;
+
+  parameter = heifplugin_find_encoder_parameter (encoder, name);
+
+  if (parameter &&
+      heif_encoder_parameter_get_valid_integer_range (parameter,
+                                                      &have_range,
+                                                      &minimum,
+                                                      &maximum).code == 0 &&
+      have_range)
+    {
+      value = CLAMP (value, minimum, maximum);
+    }
+
+  return value;
+}
+
+/* Let an AV1 encoder use n_threads threads, 0 for one per usable
+ * processor.
+ */
+static void
+heifplugin_set_encoder_threads (struct heif_encoder *encoder,
+                                const char          *encoder_name,
+                                gint                 n_threads)
+{
+  struct heif_error err;
+
+  if (n_threads <= 0)
+    n_threads = heifplugin_get_num_threads ();
+
+  n_threads = heifplugin_clamp_encoder_parameter (encoder, "threads",
+                                                  n_threads);
+
+  err = heif_encoder_set_parameter_integer (encoder, "threads", n_threads);
+  if (err.code != 0)
+    {
+      g_printerr ("Failed to set threads=%d for %s encoder: %s", n_threads, encoder_name, err.message);
+    }
+}
+
+/* Configure encoder for options. n_threads is the number of threads an
+ * AV1 encoder may use, 0 for one per usable processor.
+ */
+static void
+heifplugin_set_encoder_parameters (struct heif_encoder          *encoder,
+                                   const char                   *encoder_name,
+                                   enum heif_compression_format  compression,
+                                   const HeifpluginSaveOptions  *options,
+                                   gint                          n_threads)
+{
+  struct heif_error         err;
+  gboolean                  lossless      = options->lossless;
+  gint                      quality       = options->quality;
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+  HeifpluginExportFormat    pixel_format  = options->pixel_format;
+#endif
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+  HeifpluginEncoderSpeed    encoder_speed = options->encoder_speed;
+  const char               *parameter_value;
+#endif
+
+  /* workaround for a bug in libheif when heif_encoder_set_lossless is not working
+     (known problem with encoding via rav1e) */
+  if (lossless)
+    {
+      quality = 100;
+    }
+
+  heif_encoder_set_lossy_quality (encoder, quality);
+  heif_encoder_set_lossless (encoder, lossless);
+  /* heif_encoder_set_logging_level (encoder, logging_level); */
+
+#if LIBHEIF_HAVE_VERSION(1,8,0)
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+
+  if (lossless && pixel_format != HEIFPLUGIN_EXPORT_FORMAT_RGB)
+    {
+      /* disable subsampling for lossless */
+      pixel_format = HEIFPLUGIN_EXPORT_FORMAT_YUV444;
+    }
+
+  switch (pixel_format)
+    {
+    case HEIFPLUGIN_EXPORT_FORMAT_RGB:
+      /* same as HEIFPLUGIN_EXPORT_FORMAT_YUV444 */
+    case HEIFPLUGIN_EXPORT_FORMAT_YUV444:
+      parameter_value = "444";
+      break;
+    case HEIFPLUGIN_EXPORT_FORMAT_YUV422:
+      parameter_value = "422";
+      break;
+    default: /* HEIFPLUGIN_EXPORT_FORMAT_YUV420 */
+      parameter_value = "420";
+      break;
+    }
+
+  err = heif_encoder_set_parameter_string (encoder, "chroma", parameter_value);
+  if (err.code != 0)
+    {
+      g_printerr ("Failed to set chroma %s for %s encoder: %s", parameter_value, encoder_name, err.message);
+    }
+#endif
+
+  if (compression == heif_compression_HEVC)
+    {
+      switch (encoder_speed)
+        {
+        case HEIFPLUGIN_ENCODER_SPEED_SLOW:
+          parameter_value = "veryslow";
+          break;
+        case HEIFPLUGIN_ENCODER_SPEED_FASTER:
+          parameter_value = "faster";
+          break;
+        default: /*  HEIFPLUGIN_ENCODER_SPEED_BALANCED */
+          parameter_value = "medium";
+          break;
+        }
+
+      err = heif_encoder_set_parameter_string (encoder, "preset", parameter_value);
+      if (err.code != 0)
+        {
+          g_printerr ("Failed to set preset %s for %s encoder: %s", parameter_value, encoder_name, err.message);
+        }
+
+    }
+  else if (compression == heif_compression_AV1)
+    {
+      int parameter_number;
+
+      heifplugin_set_encoder_threads (encoder, encoder_name, n_threads);
+
+      if (g_strcmp0 (encoder_name, "aom") == 0) /* AOMedia AV1 encoder */
+        {
+          switch (encoder_speed)
+            {
+            case HEIFPLUGIN_ENCODER_SPEED_SLOW:
+              parameter_number = 1;
+              break;
+            case HEIFPLUGIN_ENCODER_SPEED_FASTER:
+              parameter_number = 6;
+#if LIBHEIF_HAVE_VERSION(1,10,0)
+              err = heif_encoder_set_parameter_boolean (encoder, "realtime", 1);
+              if (err.code != 0)
+                {
+                  g_printerr ("Failed to set realtime=1 for %s encoder: %s",  encoder_name, err.message);
+                }
+#endif
+              break;
+            default: /*  HEIFPLUGIN_ENCODER_SPEED_BALANCED */
+              parameter_number = 5;
+              break;
+            }
+
+          err = heif_encoder_set_parameter_integer (encoder, "speed", parameter_number);
+          if (err.code != 0)
+            {
+              g_printerr ("Failed to set speed=%d for %s encoder: %s", parameter_number, encoder_name, err.message);
+            }
+
+        }
+      else if (g_strcmp0 (encoder_name, "rav1e") == 0) /* Rav1e encoder */
+        {
+          switch (encoder_speed)
+            {
+            case HEIFPLUGIN_ENCODER_SPEED_SLOW:
+              parameter_number = 6;
+              break;
+            case HEIFPLUGIN_ENCODER_SPEED_FASTER:
+              parameter_number = 10;
+              break;
+            default: /*  HEIFPLUGIN_ENCODER_SPEED_BALANCED */
+              parameter_number = 8;
+              break;
+            }
+
+          err = heif_encoder_set_parameter_integer (encoder, "speed", parameter_number);
+          if (err.code != 0)
+            {
+              g_printerr ("Failed to set speed=%d for %s encoder: %s", parameter_number, encoder_name, err.message);
+            }
+
+        }
+      else
+        {
+          g_printerr ("Parameters not set, unsupported AV1 encoder: %s", encoder_name);
+        }
+    }
+#endif
+}
+
+/* AV1 tiles are encoded independently, so each thread can work on its
+ * own, but every tile boundary costs some compression. Tiles smaller
+ * than this aren't worth it.
+ */
+#define HEIFPLUGIN_MIN_TILE_SIZE 512
+#define HEIFPLUGIN_MAX_TILES     64
+
+/* Choose a tile layout for a width x height image giving n_threads
+ * threads a tile each. The tiles are split across their longer side in
+ * powers of two, so they stay roughly square.
+ */
+static void
+heifplugin_get_tile_layout (gint  width,
+                            gint  height,
+                            gint  n_threads,
+                            gint *tile_cols,
+                            gint *tile_rows)
+{
+  gint cols = 1;
+  gint rows = 1;
+
+  while (cols * rows < n_threads)
+    {
+      gboolean split_cols = (width  / cols / 2 >= HEIFPLUGIN_MIN_TILE_SIZE &&
+                             cols < HEIFPLUGIN_MAX_TILES);
+      gboolean split_rows = (height / rows / 2 >= HEIFPLUGIN_MIN_TILE_SIZE &&
+                             rows < HEIFPLUGIN_MAX_TILES);
+
+      if (split_cols && (! split_rows || width / cols >= height / rows))
+        cols *= 2;
+      else if (split_rows)
+        rows *= 2;
+      else
+        break;
+    }
+
+  *tile_cols = cols;
+  *tile_rows = rows;
+}
+
+/* How an encoder plug-in of libheif takes the tile layout */
+typedef enum
+{
+  HEIFPLUGIN_TILES_COUNT, /* number of tiles */
+  HEIFPLUGIN_TILES_LOG2   /* log2 of the number of tiles */
+} HeifpluginTileUnit;
+
+typedef struct
+{
+  const gchar        *encoder_name;
+  const gchar        *cols_name;
+  const gchar        *rows_name;
+  const gchar        *row_mt_name;    /* NULL if there is none */
+  HeifpluginTileUnit  unit;
+  gboolean            custom_options; /* unlisted parameters are passed
+                                       * on to the codec library */
+} HeifpluginTilingParameters;
+
+/* The encoders whose tiling parameters are known. aom takes libaom's
+ * own options, which libheif doesn't list but passes on to
+ * aom_codec_set_option(). rav1e and svt take the number of tiles and
+ * convert it themselves.
+ */
+static const HeifpluginTilingParameters heifplugin_tiling_parameters[] =
+{
+  { "aom",   "tile-columns", "tile-rows", "row-mt", HEIFPLUGIN_TILES_LOG2,  TRUE  },
+  { "rav1e", "tile-cols",    "tile-rows", NULL,     HEIFPLUGIN_TILES_COUNT, FALSE },
+  { "svt",   "tile-cols",    "tile-rows", NULL,     HEIFPLUGIN_TILES_COUNT, FALSE }
+};
+
+static const HeifpluginTilingParameters *
+heifplugin_get_tiling_parameters (const char *encoder_name)
+{
+  gint i;
+
+  for (i = 0; i < (gint) G_N_ELEMENTS (heifplugin_tiling_parameters); i++)
+    {
+      if (g_strcmp0 (encoder_name, heifplugin_tiling_parameters[i].encoder_name) == 0)
+        return &heifplugin_tiling_parameters[i];
+    }
+
+  return NULL;
+}
+
+/* Set name to value, as a listed integer parameter if encoder has it,
+ * else as a custom option if the encoder takes them. Failures are only
+ * reported for listed parameters and values the user asked for.
+ */
+static void
+heifplugin_set_tiling_parameter (struct heif_encoder               *encoder,
+                                 const char                        *encoder_name,
+                                 const HeifpluginTilingParameters  *tiling,
+                                 const char                        *name,
+                                 gint                               value,
+                                 gboolean                           requested)
+{
+  struct heif_error err;
+
+  if (heifplugin_find_encoder_parameter (encoder, name))
+    {
+      value = heifplugin_clamp_encoder_parameter (encoder, name, value);
+
+      err = heif_encoder_set_parameter_integer (encoder, name, value);
+      if (err.code != 0)
+        {
+          g_printerr ("Failed to set %s=%d for %s encoder: %s", name, value, encoder_name, err.message);
+        }
+    }
+  else if (tiling->custom_options)
+    {
+      gchar *string = g_strdup_printf ("%d", value);
+
+      err = heif_encoder_set_parameter_string (encoder, name, string);
+      if (err.code != 0 && requested)
+        {
+          g_printerr ("Failed to set %s=%d for %s encoder: %s", name, value, encoder_name, err.message);
+        }
+
+      g_free (string);
+    }
+  else if (requested)
+    {
+      /* the automatic layout is only a hint */
+      g_printerr ("Parameter %s not supported by %s encoder", name, encoder_name);
+    }
+}
+
+/* Convert a number of tiles to the unit of the encoder, rounding down
+ * to a power of two for log2.
+ */
+static gint
+heifplugin_get_tile_value (const HeifpluginTilingParameters *tiling,
+                           gint                              n_tiles)
+{
+  gint log2 = 0;
+
+  if (tiling->unit == HEIFPLUGIN_TILES_COUNT)
+    return n_tiles;
+
+  while ((2 << log2) <= n_tiles)
+    log2++;
+
+  return log2;
+}
+
+/* Set the tile layout and row multithreading of an AV1 encoder for a
+ * width x height image. Tile rows and columns which aren't set in
+ * options are chosen from the image size and n_threads, the number of
+ * threads the encoder may use (0 for one per usable processor).
+ * Encoders not in heifplugin_tiling_parameters are left alone.
+ */
+static void
+heifplugin_set_encoder_tiling (struct heif_encoder         *encoder,
+                               const char                  *encoder_name,
+                               const HeifpluginSaveOptions *options,
+                               gint                         width,
+                               gint                         height,
+                               gint                         n_threads)
+{
+  const HeifpluginTilingParameters *tiling;
+  gint                              tile_cols;
+  gint                              tile_rows;
+
+  tiling = heifplugin_get_tiling_parameters (encoder_name);
+
+  if (! tiling)
+    {
+      if (options->tile_cols > 0 || options->tile_rows > 0)
+        g_printerr ("Tiling not set, unsupported AV1 encoder: %s", encoder_name);
+      return;
+    }
+
+  if (n_threads <= 0)
+    n_threads = heifplugin_get_num_threads ();
+
+  heifplugin_get_tile_layout (width, height, n_threads,
+                              &tile_cols, &tile_rows);
+
+  if (options->tile_cols > 0)
+    tile_cols = options->tile_cols;
+
+  if (options->tile_rows > 0)
+    tile_rows = options->tile_rows;
+
+  heifplugin_set_tiling_parameter (encoder, encoder_name, tiling,
+                                   tiling->cols_name,
+                                   heifplugin_get_tile_value (tiling, tile_cols),
+                                   options->tile_cols > 0);
+  heifplugin_set_tiling_parameter (encoder, encoder_name, tiling,
+                                   tiling->rows_name,
+                                   heifplugin_get_tile_value (tiling, tile_rows),
+                                   options->tile_rows > 0);
+
+  if (tiling->row_mt_name)
+    {
+      const struct heif_encoder_parameter *row_mt;
+      struct heif_error                    err;
+
+      row_mt = heifplugin_find_encoder_parameter (encoder, tiling->row_mt_name);
+
+      if (row_mt && heif_encoder_parameter_get_type (row_mt) == heif_encoder_parameter_type_boolean)
+        err = heif_encoder_set_parameter_boolean (encoder, tiling->row_mt_name, options->row_mt);
+      else if (row_mt)
+        err = heif_encoder_set_parameter_integer (encoder, tiling->row_mt_name, options->row_mt);
+      else
+        err = heif_encoder_set_parameter_string (encoder, tiling->row_mt_name,
+                                                 options->row_mt ? "1" : "0");
+
+      /* a custom option libheif can't pass on is only a lost hint */
+      if (err.code != 0 && row_mt)
+        {
+          g_printerr ("Failed to set %s=%d for %s encoder: %s", tiling->row_mt_name, options->row_mt, encoder_name, err.message);
+        }
+    }
+}
+
+/* Serialize the Exif tags of metadata which can be saved to HEIF, NULL
+ * if there are none.
+ */
+static GBytes *
+heifplugin_get_exif_data (GimpMetadata *metadata)
+{
+  GBytes *raw_exif_data = NULL;
+  GError *error         = NULL;
+
+  if (gexiv2_metadata_get_supports_exif (GEXIV2_METADATA (metadata)) &&
+      gexiv2_metadata_has_exif (GEXIV2_METADATA (metadata)))
+    {
+      GimpMetadata   *new_exif_metadata = gimp_metadata_new ();
+      GExiv2Metadata *new_gexiv2metadata = GEXIV2_METADATA (new_exif_metadata);
+      gchar         **exif_data = gexiv2_metadata_get_exif_tags (GEXIV2_METADATA (metadata));
+      guint           i;
+
+      gexiv2_metadata_clear_exif (new_gexiv2metadata);
+
+      for (i = 0; exif_data[i] != NULL; i++)
+        {
+          if (! gexiv2_metadata_has_tag (new_gexiv2metadata, exif_data[i]) &&
+              gimp_metadata_is_tag_supported (exif_data[i], "image/heif"))
+            {
+              heifplugin_image_metadata_copy_tag (GEXIV2_METADATA (metadata),
+                                                  new_gexiv2metadata,
+                                                  exif_data[i]);
+            }
+        }
+
+      g_strfreev (exif_data);
+
+      raw_exif_data = gexiv2_metadata_get_exif_data (new_gexiv2metadata, GEXIV2_BYTE_ORDER_LITTLE, &error);
+      if (! raw_exif_data)
+        {
+          if (error)
+            {
+              g_printerr ("%s: error preparing EXIF metadata: %s",
+                          G_STRFUNC, error->message);
+              g_clear_error (&error);
+            }
+        }
+      else if (g_bytes_get_size (raw_exif_data) < 4)
+        {
+          g_clear_pointer (&raw_exif_data, g_bytes_unref);
+        }
+
+      g_object_unref (new_exif_metadata);
+    }
+
+  return raw_exif_data;
+}
+
+/* Serialize the XMP tags of metadata which can be saved to HEIF,
+ * adding GIMP's own history and version tags to metadata first. NULL if
+ * there are none.
+ */
+static gchar *
+heifplugin_get_xmp_packet (GimpMetadata *metadata)
+{
+  gchar *xmp_packet = NULL;
+
+  if (gexiv2_metadata_get_supports_xmp (GEXIV2_METADATA (metadata)) &&
+      gexiv2_metadata_has_xmp (GEXIV2_METADATA (metadata)))
+    {
+      GimpMetadata   *new_metadata = gimp_metadata_new ();
+      GExiv2Metadata *new_g2metadata = GEXIV2_METADATA (new_metadata);
+      guint           i;
+
+      static const XmpStructs structlist[] =
+      {
+        { "Xmp.iptcExt.LocationCreated", GEXIV2_STRUCTURE_XA_BAG },
+        { "Xmp.iptcExt.LocationShown",   GEXIV2_STRUCTURE_XA_BAG },
+        { "Xmp.iptcExt.ArtworkOrObject", GEXIV2_STRUCTURE_XA_BAG },
+        { "Xmp.iptcExt.RegistryId",      GEXIV2_STRUCTURE_XA_BAG },
+        { "Xmp.xmpMM.History",           GEXIV2_STRUCTURE_XA_SEQ },
+        { "Xmp.plus.ImageSupplier",      GEXIV2_STRUCTURE_XA_SEQ },
+        { "Xmp.plus.ImageCreator",       GEXIV2_STRUCTURE_XA_SEQ },
+        { "Xmp.plus.CopyrightOwner",     GEXIV2_STRUCTURE_XA_SEQ },
+        { "Xmp.plus.Licensor",           GEXIV2_STRUCTURE_XA_SEQ }
+      };
+
+      gchar         **xmp_data;
+      struct timeval  timer_usec;
+      gint64          timestamp_usec;
+      gchar           ts[128];
+
+      gexiv2_metadata_clear_xmp (new_g2metadata);
+
+      gettimeofday (&timer_usec, NULL);
+      timestamp_usec = ( (gint64) timer_usec.tv_sec) * 1000000ll +
+                         (gint64) timer_usec.tv_usec;
+      g_snprintf (ts, sizeof (ts), "%" G_GINT64_FORMAT, timestamp_usec);
+
+      gimp_metadata_add_xmp_history (metadata, "");
+
+      gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
+                                          "Xmp.GIMP.TimeStamp",
+                                          ts,
+                                          NULL);
+
+      gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
+                                          "Xmp.xmp.CreatorTool",
+                                          "GIMP",
+                                          NULL);
+
+      gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
+                                          "Xmp.GIMP.Version",
+                                          GIMP_VERSION,
+                                          NULL);
+
+      gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
+                                          "Xmp.GIMP.API",
+                                          GIMP_API_VERSION,
+                                          NULL);
+
+      gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
+                                          "Xmp.GIMP.Platform",
+#if defined(_WIN32) || defined(__CYGWIN__) || defined(__MINGW32__)
+                                          "Windows",
+#elif defined(__linux__)
+                                          "Linux",
+#elif defined(__APPLE__) && defined(__MACH__)
+                                          "Mac OS",
+#elif defined(unix) || defined(__unix__) || defined(__unix)
+                                          "Unix",
+#else
+                                          "Unknown",
+#endif
+                                          NULL);
+
+
+      xmp_data = gexiv2_metadata_get_xmp_tags (GEXIV2_METADATA (metadata));
+
+      /* Patch necessary structures */
+      for (i = 0; i < (gint) G_N_ELEMENTS (structlist); i++)
+        {
+          gexiv2_metadata_try_set_xmp_tag_struct (GEXIV2_METADATA (new_g2metadata),
+                                                  structlist[i].tag,
+                                                  structlist[i].type,
+                                                  NULL);
+        }
+
+      for (i = 0; xmp_data[i] != NULL; i++)
+        {
+          if (! gexiv2_metadata_has_tag (new_g2metadata, xmp_data[i]) &&
+              gimp_metadata_is_tag_supported (xmp_data[i], "image/heif"))
+            {
+              heifplugin_image_metadata_copy_tag (GEXIV2_METADATA (metadata),
+                                                  new_g2metadata,
+                                                  xmp_data[i]);
+            }
+        }
+
+      g_strfreev (xmp_data);
+
+      xmp_packet = gexiv2_metadata_try_generate_xmp_packet (new_g2metadata, GEXIV2_USE_COMPACT_FORMAT | GEXIV2_OMIT_ALL_FORMATTING, 0, NULL);
+      if (xmp_packet && ! *xmp_packet)
+        g_clear_pointer (&xmp_packet, g_free);
+
+      g_object_unref (new_metadata);
+    }
+
+  return xmp_packet;
+}
+
+/* Encode h_image into context and attach the serialized metadata. Only
+ * libheif is used here, so this can run on a worker thread as long as
+ * encoder isn't shared.
+ */
+static gboolean
+heifplugin_encode_image (struct heif_context  *context,
+                         struct heif_image    *h_image,
+                         struct heif_encoder  *encoder,
+                         GBytes               *exif,
+                         const gchar          *xmp,
+                         GError              **error)
+{
+  struct heif_image_handle *handle = NULL;
+  struct heif_error         err;
+
+  err = heif_context_encode_image (context,
+                                   h_image,
+                                   encoder,
+                                   NULL,
+                                   &handle);
+  if (err.code != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Encoding HEIF image failed: %s"),
+                   err.message);
+      return FALSE;
+    }
+
+  if (exif)
+    {
+      gsize         exif_size   = 0;
+      gconstpointer exif_buffer = g_bytes_get_data (exif, &exif_size);
+
+      err = heif_context_add_exif_metadata (context, handle,
+                                            exif_buffer, exif_size);
+      if (err.code != 0)
+        {
+          g_printerr ("Failed to save EXIF metadata: %s", err.message);
+        }
+    }
+
+  if (xmp)
+    {
+      heif_context_add_XMP_metadata (context, handle,
+                                     xmp, strlen (xmp));
+    }
+
+  heif_image_handle_release (handle);
+
+  return TRUE;
+}
+
+static gboolean
+heifplugin_write_context (struct heif_context  *context,
+                          GFile                *file,
+                          GError              **error)
+{
+  struct heif_writer  writer;
+  struct heif_error   err;
+  GOutputStream      *output;
+
+  writer.writer_api_version = 1;
+  writer.write              = write_callback;
+
+  output = G_OUTPUT_STREAM (g_file_replace (file,
+                                            NULL, FALSE, G_FILE_CREATE_NONE,
+                                            NULL, error));
+  if (! output)
+    return FALSE;
+
+  err = heif_context_write (context, &writer, output);
+
+  if (err.code != 0)
+    {
+      GCancellable *cancellable = g_cancellable_new ();
+
+      g_cancellable_cancel (cancellable);
+      g_output_stream_close (output, cancellable, NULL);
+      g_object_unref (cancellable);
+      g_object_unref (output);
+
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Writing HEIF image failed: %s"),
+                   err.message);
+      return FALSE;
+    }
 
-      g_object_unref (buffer);
+  g_object_unref (output);
 
-      heif_image_add_plane (h_image, heif_channel_interleaved,
-                            width, height, save_bit_depth);
+  return TRUE;
+}
 
-      data = heif_image_get_plane (h_image, heif_channel_interleaved, &stride);
+static gboolean
+save_image (GFile                        *file,
+            GimpImage                    *image,
+            GimpDrawable                 *drawable,
+            GObject                      *config,
+            GError                      **error,
+            enum heif_compression_format  compression,
+            GimpMetadata                 *metadata)
+{
+  HeifpluginSaveOptions                 options;
+  struct heif_image                    *h_image = NULL;
+  struct heif_context                  *context = heif_context_alloc ();
+  struct heif_encoder                  *encoder = NULL;
+  const struct heif_encoder_descriptor *encoder_descriptor;
+  const char                           *encoder_name;
+  struct heif_error                     err;
+  GBytes                               *exif    = NULL;
+  gchar                                *xmp     = NULL;
+  gboolean                              success;
 
-      switch (save_bit_depth)
-        {
-        case 10:
-          for (y = 0; y < height; y++)
-            {
-              dest16 = (uint16_t *) (y * stride + data);
-              for (x = 0; x < rowentries; x++)
-                {
-                  tmp_pixelval = (int) ( ( (float) (*src16) / 65535.0f) * 1023.0f + 0.5f);
-                  *dest16 = CLAMP (tmp_pixelval, 0, 1023);
-                  dest16++;
-                  src16++;
-                }
-            }
-          break;
-        case 12:
-          for (y = 0; y < height; y++)
-            {
-              dest16 = (uint16_t *) (y * stride + data);
-              for (x = 0; x < rowentries; x++)
-                {
-                  tmp_pixelval = (int) ( ( (float) (*src16) / 65535.0f) * 4095.0f + 0.5f);
-                  *dest16 = CLAMP (tmp_pixelval, 0, 4095);
-                  dest16++;
-                  src16++;
-                }
-            }
-          break;
-        default:
-          for (y = 0; y < height; y++)
-            {
-              dest16 = (uint16_t *) (y * stride + data);
-              for (x = 0; x < rowentries; x++)
-                {
-                  *dest16 = *src16;
-                  dest16++;
-                  src16++;
-                }
-            }
-          break;
-        }
-      g_free (data16);
-    }
-  else /* save_bit_depth == 8 */
+  if (!context)
     {
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-      heif_image_add_plane (h_image, heif_channel_interleaved,
-                            width, height, 8);
-#else
-      /* old style settings */
-      heif_image_add_plane (h_image, heif_channel_interleaved,
-                            width, height, has_alpha ? 32 : 24);
-#endif
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "cannot allocate heif_context");
+      return FALSE;
+    }
 
-      data = heif_image_get_plane (h_image, heif_channel_interleaved, &stride);
+  heifplugin_save_options_init (&options, config);
 
-      buffer = gimp_drawable_get_buffer (drawable);
+  encoder_descriptor = heifplugin_get_encoder_descriptor (context,
+                                                          compression,
+                                                          error);
+  if (! encoder_descriptor)
+    {
+      heif_context_free (context);
+      return FALSE;
+    }
 
-      if (has_alpha)
-        {
-          if (out_linear)
-            encoding = "RGBA u8";
-          else
-            encoding = "R'G'B'A u8";
-        }
-      else
-        {
-          if (out_linear)
-            encoding = "RGB u8";
-          else
-            encoding = "R'G'B' u8";
-        }
-      format = babl_format_with_space (encoding, space);
+  encoder_name = heif_encoder_descriptor_get_id_name (encoder_descriptor);
 
-      gegl_buffer_get (buffer,
-                       GEGL_RECTANGLE (0, 0, width, height),
-                       1.0, format, data, stride, GEGL_ABYSS_NONE);
+  gimp_progress_init_printf (_("Exporting '%s' using %s encoder"),
+                             gimp_file_get_utf8_name (file), encoder_name);
 
-      g_object_unref (buffer);
+  h_image = heifplugin_create_save_image (image, drawable, &options, error);
+  if (! h_image)
+    {
+      heif_context_free (context);
+      return FALSE;
     }
 
   gimp_progress_update (0.33);
@@ -1865,372 +8024,314 @@ save_image (GFile                        *file,
       return FALSE;
     }
 
-  /* workaround for a bug in libheif when heif_encoder_set_lossless is not working
-     (known problem with encoding via rav1e) */
-  if (lossless)
-    {
-      quality = 100;
-    }
-
-  heif_encoder_set_lossy_quality (encoder, quality);
-  heif_encoder_set_lossless (encoder, lossless);
-  /* heif_encoder_set_logging_level (encoder, logging_level); */
+  heifplugin_set_encoder_parameters (encoder, encoder_name, compression,
+                                     &options, 0);
 
-#if LIBHEIF_HAVE_VERSION(1,8,0)
-#if LIBHEIF_HAVE_VERSION(1,10,0)
+  if (compression == heif_compression_AV1)
+    heifplugin_set_encoder_tiling (encoder, encoder_name, &options,
+                                   gimp_drawable_get_width  (drawable),
+                                   gimp_drawable_get_height (drawable),
+                                   0);
 
-  if (lossless && pixel_format != HEIFPLUGIN_EXPORT_FORMAT_RGB)
+  if (metadata)
     {
-      /* disable subsampling for lossless */
-      pixel_format = HEIFPLUGIN_EXPORT_FORMAT_YUV444;
-    }
+      if (options.save_exif)
+        exif = heifplugin_get_exif_data (metadata);
 
-  switch (pixel_format)
-    {
-    case HEIFPLUGIN_EXPORT_FORMAT_RGB:
-      /* same as HEIFPLUGIN_EXPORT_FORMAT_YUV444 */
-    case HEIFPLUGIN_EXPORT_FORMAT_YUV444:
-      parameter_value = "444";
-      break;
-    case HEIFPLUGIN_EXPORT_FORMAT_YUV422:
-      parameter_value = "422";
-      break;
-    default: /* HEIFPLUGIN_EXPORT_FORMAT_YUV420 */
-      parameter_value = "420";
-      break;
+      if (options.save_xmp)
+        xmp = heifplugin_get_xmp_packet (metadata);
     }
 
-  err = heif_encoder_set_parameter_string (encoder, "chroma", parameter_value);
-  if (err.code != 0)
+  success = heifplugin_encode_image (context, h_image, encoder,
+                                     exif, xmp, error);
+
+  if (success)
     {
-      g_printerr ("Failed to set chroma %s for %s encoder: %s", parameter_value, encoder_name, err.message);
+      gimp_progress_update (0.66);
+
+      success = heifplugin_write_context (context, file, error);
     }
-#endif
 
-  if (compression == heif_compression_HEVC)
-    {
-      switch (encoder_speed)
-        {
-        case HEIFPLUGIN_ENCODER_SPEED_SLOW:
-          parameter_value = "veryslow";
-          break;
-        case HEIFPLUGIN_ENCODER_SPEED_FASTER:
-          parameter_value = "faster";
-          break;
-        default: /*  HEIFPLUGIN_ENCODER_SPEED_BALANCED */
-          parameter_value = "medium";
-          break;
-        }
+  if (exif)
+    g_bytes_unref (exif);
+  g_free (xmp);
 
-      err = heif_encoder_set_parameter_string (encoder, "preset", parameter_value);
-      if (err.code != 0)
-        {
-          g_printerr ("Failed to set preset %s for %s encoder: %s", parameter_value, encoder_name, err.message);
-        }
+  heif_encoder_release (encoder);
+  heif_image_release (h_image);
+  heif_context_free (context);
 
-    }
-  else if (compression == heif_compression_AV1)
-    {
-      int parameter_number;
+  if (success)
+    gimp_progress_update (1.0);
 
-      parameter_number = gimp_get_num_processors();
-      parameter_number = CLAMP(parameter_number, 1, 16);
+  return success;
+}
 
-      err = heif_encoder_set_parameter_integer (encoder, "threads", parameter_number);
-      if (err.code != 0)
-        {
-          g_printerr ("Failed to set threads=%d for %s encoder: %s", parameter_number, encoder_name, err.message);
-        }
 
+/*  exporting several images at once  */
 
-      if (g_strcmp0 (encoder_name, "aom") == 0) /* AOMedia AV1 encoder */
-        {
-          switch (encoder_speed)
-            {
-            case HEIFPLUGIN_ENCODER_SPEED_SLOW:
-              parameter_number = 1;
-              break;
-            case HEIFPLUGIN_ENCODER_SPEED_FASTER:
-              parameter_number = 6;
-#if LIBHEIF_HAVE_VERSION(1,10,0)
-              err = heif_encoder_set_parameter_boolean (encoder, "realtime", 1);
-              if (err.code != 0)
-                {
-                  g_printerr ("Failed to set realtime=1 for %s encoder: %s",  encoder_name, err.message);
-                }
-#endif
-              break;
-            default: /*  HEIFPLUGIN_ENCODER_SPEED_BALANCED */
-              parameter_number = 5;
-              break;
-            }
+typedef struct _HeifpluginSaveFile
+{
+  GFile               *file;
+  GimpImage           *image;
+  GimpDrawable        *drawable;
+  struct heif_context *context;
+  struct heif_image   *h_image;
+  GBytes              *exif;
+  gchar               *xmp;
+  gint                 width;
+  gint                 height;
+  GError              *error;
+} HeifpluginSaveFile;
+
+typedef struct _HeifpluginSaveFiles
+{
+  HeifpluginSaveFile          *files;
+  gint                         first;
+  GAsyncQueue                 *encoders;  /* idle encoder instances */
+  const HeifpluginSaveOptions *options;
+  const char                  *encoder_name;
+  gboolean                     av1;
+  gint                         n_threads; /* per encoder instance */
+} HeifpluginSaveFiles;
 
-          err = heif_encoder_set_parameter_integer (encoder, "speed", parameter_number);
-          if (err.code != 0)
-            {
-              g_printerr ("Failed to set speed=%d for %s encoder: %s", parameter_number, encoder_name, err.message);
-            }
+static void
+heifplugin_save_file_clear (HeifpluginSaveFile *file)
+{
+  if (file->exif)
+    g_bytes_unref (file->exif);
+
+  if (file->h_image)
+    heif_image_release (file->h_image);
+
+  if (file->context)
+    heif_context_free (file->context);
+
+  g_clear_pointer (&file->xmp, g_free);
+
+  file->exif    = NULL;
+  file->h_image = NULL;
+  file->context = NULL;
+}
+
+/* Encode and write one prepared file with whichever encoder instance is
+ * idle. Runs on a worker thread, so no PDB calls here.
+ */
+static void
+heifplugin_save_file_encode (gint     job,
+                             gpointer user_data)
+{
+  HeifpluginSaveFiles *save  = user_data;
+  HeifpluginSaveFile  *file  = &save->files[save->first + job];
+  struct heif_encoder *encoder;
+
+  if (file->h_image)
+    {
+      encoder = g_async_queue_pop (save->encoders);
 
+      /* the thread budget changes between rounds, the tile layout
+       * depends on the image size
+       */
+      if (save->av1)
+        {
+          heifplugin_set_encoder_threads (encoder, save->encoder_name,
+                                          save->n_threads);
+          heifplugin_set_encoder_tiling (encoder, save->encoder_name,
+                                         save->options,
+                                         file->width, file->height,
+                                         save->n_threads);
         }
-      else if (g_strcmp0 (encoder_name, "rav1e") == 0) /* Rav1e encoder */
+
+      if (heifplugin_encode_image (file->context, file->h_image, encoder,
+                                   file->exif, file->xmp, &file->error))
         {
-          switch (encoder_speed)
-            {
-            case HEIFPLUGIN_ENCODER_SPEED_SLOW:
-              parameter_number = 6;
-              break;
-            case HEIFPLUGIN_ENCODER_SPEED_FASTER:
-              parameter_number = 10;
-              break;
-            default: /*  HEIFPLUGIN_ENCODER_SPEED_BALANCED */
-              parameter_number = 8;
-              break;
-            }
+          /* the planes aren't needed anymore, free them before writing */
+          g_clear_pointer (&file->h_image, heif_image_release);
 
-          err = heif_encoder_set_parameter_integer (encoder, "speed", parameter_number);
-          if (err.code != 0)
-            {
-              g_printerr ("Failed to set speed=%d for %s encoder: %s", parameter_number, encoder_name, err.message);
-            }
+          g_async_queue_push (save->encoders, encoder);
 
+          heifplugin_write_context (file->context, file->file, &file->error);
         }
       else
         {
-          g_printerr ("Parameters not set, unsupported AV1 encoder: %s", encoder_name);
+          g_async_queue_push (save->encoders, encoder);
         }
     }
-#endif
 
-  err = heif_context_encode_image (context,
-                                   h_image,
-                                   encoder,
-                                   NULL,
-                                   &handle);
-  if (err.code != 0)
+  heifplugin_save_file_clear (file);
+}
+
+/* Export drawables[i] of images[i] to files[i] for each of the n_files
+ * files, encoding up to max_jobs of them at the same time (0 for one
+ * per usable processor). The encoder descriptor is looked up once and
+ * max_jobs encoder instances are configured once and shared by all
+ * files; AV1 encoders split the thread budget, which is taken anew for
+ * every round, between them and get their threads and tile layout per
+ * image. The images are prepared on the calling
+ * thread in rounds of max_jobs, so at most that many sets of planes are
+ * alive at once. A file that fails to export gets its error set in
+ * errors and doesn't affect the others; FALSE is only returned when no
+ * encoder is available at all.
+ */
+static gboolean
+save_files (GFile                        **gfiles,
+            GimpImage                    **images,
+            GimpDrawable                 **drawables,
+            gint                           n_files,
+            gint                           max_jobs,
+            const HeifpluginSaveOptions   *options,
+            enum heif_compression_format   compression,
+            GError                       **errors,
+            GError                       **error)
+{
+  HeifpluginSaveFiles                   save;
+  struct heif_context                  *context;
+  struct heif_encoder                  *encoder;
+  const struct heif_encoder_descriptor *encoder_descriptor;
+  const char                           *encoder_name;
+  const gchar                          *mime_type;
+  struct heif_error                     err;
+  gint                                  n_encoders;
+  gint                                  n_threads;
+  gint                                  i;
+
+  context = heif_context_alloc ();
+  if (! context)
     {
       g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   _("Encoding HEIF image failed: %s"),
-                   err.message);
-      heif_encoder_release (encoder);
-      heif_image_release (h_image);
-      heif_context_free (context);
+                   "cannot allocate heif_context");
       return FALSE;
     }
 
-  /*  EXIF metadata  */
-  if (save_exif && metadata)
+  encoder_descriptor = heifplugin_get_encoder_descriptor (context,
+                                                          compression,
+                                                          error);
+  if (! encoder_descriptor)
     {
-      if (gexiv2_metadata_get_supports_exif (GEXIV2_METADATA (metadata)) &&
-          gexiv2_metadata_has_exif (GEXIV2_METADATA (metadata)))
-        {
-          GimpMetadata   *new_exif_metadata = gimp_metadata_new ();
-          GExiv2Metadata *new_gexiv2metadata = GEXIV2_METADATA (new_exif_metadata);
-          GBytes         *raw_exif_data;
-          gchar         **exif_data = gexiv2_metadata_get_exif_tags (GEXIV2_METADATA (metadata));
-          guint           i;
+      heif_context_free (context);
+      return FALSE;
+    }
 
-          gexiv2_metadata_clear_exif (new_gexiv2metadata);
+  encoder_name = heif_encoder_descriptor_get_id_name (encoder_descriptor);
 
-          for (i = 0; exif_data[i] != NULL; i++)
-            {
-              if (! gexiv2_metadata_has_tag (new_gexiv2metadata, exif_data[i]) &&
-                  gimp_metadata_is_tag_supported (exif_data[i], "image/heif"))
-                {
-                  heifplugin_image_metadata_copy_tag (GEXIV2_METADATA (metadata),
-                                                      new_gexiv2metadata,
-                                                      exif_data[i]);
-                }
-            }
+  if (max_jobs <= 0)
+    max_jobs = heifplugin_get_num_threads ();
 
-          g_strfreev (exif_data);
+  n_encoders = CLAMP (n_files, 1, max_jobs);
+  n_threads  = MAX (heifplugin_get_num_threads () / n_encoders, 1);
 
-          raw_exif_data = gexiv2_metadata_get_exif_data (new_gexiv2metadata, GEXIV2_BYTE_ORDER_LITTLE, error);
-          if (raw_exif_data)
-            {
-              gsize exif_size = 0;
-              gconstpointer exif_buffer = g_bytes_get_data (raw_exif_data, &exif_size);
+  save.files        = g_new0 (HeifpluginSaveFile, n_files);
+  save.encoders     = g_async_queue_new ();
+  save.options      = options;
+  save.encoder_name = encoder_name;
+  save.av1          = (compression == heif_compression_AV1);
+  save.n_threads    = n_threads;
 
-              if (exif_size >= 4)
-                {
-                  err = heif_context_add_exif_metadata (context, handle,
-                                                        exif_buffer, exif_size);
-                  if (err.code != 0)
-                    {
-                      g_printerr ("Failed to save EXIF metadata: %s", err.message);
-                    }
-                }
-              g_bytes_unref (raw_exif_data);
-            }
-          else
-            {
-              if (error && *error)
-                {
-                  g_printerr ("%s: error preparing EXIF metadata: %s",
-                              G_STRFUNC, (*error)->message);
-                  g_clear_error (error);
-                }
-            }
+  for (i = 0; i < n_encoders; i++)
+    {
+      encoder = NULL;
+
+      err = heif_context_get_encoder (context, encoder_descriptor, &encoder);
+      if (err.code != 0)
+        break;
+
+      heifplugin_set_encoder_parameters (encoder, encoder_name, compression,
+                                         options, n_threads);
+
+      g_async_queue_push (save.encoders, encoder);
+    }
+
+  n_encoders = i;
 
-          g_object_unref (new_exif_metadata);
-        }
+  if (n_encoders == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "Unable to get an encoder instance");
+      g_async_queue_unref (save.encoders);
+      g_free (save.files);
+      heif_context_free (context);
+      return FALSE;
     }
 
-  /*  XMP metadata  */
-  if (save_xmp && metadata)
+  mime_type = (compression == heif_compression_HEVC ?
+               "image/heif" : "image/avif");
+
+  gimp_progress_init_printf (_("Exporting HEIF images using %s encoder"),
+                             encoder_name);
+
+  for (save.first = 0; save.first < n_files; save.first += n_encoders)
     {
-      if (gexiv2_metadata_get_supports_xmp (GEXIV2_METADATA (metadata)) &&
-          gexiv2_metadata_has_xmp (GEXIV2_METADATA (metadata)))
+      gint n_round = MIN (n_encoders, n_files - save.first);
+
+      if (save.first > 0)
         {
-          GimpMetadata   *new_metadata = gimp_metadata_new ();
-          GExiv2Metadata *new_g2metadata = GEXIV2_METADATA (new_metadata);
-          guint           i;
+          heifplugin_refresh_thread_budget ();
 
-          static const XmpStructs structlist[] =
-          {
-            { "Xmp.iptcExt.LocationCreated", GEXIV2_STRUCTURE_XA_BAG },
-            { "Xmp.iptcExt.LocationShown",   GEXIV2_STRUCTURE_XA_BAG },
-            { "Xmp.iptcExt.ArtworkOrObject", GEXIV2_STRUCTURE_XA_BAG },
-            { "Xmp.iptcExt.RegistryId",      GEXIV2_STRUCTURE_XA_BAG },
-            { "Xmp.xmpMM.History",           GEXIV2_STRUCTURE_XA_SEQ },
-            { "Xmp.plus.ImageSupplier",      GEXIV2_STRUCTURE_XA_SEQ },
-            { "Xmp.plus.ImageCreator",       GEXIV2_STRUCTURE_XA_SEQ },
-            { "Xmp.plus.CopyrightOwner",     GEXIV2_STRUCTURE_XA_SEQ },
-            { "Xmp.plus.Licensor",           GEXIV2_STRUCTURE_XA_SEQ }
-          };
-
-          gchar         **xmp_data;
-          struct timeval  timer_usec;
-          gint64          timestamp_usec;
-          gchar           ts[128];
-          gchar          *xmp_packet;
-
-          gexiv2_metadata_clear_xmp (new_g2metadata);
-
-          gettimeofday (&timer_usec, NULL);
-          timestamp_usec = ( (gint64) timer_usec.tv_sec) * 1000000ll +
-                             (gint64) timer_usec.tv_usec;
-          g_snprintf (ts, sizeof (ts), "%" G_GINT64_FORMAT, timestamp_usec);
-
-          gimp_metadata_add_xmp_history (metadata, "");
-
-          gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
-                                              "Xmp.GIMP.TimeStamp",
-                                              ts,
-                                              NULL);
-
-          gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
-                                              "Xmp.xmp.CreatorTool",
-                                              "GIMP",
-                                              NULL);
-
-          gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
-                                              "Xmp.GIMP.Version",
-                                              GIMP_VERSION,
-                                              NULL);
-
-          gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
-                                              "Xmp.GIMP.API",
-                                              GIMP_API_VERSION,
-                                              NULL);
-
-          gexiv2_metadata_try_set_tag_string (GEXIV2_METADATA (metadata),
-                                              "Xmp.GIMP.Platform",
-#if defined(_WIN32) || defined(__CYGWIN__) || defined(__MINGW32__)
-                                              "Windows",
-#elif defined(__linux__)
-                                              "Linux",
-#elif defined(__APPLE__) && defined(__MACH__)
-                                              "Mac OS",
-#elif defined(unix) || defined(__unix__) || defined(__unix)
-                                              "Unix",
-#else
-                                              "Unknown",
-#endif
-                                              NULL);
+          save.n_threads = MAX (heifplugin_get_num_threads () / n_encoders, 1);
+        }
 
+      for (i = save.first; i < save.first + n_round; i++)
+        {
+          HeifpluginSaveFile *file = &save.files[i];
+          GimpMetadata       *metadata;
 
-          xmp_data = gexiv2_metadata_get_xmp_tags (GEXIV2_METADATA (metadata));
+          file->file     = gfiles[i];
+          file->image    = images[i];
+          file->drawable = drawables[i];
+          file->width    = gimp_drawable_get_width  (file->drawable);
+          file->height   = gimp_drawable_get_height (file->drawable);
 
-          /* Patch necessary structures */
-          for (i = 0; i < (gint) G_N_ELEMENTS (structlist); i++)
+          file->context = heif_context_alloc ();
+          if (! file->context)
             {
-              gexiv2_metadata_try_set_xmp_tag_struct (GEXIV2_METADATA (new_g2metadata),
-                                                      structlist[i].tag,
-                                                      structlist[i].type,
-                                                      NULL);
+              g_set_error (&file->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                           "cannot allocate heif_context");
+              continue;
             }
 
-          for (i = 0; xmp_data[i] != NULL; i++)
+          file->h_image = heifplugin_create_save_image (file->image,
+                                                        file->drawable,
+                                                        options,
+                                                        &file->error);
+          if (! file->h_image)
             {
-              if (! gexiv2_metadata_has_tag (new_g2metadata, xmp_data[i]) &&
-                  gimp_metadata_is_tag_supported (xmp_data[i], "image/heif"))
-                {
-                  heifplugin_image_metadata_copy_tag (GEXIV2_METADATA (metadata),
-                                                      new_g2metadata,
-                                                      xmp_data[i]);
-                }
+              heifplugin_save_file_clear (file);
+              continue;
             }
 
-          g_strfreev (xmp_data);
-
-          xmp_packet = gexiv2_metadata_try_generate_xmp_packet (new_g2metadata, GEXIV2_USE_COMPACT_FORMAT | GEXIV2_OMIT_ALL_FORMATTING, 0, NULL);
-          if (xmp_packet)
+          if (options->save_exif || options->save_xmp)
             {
-              int xmp_size = strlen (xmp_packet);
-              if (xmp_size > 0)
+              GimpMetadataSaveFlags metadata_flags;
+
+              metadata = gimp_image_metadata_save_prepare (file->image,
+                                                           mime_type,
+                                                           &metadata_flags);
+              if (metadata)
                 {
-                  heif_context_add_XMP_metadata (context, handle,
-                                                 xmp_packet, xmp_size);
+                  if (options->save_exif)
+                    file->exif = heifplugin_get_exif_data (metadata);
+
+                  if (options->save_xmp)
+                    file->xmp = heifplugin_get_xmp_packet (metadata);
+
+                  g_object_unref (metadata);
                 }
-              g_free (xmp_packet);
             }
-
-          g_object_unref (new_metadata);
         }
-    }
-
-  heif_image_handle_release (handle);
-
-  gimp_progress_update (0.66);
 
-  writer.writer_api_version = 1;
-  writer.write              = write_callback;
+      heifplugin_parallel_run (n_round, n_encoders,
+                               heifplugin_save_file_encode, &save);
 
-  output = G_OUTPUT_STREAM (g_file_replace (file,
-                                            NULL, FALSE, G_FILE_CREATE_NONE,
-                                            NULL, error));
-  if (! output)
-    {
-      heif_encoder_release (encoder);
-      heif_image_release (h_image);
-      heif_context_free (context);
-      return FALSE;
+      gimp_progress_update ((gdouble) (save.first + n_round) / n_files);
     }
 
-  err = heif_context_write (context, &writer, output);
-
-  if (err.code != 0)
-    {
-      GCancellable *cancellable = g_cancellable_new ();
-
-      g_cancellable_cancel (cancellable);
-      g_output_stream_close (output, cancellable, NULL);
-      g_object_unref (cancellable);
-
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   _("Writing HEIF image failed: %s"),
-                   err.message);
-
-      heif_encoder_release (encoder);
-      heif_image_release (h_image);
-      heif_context_free (context);
-      return FALSE;
-    }
+  for (i = 0; i < n_files; i++)
+    errors[i] = save.files[i].error;
 
-  g_object_unref (output);
+  while ((encoder = g_async_queue_try_pop (save.encoders)))
+    heif_encoder_release (encoder);
 
-  heif_encoder_release (encoder);
-  heif_image_release (h_image);
+  g_async_queue_unref (save.encoders);
+  g_free (save.files);
   heif_context_free (context);
 
   gimp_progress_update (1.0);
@@ -2238,57 +8339,108 @@ save_image (GFile                        *file,
   return TRUE;
 }
 
-
 /*  the load dialog  */
 
-#define MAX_THUMBNAIL_SIZE 320
+#define MAX_THUMBNAIL_SIZE    320
+#define MAX_CACHED_THUMBNAILS 128
+
+typedef enum
+{
+  THUMBNAIL_NONE,
+  THUMBNAIL_PENDING,
+  THUMBNAIL_LOADED
+} HeifThumbnailState;
 
 typedef struct _HeifImage HeifImage;
 
 struct _HeifImage
 {
-  uint32_t           ID;
-  gchar              caption[100];
-  struct heif_image *thumbnail;
-  gint               width;
-  gint               height;
+  uint32_t            ID;
+  gchar               caption[100];
+  HeifThumbnailState  state;
+  GList              *lru_link;
 };
 
-static gboolean
+typedef struct _HeifThumbnail HeifThumbnail;
+
+struct _HeifThumbnail
+{
+  gint               index;
+  gboolean           skipped;
+  struct heif_image *img;
+  GError            *error;
+};
+
+/* Only the thumbnails of the visible rows of the icon view (plus one
+ * screen worth of rows around them) are decoded. This happens on a
+ * thread pool, and the results are handed back to the main thread
+ * through a queue, which is drained from an idle handler that puts the
+ * finished pixbufs into the list store. The decoded pixbufs are kept in
+ * a bounded LRU, so memory use doesn't grow with the number of images.
+ *
+ * libheif doesn't support using one context from several threads, so
+ * each worker takes a context of its own from a queue of idle ones.
+ * The extra contexts parse the same memory as the dialog's context.
+ * Streams can't be read that way, their thumbnails are decoded on one
+ * thread with the dialog's context.
+ */
+typedef struct _HeifThumbnailLoader HeifThumbnailLoader;
+
+struct _HeifThumbnailLoader
+{
+  struct heif_context   *heif;
+  const HeifpluginInput *input;
+  HeifImage             *images;
+  gint                   n_images;
+  GtkListStore          *list_store;
+  GtkIconView           *icon_view;
+
+  GThreadPool           *pool;
+  GAsyncQueue           *queue;
+  GAsyncQueue           *contexts;  /* idle contexts for the workers */
+
+  /* the range of rows worth decoding, read by the workers */
+  gint                   first_wanted;
+  gint                   last_wanted;
+
+  /* indices of the loaded thumbnails, most recently visible first */
+  GQueue                 lru;
+
+  GMutex                 mutex;
+  guint                  idle_id;
+  gboolean               cancelled;
+};
+
+static HeifImage *
 load_thumbnails (struct heif_context *heif,
-                 HeifImage           *images)
+                 gint                *n_images)
 {
-  guint32 *IDs;
-  gint     n_images;
-  gint     i;
+  HeifImage *images;
+  guint32   *IDs;
+  gint       i;
 
-  n_images = heif_context_get_number_of_top_level_images (heif);
+  *n_images = heif_context_get_number_of_top_level_images (heif);
 
   /* get list of all (top level) image IDs */
 
-  IDs = g_alloca (n_images * sizeof (guint32));
+  IDs = g_new (guint32, *n_images);
 
-  heif_context_get_list_of_top_level_image_IDs (heif, IDs, n_images);
+  heif_context_get_list_of_top_level_image_IDs (heif, IDs, *n_images);
 
+  images = g_new0 (HeifImage, *n_images);
 
-  /* Load a thumbnail for each image. */
+  /* Generate a caption for each image, the thumbnails themselves are
+   * decoded on demand by the thumbnail loader.
+   */
 
-  for (i = 0; i < n_images; i++)
+  for (i = 0; i < *n_images; i++)
     {
       struct heif_image_handle *handle = NULL;
       struct heif_error         err;
       gint                      width;
       gint                      height;
-      struct heif_image_handle *thumbnail_handle = NULL;
-      heif_item_id              thumbnail_ID;
-      gint                      n_thumbnails;
-      struct heif_image        *thumbnail_img = NULL;
-      gint                      thumbnail_width;
-      gint                      thumbnail_height;
 
-      images[i].ID         = IDs[i];
-      images[i].caption[0] = 0;
-      images[i].thumbnail  = NULL;
+      images[i].ID = IDs[i];
 
       /* get image handle */
 
@@ -2315,108 +8467,419 @@ load_thumbnails (struct heif_context *heif,
                       "%dx%d", width, height);
         }
 
-      /* get handle to thumbnail image
-       *
-       * if there is no thumbnail image, just the the image itself
-       * (will be scaled down later)
-       */
+      heif_image_handle_release (handle);
+    }
+
+  g_free (IDs);
+
+  return images;
+}
+
+static void
+load_thumbnail_pixbuf_destroy (guchar   *pixels,
+                               gpointer  data)
+{
+  heif_image_release (data);
+}
+
+static void
+load_thumbnail_free (HeifThumbnail *thumbnail)
+{
+  if (thumbnail->img)
+    heif_image_release (thumbnail->img);
 
-      n_thumbnails = heif_image_handle_get_list_of_thumbnail_IDs (handle,
-                                                                  &thumbnail_ID,
-                                                                  1);
+  g_clear_error (&thumbnail->error);
 
-      if (n_thumbnails > 0)
+  g_slice_free (HeifThumbnail, thumbnail);
+}
+
+static void
+load_thumbnails_set_pixbuf (HeifThumbnailLoader *loader,
+                            gint                 index,
+                            GdkPixbuf           *pixbuf)
+{
+  GtkTreeIter iter;
+
+  if (gtk_tree_model_iter_nth_child (GTK_TREE_MODEL (loader->list_store),
+                                     &iter, NULL, index))
+    {
+      gtk_list_store_set (loader->list_store, &iter, 1, pixbuf, -1);
+    }
+}
+
+/* Drop the least recently visible thumbnails which are out of the
+ * wanted range until the cache is within its size limit again.
+ */
+static void
+load_thumbnails_trim_cache (HeifThumbnailLoader *loader)
+{
+  GList *list = loader->lru.tail;
+  gint   max_cached;
+
+  max_cached = MAX (MAX_CACHED_THUMBNAILS,
+                    loader->last_wanted - loader->first_wanted + 1);
+
+  while (list && loader->lru.length > max_cached)
+    {
+      GList *prev  = list->prev;
+      gint   index = GPOINTER_TO_INT (list->data);
+
+      if (index < loader->first_wanted || index > loader->last_wanted)
         {
-          err = heif_image_handle_get_thumbnail (handle, thumbnail_ID,
-                                                 &thumbnail_handle);
-          if (err.code)
-            {
-              gimp_message (err.message);
-              continue;
-            }
+          load_thumbnails_set_pixbuf (loader, index, NULL);
+
+          g_queue_delete_link (&loader->lru, list);
+
+          loader->images[index].lru_link = NULL;
+          loader->images[index].state    = THUMBNAIL_NONE;
         }
-      else
+
+      list = prev;
+    }
+}
+
+/* Queue the missing thumbnails of the wanted range, and mark the
+ * visible ones as recently used.
+ */
+static void
+load_thumbnails_update (HeifThumbnailLoader *loader)
+{
+  GtkTreePath *start_path;
+  GtkTreePath *end_path;
+  gint         first;
+  gint         last;
+  gint         margin;
+  gint         i;
+
+  if (loader->cancelled ||
+      ! gtk_icon_view_get_visible_range (loader->icon_view,
+                                         &start_path, &end_path))
+    return;
+
+  first = gtk_tree_path_get_indices (start_path)[0];
+  last  = gtk_tree_path_get_indices (end_path)[0];
+
+  gtk_tree_path_free (start_path);
+  gtk_tree_path_free (end_path);
+
+  margin = last - first + 1;
+
+  g_atomic_int_set (&loader->first_wanted, MAX (first - margin, 0));
+  g_atomic_int_set (&loader->last_wanted,
+                    MIN (last + margin, loader->n_images - 1));
+
+  for (i = last; i >= first; i--)
+    {
+      HeifImage *image = &loader->images[i];
+
+      if (image->lru_link)
         {
-          err = heif_context_get_image_handle (heif, IDs[i], &thumbnail_handle);
-          if (err.code)
-            {
-              gimp_message (err.message);
-              continue;
-            }
+          g_queue_unlink (&loader->lru, image->lru_link);
+          g_queue_push_head_link (&loader->lru, image->lru_link);
         }
+    }
 
-      /* decode the thumbnail image */
+  /* visible rows first, then the rows below and above them */
 
-      err = heif_decode_image (thumbnail_handle,
-                               &thumbnail_img,
-                               heif_colorspace_RGB,
-                               heif_chroma_interleaved_RGB,
-                               NULL);
-      if (err.code)
+  for (i = first; i <= loader->last_wanted; i++)
+    {
+      if (loader->images[i].state == THUMBNAIL_NONE)
         {
-          gimp_message (err.message);
-          continue;
+          loader->images[i].state = THUMBNAIL_PENDING;
+
+          g_thread_pool_push (loader->pool, GINT_TO_POINTER (i + 1), NULL);
+        }
+    }
+
+  for (i = first - 1; i >= loader->first_wanted; i--)
+    {
+      if (loader->images[i].state == THUMBNAIL_NONE)
+        {
+          loader->images[i].state = THUMBNAIL_PENDING;
+
+          g_thread_pool_push (loader->pool, GINT_TO_POINTER (i + 1), NULL);
         }
+    }
+
+  load_thumbnails_trim_cache (loader);
+}
+
+static gboolean
+load_thumbnails_idle (gpointer data)
+{
+  HeifThumbnailLoader *loader  = data;
+  HeifThumbnail       *thumbnail;
+  gboolean             skipped = FALSE;
 
-      /* if thumbnail image size exceeds the maximum, scale it down */
+  g_mutex_lock (&loader->mutex);
+  loader->idle_id = 0;
+  g_mutex_unlock (&loader->mutex);
+
+  while ((thumbnail = g_async_queue_try_pop (loader->queue)))
+    {
+      HeifImage *image = &loader->images[thumbnail->index];
 
-      thumbnail_width  = heif_image_handle_get_width  (thumbnail_handle);
-      thumbnail_height = heif_image_handle_get_height (thumbnail_handle);
+      if (thumbnail->skipped)
+        {
+          image->state = THUMBNAIL_NONE;
+          skipped      = TRUE;
+        }
+      else if (thumbnail->error)
+        {
+          /* don't try again */
+          image->state = THUMBNAIL_LOADED;
 
-      if (thumbnail_width  > MAX_THUMBNAIL_SIZE ||
-          thumbnail_height > MAX_THUMBNAIL_SIZE)
+          gimp_message (thumbnail->error->message);
+        }
+      else
         {
-          /* compute scaling factor to fit into a max sized box */
+          GdkPixbuf    *pixbuf;
+          const guint8 *pixels;
+          gint          stride;
+
+          pixels = heif_image_get_plane_readonly (thumbnail->img,
+                                                  heif_channel_interleaved,
+                                                  &stride);
+
+          /* the pixbuf takes over the HEIF image */
+
+          pixbuf = gdk_pixbuf_new_from_data (pixels,
+                                             GDK_COLORSPACE_RGB,
+                                             FALSE,
+                                             8,
+                                             heif_image_get_width  (thumbnail->img,
+                                                                    heif_channel_interleaved),
+                                             heif_image_get_height (thumbnail->img,
+                                                                    heif_channel_interleaved),
+                                             stride,
+                                             load_thumbnail_pixbuf_destroy,
+                                             thumbnail->img);
+          thumbnail->img = NULL;
+
+          load_thumbnails_set_pixbuf (loader, thumbnail->index, pixbuf);
+          g_object_unref (pixbuf);
+
+          image->state = THUMBNAIL_LOADED;
+
+          g_queue_push_head (&loader->lru, GINT_TO_POINTER (thumbnail->index));
+          image->lru_link = loader->lru.head;
+        }
+
+      load_thumbnail_free (thumbnail);
+    }
+
+  /* skipped rows may have become visible again in the meantime */
+  if (skipped)
+    load_thumbnails_update (loader);
+  else
+    load_thumbnails_trim_cache (loader);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Get an idle context, or parse the file into a new one. Runs on the
+ * workers.
+ */
+static struct heif_context *
+load_thumbnails_get_context (HeifThumbnailLoader *loader)
+{
+  struct heif_context *ctx;
+  const void          *data;
+
+  ctx = g_async_queue_try_pop (loader->contexts);
+  if (ctx)
+    return ctx;
+
+  /* only memory inputs get more than one worker */
+  if (loader->input->mapped_file)
+    data = g_mapped_file_get_contents (loader->input->mapped_file);
+  else
+    data = loader->input->file_buffer;
+
+  ctx = heif_context_alloc ();
+
+  if (ctx &&
+      heif_context_read_from_memory_without_copy (ctx, data,
+                                                  loader->input->file_size,
+                                                  NULL).code != 0)
+    {
+      g_clear_pointer (&ctx, heif_context_free);
+    }
+
+  /* the workers already keep the processors busy */
+  if (ctx)
+    heifplugin_set_decoding_threads (ctx, loader->input, 1);
+
+  return ctx;
+}
+
+static void
+load_thumbnails_worker (gpointer data,
+                        gpointer user_data)
+{
+  HeifThumbnailLoader      *loader = user_data;
+  HeifThumbnail            *thumbnail;
+  struct heif_context      *ctx;
+  struct heif_image_handle *handle = NULL;
+  struct heif_error         err;
+  gint                      index  = GPOINTER_TO_INT (data) - 1;
+
+  if (g_atomic_int_get (&loader->cancelled))
+    return;
 
-          gfloat factor_h = thumbnail_width  / (gfloat) MAX_THUMBNAIL_SIZE;
-          gfloat factor_v = thumbnail_height / (gfloat) MAX_THUMBNAIL_SIZE;
-          gint   new_width, new_height;
-          struct heif_image *scaled_img = NULL;
+  thumbnail = g_slice_new0 (HeifThumbnail);
+  thumbnail->index = index;
 
-          if (factor_v > factor_h)
+  if (index < g_atomic_int_get (&loader->first_wanted) ||
+      index > g_atomic_int_get (&loader->last_wanted))
+    {
+      /* scrolled out of view before we got to it */
+      thumbnail->skipped = TRUE;
+    }
+  else
+    {
+      /* decode the thumbnail image
+       *
+       * if there is no thumbnail image, just the the image itself
+       * (scaled down)
+       */
+
+      ctx = load_thumbnails_get_context (loader);
+
+      if (! ctx)
+        {
+          g_set_error_literal (&thumbnail->error, G_FILE_ERROR,
+                               G_FILE_ERROR_FAILED,
+                               "cannot allocate heif_context");
+        }
+      else
+        {
+          err = heif_context_get_image_handle (ctx,
+                                               loader->images[index].ID,
+                                               &handle);
+          if (err.code)
             {
-              new_height = MAX_THUMBNAIL_SIZE;
-              new_width  = thumbnail_width / factor_v;
+              g_set_error_literal (&thumbnail->error, G_FILE_ERROR,
+                                   G_FILE_ERROR_FAILED, err.message);
             }
           else
             {
-              new_height = thumbnail_height / factor_h;
-              new_width  = MAX_THUMBNAIL_SIZE;
+              thumbnail->img = heifplugin_decode_thumbnail (handle,
+                                                            MAX_THUMBNAIL_SIZE,
+                                                            FALSE,
+                                                            &thumbnail->error);
+
+              heif_image_handle_release (handle);
             }
 
-          /* scale the image */
+          g_async_queue_push (loader->contexts, ctx);
+        }
+    }
+
+  g_async_queue_push (loader->queue, thumbnail);
 
-          err = heif_image_scale_image (thumbnail_img,
-                                        &scaled_img,
-                                        new_width, new_height,
-                                        NULL);
-          if (err.code)
-            {
-              gimp_message (err.message);
-              continue;
-            }
+  g_mutex_lock (&loader->mutex);
 
-          /* release the old image and only keep the scaled down version */
+  if (! loader->idle_id && ! loader->cancelled)
+    loader->idle_id = g_idle_add (load_thumbnails_idle, loader);
 
-          heif_image_release (thumbnail_img);
-          thumbnail_img = scaled_img;
+  g_mutex_unlock (&loader->mutex);
+}
 
-          thumbnail_width  = new_width;
-          thumbnail_height = new_height;
-        }
+static HeifThumbnailLoader *
+load_thumbnails_start (struct heif_context   *heif,
+                       const HeifpluginInput *input,
+                       HeifImage             *images,
+                       gint                   n_images,
+                       GtkListStore          *list_store,
+                       GtkIconView           *icon_view)
+{
+  HeifThumbnailLoader *loader = g_new0 (HeifThumbnailLoader, 1);
+  gint                 max_threads;
+
+  loader->heif         = heif;
+  loader->input        = input;
+  loader->images       = images;
+  loader->n_images     = n_images;
+  loader->list_store   = g_object_ref (list_store);
+  loader->icon_view    = icon_view;
+  loader->queue        = g_async_queue_new ();
+  loader->first_wanted = 0;
+  loader->last_wanted  = -1;
+  loader->idle_id      = 0;
+  loader->cancelled    = FALSE;
+  g_queue_init (&loader->lru);
+  g_mutex_init (&loader->mutex);
+
+  loader->contexts = g_async_queue_new ();
+  g_async_queue_push (loader->contexts, heif);
+
+  if (input->stream)
+    max_threads = 1;
+  else
+    max_threads = heifplugin_get_num_threads ();
 
-      heif_image_handle_release (thumbnail_handle);
-      heif_image_handle_release (handle);
+  loader->pool = g_thread_pool_new (load_thumbnails_worker, loader,
+                                    MIN (max_threads, n_images),
+                                    FALSE, NULL);
+
+  load_thumbnails_update (loader);
+
+  return loader;
+}
+
+/* Stop decoding and free loader. Disconnects the loader's signal
+ * handlers from the icon view and its adjustment.
+ */
+static void
+load_thumbnails_stop (HeifThumbnailLoader *loader)
+{
+  HeifThumbnail       *thumbnail;
+  struct heif_context *ctx;
+
+  g_signal_handlers_disconnect_by_data (gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (loader->icon_view)),
+                                        loader);
+  g_signal_handlers_disconnect_by_data (loader->icon_view, loader);
+
+  g_atomic_int_set (&loader->cancelled, TRUE);
+
+  /* drop the pending jobs, but wait for the running ones, they still
+   * use the HEIF context
+   */
+  g_thread_pool_free (loader->pool, TRUE, TRUE);
+
+  g_mutex_lock (&loader->mutex);
+
+  if (loader->idle_id)
+    g_source_remove (loader->idle_id);
 
-      /* remember the HEIF thumbnail image (we need it for the GdkPixbuf) */
+  loader->idle_id = 0;
 
-      images[i].thumbnail = thumbnail_img;
+  g_mutex_unlock (&loader->mutex);
 
-      images[i].width  = thumbnail_width;
-      images[i].height = thumbnail_height;
+  while ((thumbnail = g_async_queue_try_pop (loader->queue)))
+    load_thumbnail_free (thumbnail);
+
+  /* the dialog's own context goes back to the caller */
+  while ((ctx = g_async_queue_try_pop (loader->contexts)))
+    {
+      if (ctx != loader->heif)
+        heif_context_free (ctx);
     }
 
-  return TRUE;
+  g_queue_clear (&loader->lru);
+  g_async_queue_unref (loader->contexts);
+  g_async_queue_unref (loader->queue);
+  g_mutex_clear (&loader->mutex);
+  g_object_unref (loader->list_store);
+
+  g_free (loader);
+}
+
+static void
+load_dialog_visible_range_changed (HeifThumbnailLoader *loader)
+{
+  load_thumbnails_update (loader);
 }
 
 static void
@@ -2428,29 +8891,26 @@ load_dialog_item_activated (GtkIconView *icon_view,
 }
 
 static gboolean
-load_dialog (struct heif_context *heif,
-             uint32_t            *selected_image)
-{
-  GtkWidget       *dialog;
-  GtkWidget       *main_vbox;
-  GtkWidget       *frame;
-  HeifImage       *heif_images;
-  GtkListStore    *list_store;
-  GtkTreeIter      iter;
-  GtkWidget       *scrolled_window;
-  GtkWidget       *icon_view;
-  GtkCellRenderer *renderer;
-  gint             n_images;
-  gint             i;
-  gint             selected_idx = -1;
-  gboolean         run          = FALSE;
-
-  n_images = heif_context_get_number_of_top_level_images (heif);
-
-  heif_images = g_alloca (n_images * sizeof (HeifImage));
-
-  if (! load_thumbnails (heif, heif_images))
-    return FALSE;
+load_dialog (struct heif_context   *heif,
+             const HeifpluginInput *input,
+             uint32_t              *selected_image)
+{
+  GtkWidget           *dialog;
+  GtkWidget           *main_vbox;
+  GtkWidget           *frame;
+  HeifImage           *heif_images;
+  HeifThumbnailLoader *loader;
+  GtkListStore        *list_store;
+  GtkTreeIter          iter;
+  GtkWidget           *scrolled_window;
+  GtkWidget           *icon_view;
+  GtkCellRenderer     *renderer;
+  gint                 n_images;
+  gint                 i;
+  gint                 selected_idx = -1;
+  gboolean             run          = FALSE;
+
+  heif_images = load_thumbnails (heif, &n_images);
 
   dialog = gimp_dialog_new (_("Load HEIF Image"), PLUG_IN_BINARY,
                             NULL, 0,
@@ -2476,28 +8936,8 @@ load_dialog (struct heif_context *heif,
 
   for (i = 0; i < n_images; i++)
     {
-      GdkPixbuf    *pixbuf;
-      const guint8 *data;
-      gint          stride;
-
       gtk_list_store_append (list_store, &iter);
       gtk_list_store_set (list_store, &iter, 0, heif_images[i].caption, -1);
-
-      data = heif_image_get_plane_readonly (heif_images[i].thumbnail,
-                                            heif_channel_interleaved,
-                                            &stride);
-
-      pixbuf = gdk_pixbuf_new_from_data (data,
-                                         GDK_COLORSPACE_RGB,
-                                         FALSE,
-                                         8,
-                                         heif_images[i].width,
-                                         heif_images[i].height,
-                                         stride,
-                                         NULL,
-                                         NULL);
-
-      gtk_list_store_set (list_store, &iter, 1, pixbuf, -1);
     }
 
   scrolled_window = gtk_scrolled_window_new (NULL, NULL);
@@ -2513,7 +8953,12 @@ load_dialog (struct heif_context *heif,
   gtk_container_add (GTK_CONTAINER (scrolled_window), icon_view);
   gtk_widget_show (icon_view);
 
+  /* the cells don't change size when their thumbnails are loaded or
+   * dropped, so the visible range is stable
+   */
   renderer = gtk_cell_renderer_pixbuf_new ();
+  gtk_cell_renderer_set_fixed_size (renderer,
+                                    MAX_THUMBNAIL_SIZE, MAX_THUMBNAIL_SIZE);
   gtk_cell_layout_pack_start (GTK_CELL_LAYOUT (icon_view), renderer, FALSE);
   gtk_cell_layout_set_attributes (GTK_CELL_LAYOUT (icon_view), renderer,
                                   "pixbuf", 1,
@@ -2535,6 +8980,19 @@ load_dialog (struct heif_context *heif,
                     G_CALLBACK (load_dialog_item_activated),
                     dialog);
 
+  /* decode the thumbnails of the visible rows while the dialog is up */
+
+  loader = load_thumbnails_start (heif, input, heif_images, n_images,
+                                  list_store, GTK_ICON_VIEW (icon_view));
+
+  g_signal_connect_swapped (gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (icon_view)),
+                            "value-changed",
+                            G_CALLBACK (load_dialog_visible_range_changed),
+                            loader);
+  g_signal_connect_swapped (icon_view, "size-allocate",
+                            G_CALLBACK (load_dialog_visible_range_changed),
+                            loader);
+
   /* pre-select the primary image */
 
   for (i = 0; i < n_images; i++)
@@ -2551,6 +9009,8 @@ load_dialog (struct heif_context *heif,
       GtkTreePath *path = gtk_tree_path_new_from_indices (selected_idx, -1);
 
       gtk_icon_view_select_path (GTK_ICON_VIEW (icon_view), path);
+      gtk_icon_view_scroll_to_path (GTK_ICON_VIEW (icon_view), path,
+                                    FALSE, 0.0, 0.0);
       gtk_tree_path_free (path);
     }
 
@@ -2576,12 +9036,12 @@ load_dialog (struct heif_context *heif,
         }
     }
 
-  gtk_widget_destroy (dialog);
+  load_thumbnails_stop (loader);
 
-  /* release thumbnail images */
+  gtk_widget_destroy (dialog);
+  g_object_unref (list_store);
 
-  for (i = 0 ; i < n_images; i++)
-    heif_image_release (heif_images[i].thumbnail);
+  g_free (heif_images);
 
   return run;
 }
@@ -2609,7 +9069,7 @@ save_dialog (GimpProcedure *procedure,
 
   dialog = gimp_procedure_dialog_new (procedure,
                                       GIMP_PROCEDURE_CONFIG (config),
-                                      g_strcmp0 (gimp_procedure_get_name (procedure), SAVE_PROC_AV1) == 0 ?
+                                      g_str_has_prefix (gimp_procedure_get_name (procedure), SAVE_PROC_AV1) ?
                                       _("Export Image as AVIF") : _("Export Image as HEIF"));
 
   main_vbox = gtk_box_new (GTK_ORIENTATION_VERTICAL, 12);